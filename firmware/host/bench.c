@@ -0,0 +1,428 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * MIDI byte parser benchmark
+ *
+ * Feeds representative byte streams through midi_receive() on the
+ * host build and reports throughput and per-byte cost. Each call is
+ * timed individually with the time stamp counter (or the monotonic
+ * clock where none is available). Queued events are drained outside
+ * the timed region.
+ *
+ * The per-byte tail figures use the cheapest of all rounds at each
+ * stream position, which discards host interrupts and scheduling while
+ * keeping the slowest path through the parser.
+ *
+ * The reference clock handler timer_update() is timed in the same way
+ * for a set of output configurations, one call per 96ppq tick.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "stm32f3xx.h"
+#include "midi.h"
+#include "midi_event.h"
+#include "settings.h"
+#include "timer.h"
+
+#define BENCH_BYTES	(1U << 20)
+#define BENCH_ROUNDS	5U
+#define BENCH_TICKS	(96U * 1024U)
+
+// Byte on a cable
+struct bench_byte {
+	uint8_t cable;
+	uint8_t val;
+};
+
+// Input stream
+struct bench_stream {
+	const char *name;
+	uint32_t (*fill)(struct bench_byte * buf, uint32_t len);
+};
+
+// Result of one stream
+struct bench_result {
+	uint64_t bytes;
+	uint64_t events;
+	uint64_t ticks;
+	uint64_t best;
+	uint64_t worst;
+	uint64_t p999;
+	uint64_t p50;
+};
+
+static struct bench_byte stream[BENCH_BYTES];
+static uint32_t cost[BENCH_BYTES];
+
+// Read a fine-grained time stamp
+static inline uint64_t bench_stamp(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000U + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+// Return wall clock in ns
+static uint64_t bench_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000U + (uint64_t) ts.tv_nsec;
+}
+
+// Estimate stamp ticks per second
+static double bench_rate(void)
+{
+	uint64_t n0 = bench_ns();
+	uint64_t s0 = bench_stamp();
+	uint64_t n1;
+	do {
+		n1 = bench_ns();
+	} while (n1 - n0 < 100000000U);
+	uint64_t s1 = bench_stamp();
+	return (double)(s1 - s0) * 1e9 / (double)(n1 - n0);
+}
+
+// Estimate stamp overhead of an empty timed region
+static uint64_t bench_overhead(void)
+{
+	uint64_t best = UINT64_MAX;
+	uint32_t i = 0;
+	do {
+		uint64_t t0 = bench_stamp();
+		barrier();
+		uint64_t t1 = bench_stamp();
+		if (t1 - t0 < best)
+			best = t1 - t0;
+		++i;
+	} while (i < 10000U);
+	return best;
+}
+
+// Append a byte to stream buffer, return new length
+static uint32_t put(struct bench_byte *buf, uint32_t pos, uint32_t len,
+		    uint32_t cable, uint32_t val)
+{
+	if (pos < len) {
+		buf[pos].cable = (uint8_t) cable;
+		buf[pos].val = (uint8_t) val;
+		++pos;
+	}
+	return pos;
+}
+
+// Dense running-status note on/off (velocity 0) on the UART cable
+static uint32_t fill_notes(struct bench_byte *buf, uint32_t len)
+{
+	uint32_t pos = put(buf, 0, len, MIDI_CABLE_UART, MIDI_STATUS_NOTEON);
+	uint32_t n = 0;
+	while (pos + 4U <= len) {
+		uint32_t note = 36U + (n % 48U);
+		pos = put(buf, pos, len, MIDI_CABLE_UART, note);
+		pos = put(buf, pos, len, MIDI_CABLE_UART, 100U);
+		pos = put(buf, pos, len, MIDI_CABLE_UART, note);
+		pos = put(buf, pos, len, MIDI_CABLE_UART, 0U);
+		++n;
+	}
+	return pos;
+}
+
+// Running-status controller sweeps across several controllers
+static uint32_t fill_ctrl(struct bench_byte *buf, uint32_t len)
+{
+	uint32_t pos = put(buf, 0, len, MIDI_CABLE_UART, MIDI_STATUS_CONTROL);
+	uint32_t n = 0;
+	while (pos + 2U <= len) {
+		pos = put(buf, pos, len, MIDI_CABLE_UART, 1U + ((n >> 7) & 7U));
+		pos = put(buf, pos, len, MIDI_CABLE_UART, n & 0x7fU);
+		++n;
+	}
+	return pos;
+}
+
+// Channel and common messages without running status, with timing
+// clock and active sense between messages
+static uint32_t fill_status(struct bench_byte *buf, uint32_t len)
+{
+	static const uint8_t msg[][3] = {
+		{ MIDI_STATUS_NOTEON | 9U, 36U, 100U },
+		{ MIDI_STATUS_CONTROL, 1U, 64U },
+		{ MIDI_STATUS_NOTEOFF | 9U, 36U, 0U },
+		{ MIDI_STATUS_PROGRAM | 2U, 5U, 0U },
+		{ MIDI_STATUS_BENDER, 0U, 64U },
+		{ MIDI_STATUS_SPP, 16U, 0U },
+		{ MIDI_STATUS_CHANPRESS | 1U, 90U, 0U },
+		{ MIDI_STATUS_SONGSEL, 3U, 0U },
+	};
+	uint32_t pos = 0;
+	uint32_t n = 0;
+	while (pos + 5U <= len) {
+		const uint8_t *m = msg[n % ARRAY_SIZE(msg)];
+		uint32_t bytes = (m[0] & MIDI_STATUS_MASK) == MIDI_STATUS_PROGRAM
+		    || (m[0] & MIDI_STATUS_MASK) == MIDI_STATUS_CHANPRESS
+		    || m[0] == MIDI_STATUS_SONGSEL ? 1U : 2U;
+		pos = put(buf, pos, len, MIDI_CABLE_UART, m[0]);
+		pos = put(buf, pos, len, MIDI_CABLE_UART, m[1]);
+		if (bytes == 2U) {
+			pos = put(buf, pos, len, MIDI_CABLE_UART, m[2]);
+		}
+		pos = put(buf, pos, len, MIDI_CABLE_UART,
+			  (n & 1U) ? MIDI_RT_SENSE : MIDI_RT_CLOCK);
+		++n;
+	}
+	return pos;
+}
+
+// SysEx messages with timing clock interleaved every 8 bytes
+static uint32_t fill_sysclk(struct bench_byte *buf, uint32_t len)
+{
+	uint32_t pos = 0;
+	while (pos + 48U + 6U <= len) {
+		pos = put(buf, pos, len, MIDI_CABLE_UART, MIDI_STATUS_SYSTEM);
+		uint32_t i = 0;
+		do {
+			if ((i & 7U) == 7U) {
+				pos = put(buf, pos, len, MIDI_CABLE_UART,
+					  MIDI_RT_CLOCK);
+			}
+			pos = put(buf, pos, len, MIDI_CABLE_UART,
+				  (i * 7U) & 0x7fU);
+			++i;
+		} while (i < 40U);
+		pos = put(buf, pos, len, MIDI_CABLE_UART, MIDI_STATUS_EOX);
+	}
+	return pos;
+}
+
+// Back-to-back maximum length SysEx alternating between cables
+static uint32_t fill_sysex(struct bench_byte *buf, uint32_t len)
+{
+	uint32_t pos = 0;
+	uint32_t cable = MIDI_CABLE_UART;
+	while (pos + MIDI_MAX_SYSEX + 2U <= len) {
+		pos = put(buf, pos, len, cable, MIDI_STATUS_SYSTEM);
+		uint32_t i = 0;
+		do {
+			pos = put(buf, pos, len, cable, (i * 3U) & 0x7fU);
+			++i;
+		} while (i < MIDI_MAX_SYSEX);
+		pos = put(buf, pos, len, cable, MIDI_STATUS_EOX);
+		cable = cable == MIDI_CABLE_UART ? MIDI_CABLE_USB
+		    : MIDI_CABLE_UART;
+	}
+	return pos;
+}
+
+static const struct bench_stream streams[] = {
+	{ "notes", fill_notes },
+	{ "ctrl", fill_ctrl },
+	{ "status", fill_status },
+	{ "sysex+clock", fill_sysclk },
+	{ "sysex 46x2", fill_sysex },
+};
+
+// Output configuration for clock handler
+struct bench_outputs {
+	const char *name;
+	struct output_config output[SETTINGS_NROUTS];
+};
+
+static const struct bench_outputs outputs[] = {
+	{ "tim2 idle", {
+		{ 0, 1, 0, 0 }, { 0, 1, 0, 0 }, { 0, 1, 0, 0 },
+		{ 0, 1, 0, 0 }, { 0, 1, 0, 0 }, { 0, 1, 0, 0 } } },
+	{ "tim2 1 clk", {
+		{ SETTING_CLOCK, SETTING_24PPQ, 0, 0 }, { 0, 1, 0, 0 },
+		{ 0, 1, 0, 0 }, { 0, 1, 0, 0 }, { 0, 1, 0, 0 },
+		{ 0, 1, 0, 0 } } },
+	{ "tim2 6 clk", {
+		{ SETTING_CLOCK, SETTING_24PPQ, 0, 0 },
+		{ SETTING_CLOCK, SETTING_32ND, 1, 0 },
+		{ SETTING_CLOCK, SETTING_16TH, 3, 0 },
+		{ SETTING_CLOCK, SETTING_8TH, 0, 0 },
+		{ SETTING_CLOCK | SETTING_TRIG, SETTING_BEAT, 7, 0 },
+		{ SETTING_CLOCK, SETTING_BAR, 0, 0 } } },
+	{ "tim2 6 odd", {
+		{ SETTING_CLOCK, 5, 0, 0 },
+		{ SETTING_CLOCK, 7, 2, 0 },
+		{ SETTING_CLOCK, 11, 0, 0 },
+		{ SETTING_CLOCK, 13, 4, 0 },
+		{ SETTING_CLOCK, 17, 0, 0 },
+		{ SETTING_CLOCK, 19, 9, 0 } } },
+};
+
+// Release all queued events, return count
+static uint32_t drain(void)
+{
+	struct midi_event *evt;
+	uint32_t count = 0;
+	while ((evt = midi_event_poll()) != NULL) {
+		if ((evt->evt.raw.header & MIDI_CIN_MASK) == MIDI_CIN_EOX_3) {
+			midi_sysex_done(evt);
+		}
+		midi_event_done();
+		++count;
+	}
+	return count;
+}
+
+static int cmp_cost(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Feed a stream once, keeping the lowest cost seen for each byte
+static void run(uint32_t len, uint64_t overhead, struct bench_result *res)
+{
+	uint64_t ticks = 0;
+	uint32_t i = 0;
+	midi_reset(MIDI_CABLE_UART);
+	midi_reset(MIDI_CABLE_USB);
+	do {
+		uint32_t cable = stream[i].cable;
+		uint32_t val = stream[i].val;
+		uint64_t t0 = bench_stamp();
+		midi_receive(cable, val, (uint32_t) t0);
+		uint64_t t1 = bench_stamp();
+		uint64_t dt = t1 - t0;
+		dt = dt > overhead ? dt - overhead : 0U;
+		if (dt < cost[i])
+			cost[i] = (uint32_t) dt;
+		ticks += dt;
+		res->events += drain();
+		++i;
+	} while (i < len);
+	res->bytes += len;
+	res->ticks += ticks;
+	if (ticks < res->best)
+		res->best = ticks;
+}
+
+// Run the clock handler once per tick, keeping the lowest cost seen
+static void run_timer(uint64_t overhead, struct bench_result *res)
+{
+	uint64_t ticks = 0;
+	uint32_t i = 0;
+	timer_preroll();
+	timer.on = 1U;
+	do {
+		uint64_t t0 = bench_stamp();
+		timer_update();
+		uint64_t t1 = bench_stamp();
+		uint64_t dt = t1 - t0;
+		dt = dt > overhead ? dt - overhead : 0U;
+		if (dt < cost[i])
+			cost[i] = (uint32_t) dt;
+		ticks += dt;
+		host_sync();
+		++i;
+	} while (i < BENCH_TICKS);
+	res->events += BENCH_TICKS;
+	res->ticks += ticks;
+	if (ticks < res->best)
+		res->best = ticks;
+}
+
+// Set tail figures from the per-byte costs
+static void tail(uint32_t len, struct bench_result *res)
+{
+	qsort(cost, len, sizeof(cost[0]), cmp_cost);
+	res->worst = cost[len - 1U];
+	res->p50 = cost[len / 2U];
+	res->p999 = cost[(uint32_t) ((uint64_t) len * 999U / 1000U)];
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t rounds = BENCH_ROUNDS;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			rounds = (uint32_t) strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-r rounds]\n", argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (rounds == 0U) {
+		rounds = 1U;
+	}
+
+	host_init();
+	uptime_init();
+	firmware_main();
+	host_sync();
+
+	double rate = bench_rate();
+	uint64_t overhead = bench_overhead();
+	printf("stamp %.3f GHz, overhead %llu ticks, %u rounds\n",
+	       rate / 1e9, (unsigned long long)overhead, rounds);
+	printf("%-12s %10s %10s %8s %8s %8s %8s %8s\n", "stream", "Mbyte/s",
+	       "Mevent/s", "mean ns", "best ns", "p50 ns", "p99.9 ns",
+	       "max ns");
+
+	uint32_t s = 0;
+	do {
+		struct bench_result res;
+		memset(&res, 0, sizeof(res));
+		res.best = UINT64_MAX;
+		uint32_t len = streams[s].fill(stream, BENCH_BYTES);
+		memset(cost, 0xff, sizeof(cost));
+		uint32_t r = 0;
+		do {
+			run(len, overhead, &res);
+			++r;
+		} while (r < rounds);
+		tail(len, &res);
+		double secs = (double)res.ticks / rate;
+		printf("%-12s %10.2f %10.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+		       streams[s].name, (double)res.bytes / secs / 1e6,
+		       (double)res.events / secs / 1e6,
+		       secs * 1e9 / (double)res.bytes,
+		       (double)res.best * 1e9 / rate / (double)len,
+		       (double)res.p50 * 1e9 / rate,
+		       (double)res.p999 * 1e9 / rate,
+		       (double)res.worst * 1e9 / rate);
+		++s;
+	} while (s < ARRAY_SIZE(streams));
+
+	printf("%-12s %10s %10s %8s %8s %8s %8s %8s\n", "handler", "",
+	       "Mcall/s", "mean ns", "best ns", "p50 ns", "p99.9 ns",
+	       "max ns");
+	s = 0;
+	do {
+		struct bench_result res;
+		memset(&res, 0, sizeof(res));
+		res.best = UINT64_MAX;
+		memcpy(config.output, outputs[s].output, sizeof(config.output));
+		timer_reload();
+		memset(cost, 0xff, sizeof(cost));
+		uint32_t r = 0;
+		do {
+			run_timer(overhead, &res);
+			++r;
+		} while (r < rounds);
+		tail(BENCH_TICKS, &res);
+		double secs = (double)res.ticks / rate;
+		printf("%-12s %10s %10.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+		       outputs[s].name, "", (double)res.events / secs / 1e6,
+		       secs * 1e9 / (double)res.events,
+		       (double)res.best * 1e9 / rate / BENCH_TICKS,
+		       (double)res.p50 * 1e9 / rate,
+		       (double)res.p999 * 1e9 / rate,
+		       (double)res.worst * 1e9 / rate);
+		++s;
+	} while (s < ARRAY_SIZE(outputs));
+	return 0;
+}
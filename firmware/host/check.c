@@ -0,0 +1,2270 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Host build checks
+ *
+ * Runs the firmware against the peripheral model and checks results
+ * that the simulator and benchmark only measure. Each check prints
+ * its name and outcome, and the exit status is the count of failures.
+ *
+ * crc7: sysex messages of random length and content are parsed with
+ * the CRC-7 taken from the table and from the CRC peripheral model in
+ * turn, and the remainders passed on with the message must agree,
+ * and match the CRC-7/MMC check value.
+ *
+ * classify: random bytes in runs of random status byte density are
+ * parsed on the UART cable with every code index passed, and each
+ * event queued must be the one expected by a reference receiver
+ * written from the status switch that the classification table
+ * replaced, stamped with the byte that completed it. Runs of data
+ * bytes overrun the sysex buffer now and then, and the link goes quiet
+ * past the sense timeout to release a sysex buffer held by a message
+ * cut short.
+ *
+ * uartrx: random bytes as for classify are delivered to the UART5
+ * receive interrupt, one in CHECK_UARTRX_ERROR with a framing error,
+ * with channel pressure and real time messages filtered out. PendSV
+ * is taken some bytes after it is raised, and the line falls idle now
+ * and then while the idle interrupt is enabled. A byte completing a
+ * message that passes the filter must raise PendSV. Sysex data and
+ * filtered voice messages must not, until the ring is half full, and
+ * then must. No byte may be left in the ring without PendSV or the
+ * idle interrupt to parse it. Events parsed must be those of the reference receiver,
+ * in order within each event queue lane, stamped when their last byte
+ * arrived.
+ *
+ * lanes: CHECK_LANES_NOTES note ons are parsed with start, a run of
+ * clocks, stop, another run and continue mixed in at random, before
+ * any are taken. The transport messages and one event per run of
+ * clocks, counting its pulses, must be taken in order ahead of the
+ * first notes to fill the voice lane, with the rest dropped. Start
+ * and stop then alternate into a real time lane full of clocks and
+ * song positions, and must all be taken, in order.
+ *
+ * overflow: two controllers sweep CHECK_OVERFLOW_VALUES values each,
+ * interleaved with a note halfway, into the parser. Without
+ * coalescing only the first values to fill the voice lane are kept.
+ * With it nothing is dropped, each controller ends on its last value
+ * before and after the note, in order, and the lane peaks at three
+ * more than half its depth, also at a run time depth of
+ * 1 << CHECK_OVERFLOW_BITS.
+ *
+ * filter: on the default filter, CHECK_FILTER_MSGS channel pressure
+ * and pitch bend messages are parsed with a note every
+ * CHECK_FILTER_NOTE pairs. The notes must be the only events queued,
+ * and none may be dropped.
+ *
+ * notes: the outputs are given random note and controller configs
+ * sharing a few numbers, by config message on the UART cable, and
+ * random note messages on those numbers are handled. After each the
+ * output pins must be those set and cleared by the loop over outputs
+ * that the note lookup table replaced.
+ *
+ * ctrl: the outputs are configured as for notes, and random controller
+ * changes on the shared numbers are handled. After each the output
+ * pins, divisors and offsets must be those of a reference model of the
+ * loop over outputs that the controller actions replaced, including
+ * 14 bit values set in two parts.
+ *
+ * edges: the outputs are given random clock configs with divisors of
+ * up to 14 bits, and the reference clock is ticked through its update
+ * handler. Now and then an output is reconfigured, a controller
+ * changes a divisor or offset, the timer is rolled back for a start,
+ * or the run state changes. After each tick the output word prepared
+ * must be the one given by the per-tick modulo arithmetic that the
+ * edge counters replaced, with run masked outputs held off while
+ * stopped. Most configs must be too varied for an edge schedule.
+ *
+ * sched: as edges, with divisors at note lengths, and most configs
+ * must fit an edge schedule, so that the output words come from the
+ * schedule compiled and switched in while running.
+ *
+ * merge: note messages are sent byte by byte to UART5 and in bulk
+ * transfers of random length to the USB-MIDI endpoint, while the
+ * event queue is drained. Either receive interrupt is taken at random
+ * points, between polls and at any barrier() inside them while its
+ * interrupt is enabled, and now and then both send in a burst that
+ * fills the UART ring and both endpoint buffers. UART bytes are held
+ * back rather than overrun the ring. Every message must come out
+ * once, in the order sent on its cable, and the two cables merged in
+ * stamp order.
+ *
+ * ump: event packets of each kind are converted to universal MIDI
+ * packets and compared with the expected words, and sysex messages of
+ * every length up to CHECK_UMP_SYSEX data bytes are split into event
+ * packets as the device sends them, converted, and must come out as
+ * one ONLY packet or START, CONT and END packets carrying the same
+ * data.
+ *
+ * usbin: note packets are sent to the host in groups while the
+ * USB-MIDI IN endpoint is read only now and then. A group goes whole
+ * into the buffer not being sent or is refused, one that would not
+ * fit a buffer is always refused, and the buffer gathered is handed
+ * over as the other is read, so that every packet taken is read once
+ * and in order.
+ *
+ * update, in builds with SYSEX_UPDATE: a three page image is sent on
+ * the UART cable in data messages of part of a page, one of them first
+ * with a bad CRC-7, while the deadline wheel runs a pass a millisecond.
+ * Chunks sent before their page buffer is written are rejected and
+ * sent again later. Status replies are read from the USB-MIDI IN
+ * endpoint left configured by the usbin check, and must count the
+ * bytes accepted and the chunks dropped, the last before reset in
+ * state UPDATE_RESET. After commit the update pages must hold the
+ * image and the commit record its size and CRC-32, the application
+ * pages must be untouched, and the device must have been reset once.
+ * The boot copy of loader.s is then run as a C stand-in, first cut
+ * short after a page as if by power loss and then to the end, and the
+ * application pages must hold the image with the record cleared.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "stm32f3xx.h"
+#include "midi.h"
+#include "midi_event.h"
+#include "midi_uart.h"
+#include "midi_ump.h"
+#include "midi_usb.h"
+#include "flash.h"
+#include "settings.h"
+#include "usb.h"
+#include "output.h"
+#include "update.h"
+#include "timer.h"
+
+#define CHECK_CRC7_MSGS	4096U
+#define CHECK_CRC7_SUM	0x75U	// CRC-7/MMC of "123456789"
+#define CHECK_NONRT	0x7eU	// universal non-real time sysex ID
+#define CHECK_CLASSIFY_BYTES	200000U	// random bytes parsed
+#define CHECK_CLASSIFY_RUN	64U	// bytes of like status density
+#define CHECK_UARTRX_ERROR	512U	// 1 in n bytes with a framing error
+#define CHECK_UARTRX_EXPECT	128U	// events expected and not yet parsed
+#define CHECK_LANES_NOTES	40U	// note ons sent with transport
+#define CHECK_LANES_CLOCKS	12U	// clocks in each run
+#define CHECK_LANES_VOICE	16U	// 1 << RCVBUFBITS
+#define CHECK_LANES_RT	8U	// 1 << RTBUFBITS
+#define CHECK_OVERFLOW_VALUES	64U	// values in each controller sweep
+#define CHECK_OVERFLOW_CTRL1	1U	// modulation wheel
+#define CHECK_OVERFLOW_CTRL2	7U	// channel volume
+#define CHECK_OVERFLOW_NOTE	60U	// note halfway through the sweep
+#define CHECK_OVERFLOW_BITS	3U	// reduced voice depth in bits
+#define CHECK_FILTER_MSGS	200U	// filtered messages of each kind
+#define CHECK_FILTER_NOTE	20U	// a note every n pairs
+#define CHECK_SENSE_POLL	(MIDI_SENSE_TIMEOUT >> 3)	// MIDI_SENSE_POLL
+#define CHECK_CONFIG_OUTPUT	0x05U	// output config command
+#define CHECK_OUTPUT_CONFIGS	500U	// random output configs
+#define CHECK_OUTPUT_MSGS	64U	// messages sent to each config
+#define CHECK_CLOCK_CONFIGS	300U	// random clock configs
+#define CHECK_CLOCK_TICKS	4096U	// reference clock ticks per config
+#define CHECK_CLOCK_CHANGE	256U	// 1 in n ticks changes the config
+#define CHECK_SCHEDLEN	256U	// TIMER_SCHEDLEN
+#define CHECK_SCHEDMAX	0x10000U	// TIMER_SCHEDMAX
+#define CHECK_USBADDR	1U
+#define CHECK_MERGE_MSGS	20000U	// note messages on each cable
+#define CHECK_MERGE_PREEMPT	8U	// 1 in n barriers takes an interrupt
+#define CHECK_MERGE_STEPS	(64U * CHECK_MERGE_MSGS)	// before a stall
+#define CHECK_UART_RXLEN	64U	// MIDI_UART_RXLEN
+#define CHECK_UART_OVERRUN	25U	// MIDI_UART_OVERRUN breakpoint
+#define CHECK_UMP_SYSEX	40U	// longest sysex data converted
+#define CHECK_USBIN_WORDS	(USB_ENDPOINT_SIZE / 4U)	// packets per buffer
+#define CHECK_USBIN_STEPS	4096U	// groups sent
+#define CHECK_UPDATE_SIZE	(2U * FLASH_PAGESZ + 256U)	// image bytes
+#define CHECK_UPDATE_CHUNK	512U	// image bytes per data message
+#define CHECK_UPDATE_BAD	1U	// chunk first sent with a bad CRC-7
+#define CHECK_UPDATE_STEPS	(4U * FLASH_PAGESZ)	// passes per page
+#define CHECK_UPDATE_REJECT	40U	// UPDATE_REJECT breakpoint
+#define CHECK_UPDATE_FAIL	41U	// UPDATE_FAIL breakpoint
+#define CHECK_UPDATE_REPLY	8U	// UPDATE_STATUS reply bytes with CRC-7
+
+// Named check, run returns non-zero on failure
+struct check {
+	const char *name;
+	int (*run)(void);
+};
+
+static uint32_t seed = 1U;
+
+// Note messages sent and received on each cable, by cable number
+static struct check_merge {
+	uint32_t sent[2];	// messages sent, whole for USB
+	uint32_t bytes;		// bytes of the UART message sent
+	uint32_t got[2];	// messages received in order
+	uint32_t stamp;		// stamp of the last message received
+	uint32_t stamped;	// a message has been received
+	uint32_t active;	// receive interrupt running
+	uint32_t fail;
+} merge;
+
+// Reference receiver, running status and sysex on the UART cable
+static struct check_parse {
+	uint32_t status;	// running status
+	uint32_t cin;		// code index of message
+	uint32_t bytes;		// data bytes expected
+	uint32_t count;		// data bytes collected
+	uint32_t data1;		// previous data byte
+	uint32_t sysid;		// sysex buffer held
+	uint32_t run;		// one in run random bytes is status
+	uint8_t buf[MIDI_MAX_SYSEX];	// sysex data
+} parse;
+
+// Events expected from the UART ring by lane, and bytes stored since
+// the ring was emptied
+static struct check_uartrx {
+	struct check_expect {
+		union midi_event_pkt evt;	// event expected
+		uint32_t mask;	// bits compared
+		uint32_t stamp;	// stamp of its last byte
+	} expect[MIDI_LANES][CHECK_UARTRX_EXPECT];
+	uint32_t head[MIDI_LANES];
+	uint32_t tail[MIDI_LANES];
+	uint32_t since;
+	uint32_t fail;
+} uartrx;
+
+// Output config as last sent, with reference divisors and offsets
+static struct output_config outref[SETTINGS_NROUTS];
+
+// Numbers shared by the outputs, controllers 8 and 9 also carry the
+// upper bits for 40 and 41
+static const uint8_t output_numbers[] = { 8U, 9U, 40U, 41U, 72U, 73U };
+
+// Clock divisors at note lengths, from 96ppq to a bar
+static const uint8_t clock_divisors[] = {
+	1U, 2U, 3U, 4U, 6U, 8U, 12U, 16U, 24U, 32U, 48U, 96U, 192U
+};
+
+// Last update status reply read from the USB-MIDI IN endpoint
+static struct check_status {
+	uint8_t msg[MIDI_MAX_SYSEX];	// sysex being read, after F0
+	uint32_t len;		// bytes in msg
+	uint32_t replies;	// good replies read
+	uint32_t bad;		// malformed replies
+	uint32_t fill;		// image bytes accepted
+	uint32_t dropped;	// chunks dropped
+	uint32_t state;		// enum update_state
+} status;
+
+// Return a pseudo-random number, xorshift32
+static uint32_t check_rand(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+// CRC-7/MMC of len bytes, bit at a time
+static uint32_t check_crc7mmc(const uint8_t *msg, uint32_t len)
+{
+	uint32_t crc = 0;
+	uint32_t i = 0;
+	while (i < len) {
+		uint32_t bit = 8U;
+		do {
+			--bit;
+			if (((crc >> 6) ^ (msg[i] >> bit)) & 1U) {
+				crc = ((crc << 1) ^ 0x09U) & MIDI_DATA_MASK;
+			} else {
+				crc = (crc << 1) & MIDI_DATA_MASK;
+			}
+		} while (bit);
+		++i;
+	}
+	return crc;
+}
+
+// Parse a sysex body on the UART cable, return the CRC-7 of all but
+// its last byte as queued with the message, or UINT32_MAX if none
+static uint32_t check_sysex(const uint8_t *body, uint32_t len)
+{
+	struct midi_event *evt;
+	uint32_t crc = UINT32_MAX;
+	uint32_t i = 0;
+	midi_receive(MIDI_CABLE_UART, MIDI_STATUS_SYSTEM, 0);
+	while (i < len) {
+		midi_receive(MIDI_CABLE_UART, body[i], 0);
+		++i;
+	}
+	midi_receive(MIDI_CABLE_UART, MIDI_STATUS_EOX, 0);
+	while ((evt = midi_event_poll()) != NULL) {
+		if ((evt->evt.raw.header & MIDI_CIN_MASK) == MIDI_CIN_EOX_3) {
+			crc = evt->evt.raw.midi2;
+			midi_sysex_done(evt);
+		}
+		midi_event_done();
+	}
+	return crc;
+}
+
+// Table and CRC peripheral give the same sysex CRC-7
+static int check_crc7(void)
+{
+	// The last byte stands in for the CRC and is not summed
+	static const uint8_t sum[] = "123456789\0";
+	uint8_t body[MIDI_MAX_SYSEX];
+	uint32_t n = 0;
+	int fail = 0;
+	host_crc7_table = 1U;
+	if (check_sysex(sum, sizeof(sum) - 1U) != CHECK_CRC7_SUM) {
+		fprintf(stderr, "crc7: table check value wrong\n");
+		fail = 1;
+	}
+	host_crc7_table = 0;
+	if (check_sysex(sum, sizeof(sum) - 1U) != CHECK_CRC7_SUM) {
+		fprintf(stderr, "crc7: peripheral check value wrong\n");
+		fail = 1;
+	}
+	do {
+		uint32_t len = 2U + check_rand() % (MIDI_MAX_SYSEX - 1U);
+		uint32_t table;
+		uint32_t periph;
+		uint32_t i = 1U;
+		// Not this device's ID, so never an update
+		body[0] = CHECK_NONRT;
+		while (i < len) {
+			body[i] = (uint8_t) (check_rand() & MIDI_DATA_MASK);
+			++i;
+		}
+		host_crc7_table = 1U;
+		table = check_sysex(body, len);
+		host_crc7_table = 0;
+		periph = check_sysex(body, len);
+		if (table != periph || table > MIDI_DATA_MASK) {
+			fprintf(stderr, "crc7: %u byte message: table 0x%x,"
+				" peripheral 0x%x\n", len, table, periph);
+			fail = 1;
+			break;
+		}
+		++n;
+	} while (n < CHECK_CRC7_MSGS);
+	host_crc7_table = IS_ENABLED(CRC7_TABLE);
+	return fail;
+}
+
+// Clear the reference receiver status
+static void check_parse_reset(void)
+{
+	parse.status = MIDI_STATUS_NULL;
+	parse.cin = MIDI_CIN_RESERVED_0;
+	parse.bytes = 0;
+	parse.count = 0;
+}
+
+// Expect a message with data bytes in the reference receiver
+static void check_parse_start(uint32_t cin, uint32_t bytes, uint32_t sb)
+{
+	parse.status = sb;
+	parse.cin = cin;
+	parse.bytes = bytes;
+	parse.count = 0;
+}
+
+/* Receive a byte in the reference receiver
+ *
+ * Follows the status switch that the classification table replaced.
+ * Return zero if no event is expected, otherwise the event in e and a
+ * mask of its bits to compare. An EOX after part of a message other
+ * than sysex queues its count with a stale CRC-7, not compared.
+ */
+static uint32_t check_parse_byte(uint32_t b, union midi_event_pkt *e)
+{
+	union midi_event_pkt mask = {.val = UINT32_MAX };
+	uint32_t sb = parse.status;
+	e->val = 0;
+	e->raw.header = MIDI_CABLE_UART << 4;
+	if (!(b & MIDI_STATUS_FLAG)) {
+		if (sb == MIDI_STATUS_SYSTEM) {
+			if (parse.count >= MIDI_MAX_SYSEX) {
+				check_parse_reset();
+			} else {
+				parse.buf[parse.count++] = (uint8_t) b;
+			}
+			return 0;
+		}
+		if (!parse.bytes) {
+			return 0;
+		}
+		if (++parse.count < parse.bytes) {
+			parse.data1 = b;
+			return 0;
+		}
+		e->raw.header |= (uint8_t) parse.cin;
+		e->raw.midi0 = (uint8_t) sb;
+		if (parse.bytes == 2U) {
+			e->raw.midi1 = (uint8_t) parse.data1;
+			e->raw.midi2 = (uint8_t) b;
+		} else {
+			e->raw.midi1 = (uint8_t) b;
+		}
+		if ((sb & MIDI_STATUS_MASK) == MIDI_STATUS_NOTEON && b == 0) {
+			e->raw.header = MIDI_CABLE_UART << 4 | MIDI_CIN_NOTE_OFF;
+			e->raw.midi0 = (uint8_t) (sb & ~0x10U);
+		}
+		if (parse.cin == MIDI_CIN_COMMON_3
+		    || parse.cin == MIDI_CIN_COMMON_2) {
+			check_parse_reset();
+		} else {
+			parse.count = 0;
+		}
+		return mask.val;
+	}
+	switch (b) {
+	case MIDI_RT_CLOCK:
+	case MIDI_RT_START:
+	case MIDI_RT_CONTINUE:
+	case MIDI_RT_STOP:
+		e->raw.header |= MIDI_CIN_BYTE;
+		e->raw.midi0 = (uint8_t) b;
+		return mask.val;
+	case MIDI_RT_RESET:
+		e->raw.header |= MIDI_CIN_BYTE;
+		e->raw.midi0 = (uint8_t) b;
+		check_parse_reset();
+		return mask.val;
+	case MIDI_RT_SENSE:
+	case MIDI_RT_UNDEF9:
+	case MIDI_RT_UNDEFd:
+		return 0;
+	case MIDI_STATUS_SYSTEM:
+		if (parse.sysid == 0) {
+			parse.sysid = 1U;
+			check_parse_start(MIDI_CIN_EOX_3, 2U, b);
+		} else {
+			check_parse_reset();
+		}
+		return 0;
+	case MIDI_STATUS_SPP:
+		check_parse_start(MIDI_CIN_COMMON_3, 2U, b);
+		return 0;
+	case MIDI_STATUS_MTCQF:
+	case MIDI_STATUS_SONGSEL:
+		check_parse_start(MIDI_CIN_COMMON_2, 1U, b);
+		return 0;
+	case MIDI_STATUS_UNDEF4:
+	case MIDI_STATUS_UNDEF5:
+		check_parse_reset();
+		return 0;
+	case MIDI_STATUS_TUNEREQ:
+		e->raw.header |= MIDI_CIN_SYS_1;
+		e->raw.midi0 = (uint8_t) b;
+		check_parse_reset();
+		return mask.val;
+	case MIDI_STATUS_EOX:
+		if (!parse.count) {
+			check_parse_reset();
+			return 0;
+		}
+		// The event is taken at once, releasing the sysex buffer
+		e->raw.header |= MIDI_CIN_EOX_3;
+		e->raw.midi0 = MIDI_STATUS_SYSTEM;
+		e->raw.midi1 = (uint8_t) parse.count;
+		if (sb == MIDI_STATUS_SYSTEM) {
+			e->raw.midi2 = (uint8_t) check_crc7mmc(parse.buf,
+							       parse.count - 1U);
+		} else {
+			mask.raw.midi2 = 0;
+		}
+		parse.sysid = 0;
+		check_parse_reset();
+		return mask.val;
+	default:
+		break;
+	}
+	switch (b & MIDI_STATUS_MASK) {
+	case MIDI_STATUS_NOTEOFF:
+	case MIDI_STATUS_NOTEON:
+	case MIDI_STATUS_POLYPRESS:
+	case MIDI_STATUS_CONTROL:
+	case MIDI_STATUS_BENDER:
+		check_parse_start(b >> 4, 2U, b);
+		break;
+	case MIDI_STATUS_PROGRAM:
+	case MIDI_STATUS_CHANPRESS:
+		check_parse_start(b >> 4, 1U, b);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+// Clear the reference receiver as the link going quiet does
+static void check_parse_quiet(void)
+{
+	check_parse_reset();
+	parse.sysid = 0;
+}
+
+/* Return non-zero if the link should go quiet before byte i
+ *
+ * A sysex cut short holds its buffer until the receiver times out,
+ * which is let happen at the start of one run in four.
+ */
+static uint32_t check_parse_held(uint32_t i)
+{
+	return i % CHECK_CLASSIFY_RUN == 0 && parse.sysid
+	    && (check_rand() & 3U) == 0;
+}
+
+/* Return byte i of random MIDI for the reference receiver
+ *
+ * Bytes come in runs of random status byte density, down to long
+ * sysex. One status byte in four starts or ends a sysex and one in
+ * four is any system message. A sysex never starts with this device's
+ * ID, so it is never a config message or update.
+ */
+static uint32_t check_parse_rand(uint32_t i)
+{
+	uint32_t b = check_rand() >> 8;
+	if (i % CHECK_CLASSIFY_RUN == 0) {
+		parse.run = 1U + b % CHECK_CLASSIFY_RUN;
+		b >>= 8;
+	}
+	if (b % parse.run == 0) {
+		b >>= 8;
+		if ((b & 3U) == 0) {
+			b = parse.status == MIDI_STATUS_SYSTEM
+			    ? MIDI_STATUS_EOX : MIDI_STATUS_SYSTEM;
+		} else if ((b & 3U) == 1U) {
+			b = MIDI_STATUS_SYSTEM | (b >> 2 & MIDI_CHANNEL_MASK);
+		} else {
+			b = MIDI_STATUS_FLAG | (b >> 2 & MIDI_DATA_MASK);
+		}
+	} else {
+		b = b >> 8 & MIDI_DATA_MASK;
+	}
+	if (parse.status == MIDI_STATUS_SYSTEM && parse.count == 0
+	    && b == (SYSEX_ID & 0xffU)) {
+		b ^= 1U;
+	}
+	return b;
+}
+
+// Let the cables go quiet past the sense timeout, so that the
+// receivers reset and release any sysex buffer still held
+static void check_quiet(void)
+{
+	uint32_t n = 2U * CHECK_SENSE_POLL / 8U;
+	Uptime += MIDI_SENSE_TIMEOUT;
+	while (n) {
+		Uptime += 8U;
+		system_update();
+		--n;
+	}
+	host_sync();
+}
+
+// Status bytes classified by table act as the switch they replaced
+static int check_classify(void)
+{
+	uint32_t fmidi = config.fmidi;
+	uint32_t i = 0;
+	int fail = 0;
+	// Pass every code index to compare all events
+	config.fmidi = UINT16_MAX;
+	midi_event_map();
+	check_parse_quiet();
+	do {
+		struct midi_event *evt;
+		union midi_event_pkt want;
+		uint32_t mask;
+		uint32_t n = 0;
+		uint32_t b;
+		if (check_parse_held(i)) {
+			check_quiet();
+			check_parse_quiet();
+		}
+		b = check_parse_rand(i);
+		mask = check_parse_byte(b, &want);
+		midi_receive(MIDI_CABLE_UART, b, i);
+		while ((evt = midi_event_poll()) != NULL) {
+			uint32_t cin = evt->evt.raw.header & MIDI_CIN_MASK;
+			if (!fail && (n++ || ((evt->evt.val ^ want.val) & mask)
+				      || !mask
+				      || (cin != MIDI_CIN_EOX_3
+					  && evt->clock != i))) {
+				fprintf(stderr, "classify: byte %u 0x%02x: got "
+					"%02x %02x %02x %02x, expected %s"
+					"%02x %02x %02x %02x\n", i, b,
+					evt->evt.raw.header, evt->evt.raw.midi0,
+					evt->evt.raw.midi1, evt->evt.raw.midi2,
+					mask ? "" : "none, not ",
+					want.raw.header, want.raw.midi0,
+					want.raw.midi1, want.raw.midi2);
+				fail = 1;
+			}
+			if (cin == MIDI_CIN_EOX_3) {
+				midi_sysex_done(evt);
+			}
+			midi_event_done();
+		}
+		if (!fail && mask && !n) {
+			fprintf(stderr, "classify: byte %u 0x%02x: no event, "
+				"expected %02x %02x %02x %02x\n", i, b,
+				want.raw.header, want.raw.midi0,
+				want.raw.midi1, want.raw.midi2);
+			fail = 1;
+		}
+		++i;
+	} while (!fail && i < CHECK_CLASSIFY_BYTES);
+	config.fmidi = fmidi;
+	midi_event_map();
+	check_quiet();
+	return fail;
+}
+
+// Return the event queue lane for code index cin
+static uint32_t check_lane(uint32_t cin)
+{
+	if (cin == MIDI_CIN_EOX_3) {
+		return MIDI_LANE_SYSEX;
+	}
+	if (cin >= MIDI_CIN_NOTE_OFF && cin < MIDI_CIN_BYTE) {
+		return MIDI_LANE_VOICE;
+	}
+	return MIDI_LANE_RT;
+}
+
+// Take PendSV, comparing the events parsed from the UART ring with
+// those expected in each lane
+static void check_uartrx_drain(void)
+{
+	struct midi_event *evt;
+	SCB->ICSR &= ~SCB_ICSR_PENDSVSET_Msk;
+	while ((evt = midi_event_poll()) != NULL) {
+		uint32_t cin = evt->evt.raw.header & MIDI_CIN_MASK;
+		uint32_t l = check_lane(cin);
+		uint32_t n = uartrx.tail[l];
+		struct check_expect *x =
+		    &uartrx.expect[l][n % CHECK_UARTRX_EXPECT];
+		if (!uartrx.fail && (n == uartrx.head[l]
+				     || ((evt->evt.val ^ x->evt.val) & x->mask)
+				     || (cin != MIDI_CIN_EOX_3
+					 && evt->clock != x->stamp))) {
+			fprintf(stderr, "uartrx: lane %u event %u: got %02x %02x"
+				" %02x %02x at %u, expected %02x %02x %02x "
+				"%02x at %u\n", l, n, evt->evt.raw.header,
+				evt->evt.raw.midi0, evt->evt.raw.midi1,
+				evt->evt.raw.midi2, evt->clock,
+				x->evt.raw.header, x->evt.raw.midi0,
+				x->evt.raw.midi1, x->evt.raw.midi2, x->stamp);
+			uartrx.fail = 1;
+		}
+		uartrx.tail[l]++;
+		if (cin == MIDI_CIN_EOX_3) {
+			midi_sysex_done(evt);
+		}
+		midi_event_done();
+	}
+	uartrx.since = 0;
+}
+
+/* Deliver byte b to UART5, or a framing error if err is set, and take
+ * its interrupt
+ *
+ * Return non-zero if the interrupt raised PendSV. One already pending
+ * stays pending.
+ */
+static uint32_t check_uartrx_send(uint32_t b, uint32_t err)
+{
+	uint32_t pend = SCB->ICSR & SCB_ICSR_PENDSVSET_Msk;
+	uint32_t woke;
+	SCB->ICSR &= ~SCB_ICSR_PENDSVSET_Msk;
+	Uptime++;
+	host_uart5.RDR = (uint16_t) b;
+	host_uart5.ISR |= USART_ISR_RXNE | (err ? USART_ISR_FE : 0);
+	midi_uart_receive();
+	host_uart5.ISR &= ~(USART_ISR_RXNE | USART_ISR_FE);
+	uartrx.since++;
+	woke = SCB->ICSR & SCB_ICSR_PENDSVSET_Msk;
+	SCB->ICSR |= pend;
+	return woke;
+}
+
+// UART bytes are parsed in batches with PendSV raised as needed
+static int check_uartrx(void)
+{
+	uint32_t fmidi = config.fmidi;
+	uint32_t i = 0;
+	// Channel pressure and real time messages are filtered out
+	config.fmidi = UINT16_MAX & ~(1U << MIDI_CIN_PRESS | 1U << MIDI_CIN_BYTE);
+	midi_event_map();
+	memset(&uartrx, 0, sizeof(uartrx));
+	check_parse_quiet();
+	do {
+		union midi_event_pkt want = {.val = 0 };
+		uint32_t sysdata;
+		uint32_t mask = 0;
+		uint32_t wanted = 0;
+		uint32_t err;
+		uint32_t woke;
+		uint32_t b;
+		uint32_t r;
+		if (check_parse_held(i)) {
+			check_uartrx_drain();
+			check_quiet();
+			check_parse_quiet();
+		}
+		b = check_parse_rand(i);
+		err = check_rand() % CHECK_UARTRX_ERROR == 0;
+		sysdata = parse.status == MIDI_STATUS_SYSTEM
+		    && !(b & MIDI_STATUS_FLAG);
+		if (err) {
+			// Taken as a status byte that clears running status
+			check_parse_reset();
+			sysdata = 0;
+		} else {
+			mask = check_parse_byte(b, &want);
+			wanted = (config.fmidi | 1U << MIDI_CIN_EOX_3)
+			    & 1U << (want.raw.header & MIDI_CIN_MASK);
+		}
+		woke = check_uartrx_send(b, err);
+		if (mask && wanted) {
+			uint32_t l = check_lane(want.raw.header & MIDI_CIN_MASK);
+			struct check_expect *x = &uartrx.expect[l]
+			    [uartrx.head[l] % CHECK_UARTRX_EXPECT];
+			x->evt = want;
+			x->mask = mask;
+			x->stamp = uptime_cycles();
+			uartrx.head[l]++;
+			if (!woke) {
+				fprintf(stderr, "uartrx: byte %u 0x%02x: message "
+					"complete without PendSV\n", i, b);
+				uartrx.fail = 1;
+			}
+		}
+		// Filtered voice messages and sysex data wait for others
+		if (woke && uartrx.since < CHECK_UART_RXLEN / 2U
+		    && (sysdata || (mask && !wanted
+				    && (want.raw.header & MIDI_CIN_MASK)
+				    < MIDI_CIN_BYTE))) {
+			fprintf(stderr, "uartrx: byte %u 0x%02x: PendSV raised "
+				"for %s\n", i, b, sysdata ? "sysex data"
+				: "a filtered message");
+			uartrx.fail = 1;
+		}
+		if (!(SCB->ICSR & SCB_ICSR_PENDSVSET_Msk)
+		    && (uartrx.since >= CHECK_UART_RXLEN / 2U
+			|| !(host_uart5.CR1 & USART_CR1_IDLEIE))) {
+			fprintf(stderr, "uartrx: byte %u 0x%02x: %u bytes left "
+				"in the ring without PendSV\n", i, b,
+				uartrx.since);
+			uartrx.fail = 1;
+		}
+		// PendSV is taken some bytes later, or the line falls idle
+		r = check_rand();
+		if ((SCB->ICSR & SCB_ICSR_PENDSVSET_Msk) && (r & 3U) == 0) {
+			check_uartrx_drain();
+		} else if (!(SCB->ICSR & SCB_ICSR_PENDSVSET_Msk)
+			   && (host_uart5.CR1 & USART_CR1_IDLEIE)
+			   && (r & 7U) == 1U) {
+			host_uart5.ISR |= USART_ISR_IDLE;
+			midi_uart_receive();
+			host_uart5.ISR &= ~USART_ISR_IDLE;
+			if (!(SCB->ICSR & SCB_ICSR_PENDSVSET_Msk)) {
+				fprintf(stderr, "uartrx: byte %u: idle line "
+					"without PendSV\n", i);
+				uartrx.fail = 1;
+			}
+		}
+		++i;
+	} while (!uartrx.fail && i < CHECK_CLASSIFY_BYTES);
+	check_uartrx_drain();
+	i = 0;
+	do {
+		if (!uartrx.fail && uartrx.tail[i] != uartrx.head[i]) {
+			fprintf(stderr, "uartrx: lane %u: %u of %u events "
+				"parsed\n", i, uartrx.tail[i], uartrx.head[i]);
+			uartrx.fail = 1;
+		}
+		++i;
+	} while (i < MIDI_LANES);
+	if (!uartrx.fail && host_bkpt_count[CHECK_UART_OVERRUN]) {
+		fprintf(stderr, "uartrx: ring overrun\n");
+		uartrx.fail = 1;
+	}
+	config.fmidi = fmidi;
+	midi_event_map();
+	check_quiet();
+	return uartrx.fail;
+}
+
+// Receive a message on the UART cable straight into the parser
+static void check_lanes_send(uint32_t sb, uint32_t d1, uint32_t d2)
+{
+	uint32_t cmd = sb & MIDI_STATUS_MASK;
+	midi_receive(MIDI_CABLE_UART, sb, 0);
+	if (sb < MIDI_RT_CLOCK) {
+		midi_receive(MIDI_CABLE_UART, d1, 0);
+	}
+	if (sb < MIDI_RT_CLOCK && cmd != MIDI_STATUS_PROGRAM
+	    && cmd != MIDI_STATUS_CHANPRESS) {
+		midi_receive(MIDI_CABLE_UART, d2, 0);
+	}
+}
+
+// Take the next event, return non-zero if it is not status sb with
+// data bytes d1 and d2, where clocks carry the pulses merged into d1
+static int check_lanes_take(const char *name, uint32_t sb, uint32_t d1,
+			    uint32_t d2)
+{
+	struct midi_event *evt = midi_event_poll();
+	int fail;
+	if (evt == MIDI_EVENT_NULL) {
+		fprintf(stderr, "%s: no event, expected %02x %02x %02x\n",
+			name, sb, d1, d2);
+		return 1;
+	}
+	fail = evt->evt.raw.midi0 != sb || evt->evt.raw.midi1 != d1
+	    || evt->evt.raw.midi2 != d2;
+	if (fail) {
+		fprintf(stderr, "%s: got %02x %02x %02x, expected %02x %02x %02x\n",
+			name, evt->evt.raw.midi0, evt->evt.raw.midi1,
+			evt->evt.raw.midi2, sb, d1, d2);
+	}
+	midi_event_done();
+	return fail;
+}
+
+/* Real time messages overtake queued voice traffic
+ *
+ * Note ons are received with transport messages and two runs of
+ * clocks mixed in at random, more than the voice lane holds. Then
+ * start and stop alternate into a real time lane filled with clocks
+ * and song positions, each displacing the newest of those.
+ */
+static int check_lanes(void)
+{
+	static const uint8_t rt[] = {
+		MIDI_RT_START, MIDI_RT_CLOCK, MIDI_RT_STOP, MIDI_RT_CLOCK,
+		MIDI_RT_CONTINUE
+	};
+	uint32_t fmidi = config.fmidi;
+	uint32_t rtdrop = midi_event_stats[MIDI_LANE_RT].dropped;
+	uint32_t dropped = midi_event_stats[MIDI_LANE_VOICE].dropped;
+	uint32_t clocks = 0;
+	uint32_t n = 0;
+	uint32_t k = 0;
+	int fail = 0;
+	config.fmidi = UINT16_MAX;
+	midi_event_map();
+	while (n < CHECK_LANES_NOTES || k < ARRAY_SIZE(rt)) {
+		if (k < ARRAY_SIZE(rt)
+		    && (n == CHECK_LANES_NOTES || (check_rand() & 1U))) {
+			check_lanes_send(rt[k], 0, 0);
+			// Each run of clocks merges into one event
+			if (rt[k] != MIDI_RT_CLOCK
+			    || ++clocks % CHECK_LANES_CLOCKS == 0) {
+				++k;
+			}
+		} else {
+			check_lanes_send(MIDI_STATUS_NOTEON, n, 1U);
+			++n;
+		}
+	}
+	k = 0;
+	do {
+		fail |= check_lanes_take("lanes", rt[k], rt[k] == MIDI_RT_CLOCK
+					 ? CHECK_LANES_CLOCKS - 1U : 0, 0);
+		++k;
+	} while (k < ARRAY_SIZE(rt));
+	n = 0;
+	do {
+		fail |= check_lanes_take("lanes", MIDI_STATUS_NOTEON, n, 1U);
+		++n;
+	} while (n < CHECK_LANES_VOICE);
+	if (midi_event_poll() != MIDI_EVENT_NULL
+	    || midi_event_stats[MIDI_LANE_VOICE].dropped - dropped
+	    != CHECK_LANES_NOTES - CHECK_LANES_VOICE) {
+		fprintf(stderr, "lanes: %u notes dropped of %u\n",
+			midi_event_stats[MIDI_LANE_VOICE].dropped - dropped,
+			CHECK_LANES_NOTES);
+		fail = 1;
+	}
+	n = 0;
+	do {
+		check_lanes_send(MIDI_RT_CLOCK, 0, 0);
+		check_lanes_send(MIDI_STATUS_SPP, n, 0);
+		++n;
+	} while (n < CHECK_LANES_RT / 2U);
+	n = 0;
+	do {
+		check_lanes_send(n & 1U ? MIDI_RT_STOP : MIDI_RT_START, 0, 0);
+		++n;
+	} while (n < CHECK_LANES_RT);
+	n = 0;
+	do {
+		fail |= check_lanes_take("lanes", n & 1U ? MIDI_RT_STOP
+					 : MIDI_RT_START, 0, 0);
+		++n;
+	} while (n < CHECK_LANES_RT);
+	if (midi_event_poll() != MIDI_EVENT_NULL
+	    || midi_event_stats[MIDI_LANE_RT].dropped - rtdrop
+	    != CHECK_LANES_RT) {
+		fprintf(stderr, "lanes: %u real time events displaced of %u\n",
+			midi_event_stats[MIDI_LANE_RT].dropped - rtdrop,
+			CHECK_LANES_RT);
+		fail = 1;
+	}
+	config.fmidi = fmidi;
+	midi_event_map();
+	return fail;
+}
+
+// Sweep two controllers into the parser, with a note halfway
+static void check_overflow_sweep(void)
+{
+	uint32_t v = 0;
+	do {
+		if (v == CHECK_OVERFLOW_VALUES / 2U) {
+			check_lanes_send(MIDI_STATUS_NOTEON,
+					 CHECK_OVERFLOW_NOTE, 1U);
+		}
+		check_lanes_send(MIDI_STATUS_CONTROL, CHECK_OVERFLOW_CTRL1, v);
+		check_lanes_send(MIDI_STATUS_CONTROL, CHECK_OVERFLOW_CTRL2, v);
+		++v;
+	} while (v < CHECK_OVERFLOW_VALUES);
+}
+
+// Take both controllers at value v
+static int check_overflow_take(uint32_t v)
+{
+	int fail = check_lanes_take("overflow", MIDI_STATUS_CONTROL,
+				    CHECK_OVERFLOW_CTRL1, v);
+	fail |= check_lanes_take("overflow", MIDI_STATUS_CONTROL,
+				 CHECK_OVERFLOW_CTRL2, v);
+	return fail;
+}
+
+// Compare the voice lane counts with those expected
+static int check_overflow_stats(uint32_t depth, uint32_t dropped,
+				uint32_t merged, uint32_t high)
+{
+	struct midi_event_stats *st = &midi_event_stats[MIDI_LANE_VOICE];
+	int fail = midi_event_poll() != MIDI_EVENT_NULL
+	    || st->dropped != dropped || st->merged != merged
+	    || st->high != high;
+	if (fail) {
+		fprintf(stderr, "overflow: depth %u dropped %u merged %u"
+			" high %u, expected %u %u %u\n", depth, st->dropped,
+			st->merged, st->high, dropped, merged, high);
+	}
+	st->dropped = 0;
+	st->merged = 0;
+	st->high = 0;
+	return fail;
+}
+
+/* Voice lane overflow, with and without controller coalescing
+ *
+ * Without coalescing the sweep fills the voice lane and the rest is
+ * dropped. Coalescing from half full keeps each controller's first
+ * values and its last before and after the note, in order, and the
+ * peak depth follows the run time depth.
+ */
+static int check_overflow(void)
+{
+	static const uint8_t bits[] = { 0, CHECK_OVERFLOW_BITS };
+	struct midi_event_stats save = midi_event_stats[MIDI_LANE_VOICE];
+	uint32_t fmidi = config.fmidi;
+	uint32_t depth = CHECK_LANES_VOICE;
+	uint32_t n = 0;
+	uint32_t v;
+	int fail = 0;
+	config.fmidi = UINT16_MAX;
+	midi_event_map();
+	midi_event_stats[MIDI_LANE_VOICE] = (struct midi_event_stats) { 0 };
+	midi_event_config(0, 0);
+	check_overflow_sweep();
+	v = 0;
+	do {
+		fail |= check_overflow_take(v);
+		++v;
+	} while (v < depth / 2U);
+	fail |= check_overflow_stats(depth,
+				     2U * CHECK_OVERFLOW_VALUES + 1U - depth,
+				     0, depth);
+	do {
+		midi_event_config(bits[n], 1U);
+		// The depth is taken up while the lane is empty
+		(void)midi_event_poll();
+		depth = bits[n] ? 1U << bits[n] : CHECK_LANES_VOICE;
+		check_overflow_sweep();
+		v = 0;
+		while (v + 1U < depth / 4U) {
+			fail |= check_overflow_take(v);
+			++v;
+		}
+		fail |= check_overflow_take(CHECK_OVERFLOW_VALUES / 2U - 1U);
+		fail |= check_lanes_take("overflow", MIDI_STATUS_NOTEON,
+					 CHECK_OVERFLOW_NOTE, 1U);
+		fail |= check_overflow_take(CHECK_OVERFLOW_VALUES - 1U);
+		fail |= check_overflow_stats(depth, 0,
+					     2U * CHECK_OVERFLOW_VALUES
+					     - depth / 2U - 2U,
+					     depth / 2U + 3U);
+		++n;
+	} while (n < ARRAY_SIZE(bits));
+	midi_event_config(0, IS_ENABLED(MIDI_COALESCE));
+	(void)midi_event_poll();
+	midi_event_stats[MIDI_LANE_VOICE] = save;
+	config.fmidi = fmidi;
+	midi_event_map();
+	return fail;
+}
+
+/* Filtered messages take no room in the voice lane
+ *
+ * Channel pressure and pitch bend, rejected by the default filter,
+ * are parsed with a note every so often, more than the voice lane
+ * holds. Only the notes may be queued.
+ */
+static int check_filter(void)
+{
+	uint32_t fmidi = config.fmidi;
+	uint32_t dropped = midi_event_stats[MIDI_LANE_VOICE].dropped;
+	uint32_t n = 0;
+	uint32_t i = 0;
+	int fail = 0;
+	config.fmidi = SETTING_DEFFILT;
+	midi_event_map();
+	do {
+		if (i % CHECK_FILTER_NOTE == 0) {
+			check_lanes_send(MIDI_STATUS_NOTEON, n++, 1U);
+		}
+		check_lanes_send(MIDI_STATUS_CHANPRESS, i & MIDI_DATA_MASK, 0);
+		check_lanes_send(MIDI_STATUS_BENDER, 0, i & MIDI_DATA_MASK);
+		++i;
+	} while (i < CHECK_FILTER_MSGS);
+	i = 0;
+	do {
+		fail |= check_lanes_take("filter", MIDI_STATUS_NOTEON, i, 1U);
+		++i;
+	} while (i < n);
+	if (midi_event_poll() != MIDI_EVENT_NULL
+	    || midi_event_stats[MIDI_LANE_VOICE].dropped != dropped) {
+		fprintf(stderr, "filter: %u dropped with %u notes\n",
+			midi_event_stats[MIDI_LANE_VOICE].dropped - dropped, n);
+		fail = 1;
+	}
+	config.fmidi = fmidi;
+	midi_event_map();
+	return fail;
+}
+
+// Append count 7 bit bytes of value to a config message, low first,
+// return its new length
+static uint32_t check_config_pack(uint8_t *msg, uint32_t len,
+				  uint32_t value, uint32_t count)
+{
+	uint32_t i = 0;
+	while (i < count) {
+		msg[len + i] = (uint8_t) ((value >> (7U * i)) & MIDI_DATA_MASK);
+		++i;
+	}
+	return len + count;
+}
+
+// Start a config message in msg, return its length
+static uint32_t check_config_msg(uint8_t *msg, uint32_t cmd,
+				 uint32_t value, uint32_t count)
+{
+	msg[0] = SYSEX_ID & 0xffU;
+	msg[1] = (SYSEX_ID >> 8) & 0xffU;
+	msg[2] = (SYSEX_ID >> 16) & 0xffU;
+	msg[3] = (SYSEX_ID >> 24) & 0xffU;
+	msg[4] = (uint8_t) cmd;
+	return check_config_pack(msg, 5U, value, count);
+}
+
+// Send a config message with its CRC-7, xored with bad, on the UART
+// cable and handle it
+static void check_config_send(uint8_t *msg, uint32_t len, uint32_t bad)
+{
+	uint32_t i = 0;
+	msg[len] = (uint8_t) (check_crc7mmc(msg, len) ^ bad);
+	midi_receive(MIDI_CABLE_UART, MIDI_STATUS_SYSTEM, 0);
+	while (i <= len) {
+		midi_receive(MIDI_CABLE_UART, msg[i], 0);
+		++i;
+	}
+	midi_receive(MIDI_CABLE_UART, MIDI_STATUS_EOX, 0);
+	system_update();
+	host_sync();
+}
+
+// Send a channel message on the configured channel and handle it
+static void check_channel_send(uint32_t sb, uint32_t d1, uint32_t d2)
+{
+	midi_receive(MIDI_CABLE_UART, sb | config.channel, 0);
+	midi_receive(MIDI_CABLE_UART, d1, 0);
+	midi_receive(MIDI_CABLE_UART, d2, 0);
+	system_update();
+	host_sync();
+}
+
+// Configure output i with a config message
+static void check_output_config(uint32_t i, const struct output_config *cfg)
+{
+	uint8_t msg[16];
+	uint32_t len = check_config_msg(msg, CHECK_CONFIG_OUTPUT, i, 1U);
+	len = check_config_pack(msg, len, cfg->flags, 2U);
+	len = check_config_pack(msg, len, cfg->divisor, 2U);
+	len = check_config_pack(msg, len, cfg->offset, 2U);
+	len = check_config_pack(msg, len, cfg->note, 1U);
+	check_config_send(msg, len, 0);
+}
+
+// Return a note or controller number, mostly one shared by outputs,
+// never a channel mode message
+static uint32_t check_output_number(void)
+{
+	uint32_t r = check_rand();
+	if (r & 7U) {
+		return output_numbers[(r >> 3) % ARRAY_SIZE(output_numbers)];
+	}
+	return (r >> 3) % MIDI_MODE_LOCAL;
+}
+
+/* Configure every output at random for notes and controllers
+ *
+ * Flags are drawn from those not clocked by the timer, and divisors
+ * and offsets from all 14 bit values. Return non-zero if a config
+ * message was not taken.
+ */
+static int check_output_random(void)
+{
+	struct output_config cfg;
+	uint32_t i = 0;
+	do {
+		cfg.flags = check_rand() & (SETTING_NOTE | SETTING_TRIG
+					    | SETTING_CTRLDIV | SETTING_CTRLOFT
+					    | SETTING_CTRL);
+		cfg.divisor = check_rand() & 0x3fffU;
+		cfg.offset = check_rand() & 0x3fffU;
+		cfg.note = check_output_number();
+		check_output_config(i, &cfg);
+		if (memcmp(&config.output[i], &cfg, sizeof(cfg))) {
+			return 1;
+		}
+		outref[i] = cfg;
+		++i;
+	} while (i < SETTINGS_NROUTS);
+	return 0;
+}
+
+// Put back the output config saved in cfg
+static void check_output_restore(const struct output_config *cfg)
+{
+	uint32_t i = 0;
+	do {
+		check_output_config(i, &cfg[i]);
+		++i;
+	} while (i < SETTINGS_NROUTS);
+}
+
+// Output pins for a note, found by the loop the note lookup replaced
+static uint32_t check_note_pins(uint32_t note)
+{
+	uint32_t pins = 0;
+	uint32_t i = 0;
+	do {
+		if ((outref[i].flags & SETTING_NOTE) && outref[i].note == note) {
+			pins |= out_pins[i];
+		}
+		++i;
+	} while (i < SETTINGS_NROUTS);
+	return pins;
+}
+
+// Note messages switch the outputs the replaced loop would
+static int check_notes(void)
+{
+	struct output_config save[SETTINGS_NROUTS];
+	uint32_t n = 0;
+	int fail = 0;
+	memcpy(save, config.output, sizeof(save));
+	do {
+		uint32_t odr = GPIOC->ODR & OUTMASK;
+		uint32_t m = 0;
+		if (check_output_random()) {
+			fprintf(stderr, "notes: output config not taken\n");
+			fail = 1;
+			break;
+		}
+		do {
+			uint32_t note = check_output_number();
+			uint32_t vel = check_rand();
+			uint32_t sb = vel & 1U ? MIDI_STATUS_NOTEON
+			    : MIDI_STATUS_NOTEOFF;
+			vel = vel >> 1 & MIDI_DATA_MASK;
+			// Note on with no velocity is a note off
+			if (sb == MIDI_STATUS_NOTEON && vel) {
+				odr |= check_note_pins(note);
+			} else {
+				odr &= ~check_note_pins(note);
+			}
+			check_channel_send(sb, note, vel);
+			if ((GPIOC->ODR & OUTMASK) != odr) {
+				fprintf(stderr, "notes: config %u, %02x %02x %02x:"
+					" pins %04x, expected %04x\n", n,
+					sb, note, vel,
+					GPIOC->ODR & OUTMASK, odr);
+				fail = 1;
+			}
+		} while (!fail && ++m < CHECK_OUTPUT_MSGS);
+	} while (!fail && ++n < CHECK_OUTPUT_CONFIGS);
+	check_output_restore(save);
+	return fail;
+}
+
+/* Apply a controller change to the reference outputs
+ *
+ * Follows the loop over outputs that the controller actions replaced.
+ * Controllers 32-63 set the lower 7 bits of a parameter, and the
+ * controller numbered 32 less its upper 7 bits. Return the pins
+ * switched as a BSRR word.
+ */
+static uint32_t check_ctrl_ref(uint32_t number, uint32_t value)
+{
+	uint32_t bsrr = 0;
+	uint32_t i = 0;
+	do {
+		struct output_config *out = &outref[i];
+		uint32_t pair = out->note > 31U && out->note < 64U;
+		if ((out->flags & (SETTING_CTRLDIV | SETTING_CTRLOFT))
+		    && (out->note == number
+			|| (pair && out->note - 32U == number))) {
+			uint32_t keep = 0;
+			uint32_t v = value;
+			if (pair && out->note == number) {
+				keep = MIDI_DATA_MASK << 7;
+			} else if (pair) {
+				keep = MIDI_DATA_MASK;
+				v <<= 7;
+			}
+			if (out->flags & SETTING_CTRLDIV) {
+				out->divisor = (out->divisor & keep) | v;
+			}
+			if (out->flags & SETTING_CTRLOFT) {
+				out->offset = (out->offset & keep) | v;
+			}
+		}
+		if ((out->flags & SETTING_CTRL) && out->note == number) {
+			bsrr |= value < 64U ? out_pins[i] << 16 : out_pins[i];
+		}
+		++i;
+	} while (i < SETTINGS_NROUTS);
+	return bsrr;
+}
+
+// Controller changes act as the replaced loop over outputs would
+static int check_ctrl(void)
+{
+	struct output_config save[SETTINGS_NROUTS];
+	uint32_t n = 0;
+	int fail = 0;
+	memcpy(save, config.output, sizeof(save));
+	do {
+		uint32_t odr = GPIOC->ODR & OUTMASK;
+		uint32_t m = 0;
+		if (check_output_random()) {
+			fprintf(stderr, "ctrl: output config not taken\n");
+			fail = 1;
+			break;
+		}
+		do {
+			uint32_t number = check_output_number();
+			uint32_t value = check_rand() & MIDI_DATA_MASK;
+			uint32_t bsrr = check_ctrl_ref(number, value);
+			uint32_t i = 0;
+			odr = (odr & ~(bsrr >> 16)) | (bsrr & OUTMASK);
+			check_channel_send(MIDI_STATUS_CONTROL, number, value);
+			if ((GPIOC->ODR & OUTMASK) != odr) {
+				fprintf(stderr, "ctrl: config %u, controller %u "
+					"value %u: pins %04x, expected %04x\n",
+					n, number, value, GPIOC->ODR & OUTMASK,
+					odr);
+				fail = 1;
+			}
+			do {
+				struct output_config *out = &config.output[i];
+				if (out->divisor != outref[i].divisor
+				    || out->offset != outref[i].offset) {
+					fprintf(stderr, "ctrl: config %u, "
+						"controller %u value %u: output "
+						"%u divisor %u offset %u, "
+						"expected %u %u\n", n, number,
+						value, i, out->divisor,
+						out->offset, outref[i].divisor,
+						outref[i].offset);
+					fail = 1;
+				}
+				++i;
+			} while (!fail && i < SETTINGS_NROUTS);
+		} while (!fail && ++m < CHECK_OUTPUT_MSGS);
+	} while (!fail && ++n < CHECK_OUTPUT_CONFIGS);
+	check_output_restore(save);
+	return fail;
+}
+
+/* Configure output i as a clock with random flags, return non-zero if
+ * the config was not taken
+ *
+ * Divisors are drawn from note lengths if sched is set, otherwise
+ * from all 14 bit values. One output in four is left unclocked.
+ * Clocked outputs may follow controllers for their divisor and
+ * offset, so that these change while running.
+ */
+static int check_clock_output(uint32_t i, uint32_t sched)
+{
+	struct output_config cfg;
+	uint32_t r = check_rand();
+	cfg.flags = SETTING_CLOCK | (r & (SETTING_TRIG | SETTING_CTRLDIV
+					  | SETTING_CTRLOFT | SETTING_RUNMASK));
+	if ((r & 3U) == 0) {
+		cfg.flags = SETTING_NOTE;
+	}
+	if (sched) {
+		cfg.divisor = clock_divisors[check_rand()
+					     % ARRAY_SIZE(clock_divisors)];
+	} else {
+		cfg.divisor = 1U + check_rand() % 0x3fffU;
+	}
+	cfg.offset = check_rand() & 0x3fffU;
+	cfg.note = check_output_number();
+	check_output_config(i, &cfg);
+	return memcmp(&config.output[i], &cfg, sizeof(cfg)) != 0;
+}
+
+/* Output register word prepared for phase
+ *
+ * Follows the per-tick modulo arithmetic that the edge counters
+ * replaced, for the live config. Outputs with a zero divisor, which
+ * the modulo could not handle, are not clocked.
+ */
+static uint32_t check_clock_ref(uint32_t phase)
+{
+	uint32_t word = 0;
+	uint32_t i = 0;
+	do {
+		struct output_config *out = &config.output[i];
+		if ((out->flags & SETTING_CLOCK) && out->divisor) {
+			uint32_t period = out->divisor << 1;
+			uint32_t at = phase % period;
+			if (at == out->offset % period) {
+				if (!(out->flags & SETTING_RUNMASK) || timer.on) {
+					word |= out_pins[i];
+				}
+			} else if (at == (out->divisor + out->offset) % period) {
+				word |= out_pins[i] << 16;
+			}
+		}
+		++i;
+	} while (i < SETTINGS_NROUTS);
+	return word;
+}
+
+// Return non-zero if the clocked outputs fit an edge schedule
+static uint32_t check_clock_fits(void)
+{
+	uint32_t cycle = 1U;
+	uint32_t events = 0;
+	uint32_t t = 0;
+	uint32_t i = 0;
+	do {
+		struct output_config *out = &config.output[i];
+		if ((out->flags & SETTING_CLOCK) && out->divisor) {
+			uint32_t a = cycle;
+			uint32_t b = out->divisor << 1;
+			while (b) {
+				uint32_t r = a % b;
+				a = b;
+				b = r;
+			}
+			cycle = cycle / a * (out->divisor << 1);
+			if (cycle > CHECK_SCHEDMAX) {
+				return 0;
+			}
+		}
+		++i;
+	} while (i < SETTINGS_NROUTS);
+	// Count ticks with an edge on any output
+	do {
+		i = 0;
+		do {
+			struct output_config *out = &config.output[i];
+			if ((out->flags & SETTING_CLOCK) && out->divisor
+			    && t % out->divisor == out->offset % out->divisor) {
+				++events;
+				break;
+			}
+			++i;
+		} while (i < SETTINGS_NROUTS);
+	} while (++t < cycle);
+	return events <= CHECK_SCHEDLEN;
+}
+
+// Compare the output word prepared with the reference
+static int check_clock_word(const char *name, uint32_t n)
+{
+	uint32_t want = check_clock_ref(timer.phase);
+	if (timer.nextout != want) {
+		fprintf(stderr, "%s: config %u, phase %u: word %08x, "
+			"expected %08x\n", name, n, timer.phase,
+			timer.nextout, want);
+		return 1;
+	}
+	return 0;
+}
+
+/* Clocked outputs tick as the replaced modulo arithmetic would
+ *
+ * Most configs must fit an edge schedule if sched is set, and most
+ * must not otherwise, so that the schedule or the counters are run.
+ */
+static int check_clock(const char *name, uint32_t sched)
+{
+	struct output_config save[SETTINGS_NROUTS];
+	uint32_t on = timer.on;
+	uint32_t fits = 0;
+	uint32_t n = 0;
+	int fail = 0;
+	memcpy(save, config.output, sizeof(save));
+	do {
+		uint32_t t = 0;
+		uint32_t i = 0;
+		do {
+			fail = check_clock_output(i, sched);
+			++i;
+		} while (!fail && i < SETTINGS_NROUTS);
+		if (fail) {
+			fprintf(stderr, "%s: output config not taken\n", name);
+			break;
+		}
+		fits += check_clock_fits();
+		do {
+			uint32_t r = check_rand();
+			// Now and then change the config, start or stop
+			if (r % CHECK_CLOCK_CHANGE == 0) {
+				r /= CHECK_CLOCK_CHANGE;
+				switch (r & 3U) {
+				case 0:
+					fail = check_clock_output((r >> 2)
+								  % SETTINGS_NROUTS,
+								  sched);
+					break;
+				case 1U:
+					check_channel_send(MIDI_STATUS_CONTROL,
+							   check_output_number(),
+							   (r >> 2) & MIDI_DATA_MASK);
+					break;
+				case 2U:
+					timer_preroll();
+					fail = check_clock_word(name, n);
+					break;
+				default:
+					// As set by the first clock and by stop
+					timer.on ^= 1U;
+					break;
+				}
+			}
+			timer_update();
+			fail |= check_clock_word(name, n);
+		} while (!fail && ++t < CHECK_CLOCK_TICKS);
+	} while (!fail && ++n < CHECK_CLOCK_CONFIGS);
+	timer.on = on;
+	check_output_restore(save);
+	if (!fail && (sched ? 2U * fits < n : 2U * fits > n)) {
+		fprintf(stderr, "%s: %u of %u configs fit a schedule\n",
+			name, fits, n);
+		fail = 1;
+	}
+	return fail;
+}
+
+// Edge counters, with divisors too varied for a schedule
+static int check_edges(void)
+{
+	return check_clock("edges", 0);
+}
+
+// Edge schedule, with divisors at note lengths
+static int check_sched(void)
+{
+	return check_clock("sched", 1U);
+}
+
+// Note on message n, cycling through key and velocity
+static uint32_t check_note(uint32_t n, uint32_t i)
+{
+	switch (i) {
+	case 0:
+		return MIDI_STATUS_NOTEON;
+	case 1U:
+		return n & MIDI_DATA_MASK;
+	default:
+		return 1U + (n >> 7) % MIDI_DATA_MASK;
+	}
+}
+
+// Run the USB interrupt while it has flags raised
+static void check_usb_service(void)
+{
+	while (host_usb_pending()) {
+		usb_irq();
+		host_sync();
+	}
+}
+
+// Complete a control transfer without a data stage
+static int check_usb_control(uint32_t addr, const uint8_t *setup)
+{
+	uint8_t buf[USB_ENDPOINT_SIZE];
+	uint32_t len;
+	if (host_usb_setup(addr, setup) != HOST_USB_ACK) {
+		return -1;
+	}
+	check_usb_service();
+	if (host_usb_in(addr, 0, buf, &len) != HOST_USB_ACK || len) {
+		return -1;
+	}
+	check_usb_service();
+	return 0;
+}
+
+// Reset, address and configure the device, return zero on success
+static int check_usb_enumerate(void)
+{
+	uint8_t setaddr[8] = { 0, USB_REQ_SET_ADDRESS, CHECK_USBADDR };
+	uint8_t setcfg[8] = { 0, USB_REQ_SET_CONFIG,
+		OPTION->usb.configuration.cfg_bConfigurationValue
+	};
+	host_usb_reset();
+	check_usb_service();
+	if (check_usb_control(0, setaddr) < 0
+	    || check_usb_control(CHECK_USBADDR, setcfg) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Deliver the next UART byte and take its interrupt
+ *
+ * Return zero if the byte might not fit in the ring, counting all
+ * sent bytes of messages not yet received as still held there.
+ */
+static uint32_t check_uart_send(void)
+{
+	uint32_t n = merge.sent[MIDI_CABLE_UART];
+	if (n == CHECK_MERGE_MSGS || 3U * (n - merge.got[MIDI_CABLE_UART])
+	    + merge.bytes >= CHECK_UART_RXLEN) {
+		return 0;
+	}
+	Uptime++;
+	host_uart5.RDR = (uint16_t) check_note(n, merge.bytes);
+	host_uart5.ISR |= USART_ISR_RXNE;
+	midi_uart_receive();
+	host_sync();
+	host_uart5.ISR &= ~USART_ISR_RXNE;
+	if (++merge.bytes == 3U) {
+		merge.bytes = 0;
+		merge.sent[MIDI_CABLE_UART]++;
+	}
+	return 1U;
+}
+
+// Offer the endpoint a transfer of the next packets, return non-zero
+// if it was taken
+static uint32_t check_usb_send(void)
+{
+	uint8_t buf[USB_ENDPOINT_SIZE];
+	uint32_t n = merge.sent[MIDI_CABLE_USB];
+	uint32_t len = 1U + check_rand() % (USB_ENDPOINT_SIZE / 4U);
+	uint32_t i = 0;
+	if (n == CHECK_MERGE_MSGS) {
+		return 0;
+	}
+	if (len > CHECK_MERGE_MSGS - n) {
+		len = CHECK_MERGE_MSGS - n;
+	}
+	do {
+		buf[4U * i] = MIDI_CABLE_USB << 4 | MIDI_CIN_NOTE_ON;
+		buf[4U * i + 1U] = (uint8_t) check_note(n + i, 0);
+		buf[4U * i + 2U] = (uint8_t) check_note(n + i, 1U);
+		buf[4U * i + 3U] = (uint8_t) check_note(n + i, 2U);
+		++i;
+	} while (i < len);
+	Uptime++;
+	if (host_usb_out(CHECK_USBADDR, USB_EP_OUT, buf, 4U * len)
+	    != HOST_USB_ACK) {
+		return 0;
+	}
+	merge.sent[MIDI_CABLE_USB] += len;
+	return 1U;
+}
+
+// Take a raised USB interrupt unless the driver holds it off
+static void check_usb_irq(void)
+{
+	if (host_usb_pending() && NVIC_GetEnableIRQ(USB_LP_CAN_RX0_IRQn)) {
+		check_usb_service();
+	}
+}
+
+/* Take a receive interrupt as the hardware would at this point
+ *
+ * A raised USB interrupt waits while the driver holds it off, and
+ * the two receive interrupts share a preemption group, so neither is
+ * taken inside the other.
+ */
+static void check_interrupt(void)
+{
+	if (merge.active) {
+		return;
+	}
+	merge.active = 1U;
+	if (check_rand() & 1U) {
+		check_uart_send();
+	} else if (!host_usb_pending()) {
+		check_usb_send();
+	}
+	check_usb_irq();
+	merge.active = 0;
+}
+
+// Send on both cables until the UART ring and the endpoint are full
+static void check_burst(void)
+{
+	uint32_t more;
+	merge.active = 1U;
+	do {
+		more = check_uart_send();
+		if (!host_usb_pending() && check_usb_send()) {
+			check_usb_irq();
+			more = 1U;
+		}
+	} while (more);
+	merge.active = 0;
+}
+
+// Preemption hook, an interrupt at one barrier in CHECK_MERGE_PREEMPT
+static void check_preempt(void)
+{
+	if (check_rand() % CHECK_MERGE_PREEMPT == 0) {
+		check_interrupt();
+	}
+}
+
+// Check a received event against the next expected on its cable
+static void check_merge_event(const struct midi_event *evt)
+{
+	uint32_t cable = (evt->evt.raw.header & MIDI_CABLE_MASK) >> 4;
+	uint32_t n = merge.got[cable & 1U];
+	if (merge.fail) {
+		return;
+	}
+	if (cable > MIDI_CABLE_UART
+	    || evt->evt.raw.midi0 != check_note(n, 0)
+	    || evt->evt.raw.midi1 != check_note(n, 1U)
+	    || evt->evt.raw.midi2 != check_note(n, 2U)) {
+		fprintf(stderr, "merge: cable %u message %u: got %02x %02x %02x\n",
+			cable, n, evt->evt.raw.midi0, evt->evt.raw.midi1,
+			evt->evt.raw.midi2);
+		merge.fail = 1;
+		return;
+	}
+	if (merge.stamped && (int32_t) (evt->clock - merge.stamp) < 0) {
+		fprintf(stderr, "merge: cable %u message %u: stamp %u before %u\n",
+			cable, n, evt->clock, merge.stamp);
+		merge.fail = 1;
+		return;
+	}
+	merge.stamp = evt->clock;
+	merge.stamped = 1U;
+	merge.got[cable]++;
+}
+
+// Drain the event queue as system_update() would
+static void check_merge_drain(void)
+{
+	struct midi_event *evt;
+	while ((evt = midi_event_poll()) != NULL) {
+		check_merge_event(evt);
+		midi_event_done();
+	}
+}
+
+// Receive rings merge in stamp order without loss under preemption
+static int check_merge(void)
+{
+	uint32_t idle = 0;
+	uint32_t steps = 0;
+	if (check_usb_enumerate()) {
+		fprintf(stderr, "merge: USB enumeration failed\n");
+		return 1;
+	}
+	memset(&merge, 0, sizeof(merge));
+	memset(host_bkpt_count, 0, sizeof(host_bkpt_count));
+	host_preempt = check_preempt;
+	do {
+		uint32_t r = check_rand() % 64U;
+		if (r == 0) {
+			check_burst();
+		} else if (r < 24U) {
+			check_interrupt();
+		} else {
+			check_merge_drain();
+		}
+		// Flush the USB interrupt once both cables have sent all
+		idle = merge.sent[MIDI_CABLE_UART] == CHECK_MERGE_MSGS
+		    && merge.sent[MIDI_CABLE_USB] == CHECK_MERGE_MSGS;
+		if (++steps == CHECK_MERGE_STEPS) {
+			fprintf(stderr, "merge: stalled\n");
+			merge.fail = 1;
+		}
+	} while (!merge.fail && !idle);
+	host_preempt = NULL;
+	check_usb_service();
+	check_merge_drain();
+	if (!merge.fail && (merge.got[MIDI_CABLE_UART] != CHECK_MERGE_MSGS
+			    || merge.got[MIDI_CABLE_USB] != CHECK_MERGE_MSGS
+			    || host_bkpt_count[CHECK_UART_OVERRUN])) {
+		fprintf(stderr, "merge: received %u UART and %u USB of %u\n",
+			merge.got[MIDI_CABLE_UART], merge.got[MIDI_CABLE_USB],
+			CHECK_MERGE_MSGS);
+		merge.fail = 1;
+	}
+	return merge.fail;
+}
+
+// Event packet and the universal MIDI packet it converts to
+struct check_ump {
+	uint32_t pkt;
+	uint32_t n;		// words, zero if none
+	uint32_t ump[2];
+};
+
+// Event packet from its code index and bytes, on cable 0
+#define CHECK_PKT(cin, b0, b1, b2) \
+	((cin) | (b0) << 8 | (b1) << 16 | (uint32_t) (b2) << 24)
+
+static const struct check_ump ump_table[] = {
+	{ CHECK_PKT(MIDI_CIN_NOTE_ON, 0x90U, 0x40U, 0x7fU), 1U,
+	 { 0x2090407fU } },
+	{ CHECK_PKT(MIDI_CIN_CONTROL, 0xb3U, 0x07U, 0x64U), 1U,
+	 { 0x20b30764U } },
+	{ CHECK_PKT(MIDI_CIN_PROG, 0xc1U, 0x05U, 0), 1U, { 0x20c10500U } },
+	{ CHECK_PKT(MIDI_CIN_BYTE, 0xf8U, 0, 0), 1U, { 0x10f80000U } },
+	{ CHECK_PKT(MIDI_CIN_COMMON_3, 0xf2U, 0x10U, 0x20U), 1U,
+	 { 0x10f21020U } },
+	{ CHECK_PKT(MIDI_CIN_SYS_1, 0xf6U, 0, 0), 1U, { 0x10f60000U } },
+	// Not a message
+	{ CHECK_PKT(MIDI_CIN_BYTE, 0x42U, 0, 0), 0, { 0 } },
+	{ CHECK_PKT(MIDI_CIN_RESERVED_1, 0x90U, 0x40U, 0x7fU), 0, { 0 } },
+	// Sysex start, continue and end, with F0 and F7 left out
+	{ CHECK_PKT(MIDI_CIN_SYSEX, 0xf0U, 0x7dU, 0), 2U,
+	 { 0x30127d00U, 0 } },
+	{ CHECK_PKT(MIDI_CIN_SYSEX, 0x01U, 0x02U, 0x03U), 2U,
+	 { 0x30230102U, 0x03000000U } },
+	{ CHECK_PKT(MIDI_CIN_EOX_3, 0x04U, 0x05U, 0xf7U), 2U,
+	 { 0x30320405U, 0 } },
+	{ CHECK_PKT(MIDI_CIN_SYS_1, 0xf7U, 0, 0), 2U, { 0x30300000U, 0 } },
+	{ CHECK_PKT(MIDI_CIN_EOX_2, 0xf0U, 0xf7U, 0), 2U,
+	 { 0x30000000U, 0 } },
+	{ CHECK_PKT(MIDI_CIN_EOX_3, 0xf0U, 0x01U, 0xf7U), 2U,
+	 { 0x30010100U, 0 } },
+};
+
+// Split a sysex of len data bytes into event packets in pkt, as
+// midi_sysex_send() does, return the count
+static uint32_t check_ump_split(const uint8_t *data, uint32_t len,
+				uint32_t *pkt)
+{
+	uint8_t msg[CHECK_UMP_SYSEX + 2U];
+	uint32_t n = 0;
+	uint32_t i = 0;
+	msg[0] = MIDI_STATUS_SYSTEM;
+	memcpy(&msg[1], data, len);
+	msg[len + 1U] = MIDI_STATUS_EOX;
+	len += 2U;
+	do {
+		uint32_t left = len - i;
+		uint32_t cin = left > 3U ? MIDI_CIN_SYSEX
+		    : MIDI_CIN_SYS_1 + left - 1U;
+		pkt[n++] = CHECK_PKT(cin, msg[i], left > 1U ? msg[i + 1U] : 0,
+				     left > 2U ? msg[i + 2U] : 0U);
+		i += 3U;
+	} while (i < len);
+	return n;
+}
+
+// Event packets convert to the expected universal MIDI packets
+static int check_ump(void)
+{
+	uint8_t data[CHECK_UMP_SYSEX];
+	uint32_t pkt[CHECK_UMP_SYSEX / 3U + 1U];
+	uint32_t len = 0;
+	uint32_t i = 0;
+	do {
+		const struct check_ump *t = &ump_table[i];
+		uint32_t ump[2] = { 0, 0 };
+		uint32_t n = midi_ump_packet(t->pkt, ump);
+		if (n != t->n || (n && ump[0] != t->ump[0])
+		    || (n > 1U && ump[1] != t->ump[1])) {
+			fprintf(stderr, "ump: packet 0x%08x gave %u words "
+				"0x%08x 0x%08x\n", t->pkt, n, ump[0], ump[1]);
+			return 1;
+		}
+		++i;
+	} while (i < sizeof(ump_table) / sizeof(ump_table[0]));
+	do {
+		uint8_t got[CHECK_UMP_SYSEX];
+		uint32_t count;
+		uint32_t pos = 0;
+		uint32_t fail = 0;
+		i = 0;
+		while (i < len) {
+			data[i] = (uint8_t) (check_rand() & MIDI_DATA_MASK);
+			++i;
+		}
+		count = check_ump_split(data, len, pkt);
+		i = 0;
+		do {
+			uint32_t ump[2];
+			uint32_t st;
+			uint32_t n;
+			uint32_t want = count == 1U ? MIDI_UMP_SYSEX_ONLY
+			    : i == 0 ? MIDI_UMP_SYSEX_START
+			    : i + 1U == count ? MIDI_UMP_SYSEX_END
+			    : MIDI_UMP_SYSEX_CONT;
+			if (midi_ump_packet(pkt[i], ump) != 2U
+			    || ump[0] >> 28 != MIDI_UMP_DATA64) {
+				fail = 1U;
+				break;
+			}
+			st = (ump[0] >> 20) & 0xfU;
+			n = (ump[0] >> 16) & 0xfU;
+			if (st != want || n > 3U || pos + n > len) {
+				fail = 1U;
+				break;
+			}
+			if (n) {
+				got[pos] = (uint8_t) (ump[0] >> 8);
+			}
+			if (n > 1U) {
+				got[pos + 1U] = (uint8_t) ump[0];
+			}
+			if (n > 2U) {
+				got[pos + 2U] = (uint8_t) (ump[1] >> 24);
+			}
+			pos += n;
+			++i;
+		} while (i < count);
+		if (fail || pos != len || memcmp(got, data, len)) {
+			fprintf(stderr, "ump: %u byte sysex packet %u of %u "
+				"wrong\n", len, i, count);
+			return 1;
+		}
+	} while (++len <= CHECK_UMP_SYSEX);
+	return 0;
+}
+
+// Note on packets sent to the host and read back, by key
+static struct check_usbin {
+	uint32_t sent;		// packets taken by midi_usb_send()
+	uint32_t got;		// packets read in order
+	uint32_t flight;	// packets in the buffer being sent
+	uint32_t gather;	// packets in the buffer being gathered
+	uint32_t fail;
+} usbin;
+
+// Send n note on packets to the host, return non-zero if taken
+static uint32_t check_usbin_send(uint32_t n)
+{
+	uint32_t pkt[CHECK_USBIN_WORDS + 1U];
+	uint32_t i = 0;
+	do {
+		uint32_t k = usbin.sent + i;
+		pkt[i] = MIDI_CIN_NOTE_ON | MIDI_STATUS_NOTEON << 8
+		    | check_note(k, 1U) << 16 | check_note(k, 2U) << 24;
+		++i;
+	} while (i < n);
+	if (!midi_usb_send(pkt, n)) {
+		return 0;
+	}
+	usbin.sent += n;
+	return 1U;
+}
+
+// Read one IN transfer, return its length or -1 if NAKed
+static int check_usbin_read(void)
+{
+	uint8_t buf[USB_ENDPOINT_SIZE];
+	uint32_t len;
+	uint32_t i = 0;
+	if (host_usb_in(CHECK_USBADDR, USB_EP_IN & 0x0fU, buf, &len)
+	    != HOST_USB_ACK) {
+		return -1;
+	}
+	check_usb_service();
+	while (i < len) {
+		uint32_t k = usbin.got;
+		if (buf[i] != MIDI_CIN_NOTE_ON
+		    || buf[i + 1U] != MIDI_STATUS_NOTEON
+		    || buf[i + 2U] != check_note(k, 1U)
+		    || buf[i + 3U] != check_note(k, 2U)) {
+			fprintf(stderr, "usbin: packet %u read out of order\n",
+				k);
+			usbin.fail = 1;
+			break;
+		}
+		++usbin.got;
+		i += 4U;
+	}
+	return (int)len;
+}
+
+// IN packets are sent whole, once and in order
+static int check_usbin(void)
+{
+	uint32_t steps = 0;
+	if (check_usb_enumerate()) {
+		fprintf(stderr, "usbin: USB enumeration failed\n");
+		return 1;
+	}
+	memset(&usbin, 0, sizeof(usbin));
+	do {
+		uint32_t n = 1U + check_rand() % (CHECK_USBIN_WORDS + 1U);
+		uint32_t fit = n <= CHECK_USBIN_WORDS && (!usbin.flight
+							  || usbin.gather + n
+							  <= CHECK_USBIN_WORDS);
+		int len;
+		if (check_usbin_send(n) != fit) {
+			fprintf(stderr, "usbin: %u packets %s behind %u and "
+				"%u\n", n, fit ? "refused" : "taken",
+				usbin.flight, usbin.gather);
+			return 1;
+		}
+		if (fit && usbin.flight) {
+			usbin.gather += n;
+		} else if (fit) {
+			usbin.flight = n;
+		}
+		if (check_rand() % 4U) {
+			continue;
+		}
+		// Reading one buffer hands over the other
+		len = check_usbin_read();
+		if (len != (usbin.flight ? (int)(4U * usbin.flight) : -1)) {
+			fprintf(stderr, "usbin: read %d bytes of %u packets\n",
+				len, usbin.flight);
+			return 1;
+		}
+		usbin.flight = usbin.gather;
+		usbin.gather = 0;
+	} while (!usbin.fail && ++steps < CHECK_USBIN_STEPS);
+	while (!usbin.fail && check_usbin_read() > 0) ;
+	if (!usbin.fail && usbin.got != usbin.sent) {
+		fprintf(stderr, "usbin: read %u of %u packets\n", usbin.got,
+			usbin.sent);
+		usbin.fail = 1;
+	}
+	return usbin.fail;
+}
+
+// STM32 CRC-32 of the words in len bytes of image, bit at a time
+static uint32_t check_crc32(const uint8_t *image, uint32_t len)
+{
+	uint32_t crc = 0xffffffffU;
+	uint32_t i = 0;
+	while (i < len) {
+		uint32_t bit = 0;
+		crc ^= image[i] | image[i + 1U] << 8 | image[i + 2U] << 16
+		    | (uint32_t) image[i + 3U] << 24;
+		do {
+			if (crc & 0x80000000U) {
+				crc = (crc << 1) ^ 0x04c11db7U;
+			} else {
+				crc <<= 1;
+			}
+		} while (++bit < 32U);
+		i += 4U;
+	}
+	return crc;
+}
+
+// Take a complete sysex from the IN endpoint as a status reply
+static void check_update_reply(void)
+{
+	const uint8_t *m = status.msg;
+	if (status.len != 4U + CHECK_UPDATE_REPLY
+	    || m[0] != (SYSEX_ID & 0xffU) || m[1] != ((SYSEX_ID >> 8) & 0xffU)
+	    || m[2] != ((SYSEX_ID >> 16) & 0xffU)
+	    || m[3] != ((SYSEX_ID >> 24) & 0xffU) || m[4] != UPDATE_STATUS
+	    || m[status.len - 1U] != check_crc7mmc(m, status.len - 1U)) {
+		++status.bad;
+		return;
+	}
+	status.fill = m[5] | m[6] << 7 | m[7] << 14;
+	status.dropped = m[8] | m[9] << 7;
+	status.state = m[10];
+	++status.replies;
+}
+
+// Read the USB-MIDI packets queued on the IN endpoint
+static void check_update_status(void)
+{
+	uint8_t buf[USB_ENDPOINT_SIZE];
+	uint32_t len;
+	while (host_usb_in(CHECK_USBADDR, USB_EP_IN & 0x0fU, buf, &len)
+	       == HOST_USB_ACK) {
+		uint32_t i = 0;
+		check_usb_service();
+		while (i + 4U <= len) {
+			uint32_t cin = buf[i] & MIDI_CIN_MASK;
+			uint32_t n = cin == MIDI_CIN_SYSEX || cin == MIDI_CIN_EOX_3
+			    ? 3U : cin - MIDI_CIN_SYS_1 + 1U;
+			uint32_t j = 1U;
+			if (cin < MIDI_CIN_SYSEX || cin > MIDI_CIN_EOX_3) {
+				++status.bad;
+				n = 0;
+			}
+			while (j <= n) {
+				uint8_t b = buf[i + j];
+				if (b == MIDI_STATUS_SYSTEM) {
+					status.len = 0;
+				} else if (b == MIDI_STATUS_EOX) {
+					check_update_reply();
+					status.len = 0;
+				} else if (status.len < MIDI_MAX_SYSEX) {
+					status.msg[status.len++] = b;
+				}
+				++j;
+			}
+			i += 4U;
+		}
+	}
+}
+
+// Send an update config message and handle it, return non-zero if
+// the update module rejected it
+static uint32_t check_update_send(uint8_t *msg, uint32_t len, uint32_t bad)
+{
+	uint32_t reject = host_bkpt_count[CHECK_UPDATE_REJECT];
+	check_config_send(msg, len, bad);
+	check_update_status();
+	return host_bkpt_count[CHECK_UPDATE_REJECT] != reject;
+}
+
+// Run the deadline wheel for n millisecond passes
+static void check_update_run(uint32_t n)
+{
+	while (n) {
+		Uptime += 8U;
+		system_update();
+		host_sync();
+		check_update_status();
+		--n;
+	}
+}
+
+/* Copy a committed update as loader.s does at boot
+ *
+ * Stops after pages have been copied, as if power were lost, leaving
+ * the commit record set.
+ */
+static void check_loader(uint32_t pages)
+{
+	struct flash_commit *rec = COMMIT;
+	uint32_t page = 0;
+	if (rec->magic != FLASH_COMMITMAGIC || rec->size - 1U
+	    >= FLASH_CODEPAGES * FLASH_PAGESZ
+	    || check_crc32((uint8_t *) FLASHMEM->update, rec->size)
+	    != rec->crc) {
+		return;
+	}
+	while (page * FLASH_PAGESZ < rec->size) {
+		if (page == pages) {
+			return;
+		}
+		memcpy(&FLASHMEM->application[page], &FLASHMEM->update[page],
+		       FLASH_PAGESZ);
+		++page;
+	}
+	rec->magic &= 0xffff0000U;
+}
+
+// Image is staged and committed, then copied by the loader on reset
+static int check_update(void)
+{
+	static struct flash_page app[FLASH_CODEPAGES];
+	static uint8_t image[CHECK_UPDATE_SIZE];
+	static uint8_t msg[UPDATE_HEADER + 2U * CHECK_UPDATE_CHUNK];
+	uint32_t pages = (CHECK_UPDATE_SIZE + FLASH_PAGESZ - 1U) / FLASH_PAGESZ;
+	uint32_t fail = host_bkpt_count[CHECK_UPDATE_FAIL];
+	uint32_t offset = 0;
+	uint32_t steps = 0;
+	uint32_t retries = 0;
+	uint32_t len;
+	uint32_t i = 0;
+	if (!IS_ENABLED(SYSEX_UPDATE)) {
+		fprintf(stderr, "update: skipped, built without SYSEX_UPDATE\n");
+		return 0;
+	}
+	do {
+		image[i] = (uint8_t) check_rand();
+		++i;
+	} while (i < CHECK_UPDATE_SIZE);
+	host_resets = 0;
+	memset(&status, 0, sizeof(status));
+	memcpy(app, FLASHMEM->application, sizeof(app));
+	len = check_config_msg(msg, UPDATE_BEGIN, CHECK_UPDATE_SIZE, 3U);
+	check_update_send(msg, len, 0);
+	if (status.replies != 1U || status.state != UPDATE_RECEIVE) {
+		fprintf(stderr, "update: %u replies to begin, state %u\n",
+			status.replies, status.state);
+		return 1;
+	}
+	do {
+		uint32_t acc = 0;
+		uint32_t bits = 0;
+		len = check_config_msg(msg, UPDATE_DATA, offset, 3U);
+		i = offset;
+		while (i < offset + CHECK_UPDATE_CHUNK && i < CHECK_UPDATE_SIZE) {
+			acc |= (uint32_t) image[i] << bits;
+			bits += 8U;
+			while (bits >= 7U) {
+				msg[len++] = (uint8_t) (acc & MIDI_DATA_MASK);
+				acc >>= 7;
+				bits -= 7U;
+			}
+			++i;
+		}
+		if (bits) {
+			msg[len++] = (uint8_t) (acc & MIDI_DATA_MASK);
+		}
+		if (offset == CHECK_UPDATE_BAD * CHECK_UPDATE_CHUNK
+		    && !check_update_send(msg, len, 1U)) {
+			fprintf(stderr, "update: bad CRC-7 accepted\n");
+			return 1;
+		}
+		// Both page buffers may be in use, try again later
+		while (check_update_send(msg, len, 0)) {
+			check_update_run(1U);
+			++retries;
+			if (++steps == pages * CHECK_UPDATE_STEPS) {
+				fprintf(stderr, "update: chunk at %u not taken\n",
+					offset);
+				return 1;
+			}
+		}
+		// Sent faster than pages are programmed
+		check_update_run(CHECK_UPDATE_CHUNK / 64U);
+		offset = i;
+	} while (offset < CHECK_UPDATE_SIZE);
+	if (!retries) {
+		fprintf(stderr, "update: page buffers never both in use\n");
+		return 1;
+	}
+	if (status.bad || status.fill != CHECK_UPDATE_SIZE
+	    || status.dropped != retries) {
+		fprintf(stderr, "update: status %u bytes, %u of %u dropped, "
+			"%u bad replies\n", status.fill, status.dropped,
+			retries, status.bad);
+		return 1;
+	}
+	len = check_config_msg(msg, UPDATE_COMMIT,
+			       check_crc32(image, CHECK_UPDATE_SIZE), 5U);
+	check_update_send(msg, len, 0);
+	steps = 0;
+	while (!host_resets && ++steps < 2U * pages * CHECK_UPDATE_STEPS) {
+		check_update_run(1U);
+	}
+	// No further reset once done
+	check_update_run(CHECK_UPDATE_STEPS);
+	if (status.state != UPDATE_RESET || status.bad) {
+		fprintf(stderr, "update: last status state %u\n",
+			status.state);
+		return 1;
+	}
+	if (host_resets != 1U || host_bkpt_count[CHECK_UPDATE_FAIL] != fail
+	    || COMMIT->magic != FLASH_COMMITMAGIC
+	    || COMMIT->size != CHECK_UPDATE_SIZE
+	    || COMMIT->crc != check_crc32(image, CHECK_UPDATE_SIZE)
+	    || memcmp(FLASHMEM->update, image, CHECK_UPDATE_SIZE)
+	    || memcmp(FLASHMEM->application, app, sizeof(app))) {
+		fprintf(stderr, "update: %u resets, commit record %s, "
+			"application %s\n", host_resets,
+			COMMIT->magic == FLASH_COMMITMAGIC ? "set" : "clear",
+			memcmp(FLASHMEM->application, app, sizeof(app))
+			? "written" : "untouched");
+		return 1;
+	}
+	// Power lost during the boot copy, then the next boot completes
+	check_loader(1U);
+	if (COMMIT->magic != FLASH_COMMITMAGIC
+	    || memcmp(FLASHMEM->application, image, FLASH_PAGESZ)) {
+		fprintf(stderr, "update: cut copy left the record clear\n");
+		return 1;
+	}
+	check_loader(FLASH_CODEPAGES);
+	if (COMMIT->magic == FLASH_COMMITMAGIC
+	    || memcmp(FLASHMEM->application, image, CHECK_UPDATE_SIZE)) {
+		fprintf(stderr, "update: boot copy %s, record %s\n",
+			memcmp(FLASHMEM->application, image, CHECK_UPDATE_SIZE)
+			? "differs" : "matches",
+			COMMIT->magic == FLASH_COMMITMAGIC ? "set" : "clear");
+		return 1;
+	}
+	return 0;
+}
+
+static const struct check checks[] = {
+	{ "crc7", check_crc7 },
+	{ "classify", check_classify },
+	{ "uartrx", check_uartrx },
+	{ "lanes", check_lanes },
+	{ "overflow", check_overflow },
+	{ "filter", check_filter },
+	{ "notes", check_notes },
+	{ "ctrl", check_ctrl },
+	{ "edges", check_edges },
+	{ "sched", check_sched },
+	{ "merge", check_merge },
+	{ "ump", check_ump },
+	{ "usbin", check_usbin },
+	{ "update", check_update },
+};
+
+int main(int argc, char *argv[])
+{
+	int failed = 0;
+	int opt;
+	uint32_t i = 0;
+	while ((opt = getopt(argc, argv, "s:h")) != -1) {
+		switch (opt) {
+		case 's':
+			seed = (uint32_t) strtoul(optarg, NULL, 0) | 1U;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s seed]\n", argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	host_init();
+	uptime_init();
+	firmware_main();
+	host_sync();
+
+	do {
+		int fail = checks[i].run();
+		printf("%-12s %s\n", checks[i].name, fail ? "FAIL" : "ok");
+		failed += fail;
+		++i;
+	} while (i < ARRAY_SIZE(checks));
+	return failed;
+}
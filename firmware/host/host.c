@@ -0,0 +1,524 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Host peripheral model
+ *
+ * In-memory register files standing in for the STM32F303 peripherals
+ * on an x86-64 host. GPIO set/reset and CRC data writes are applied
+ * when the next access to the same peripheral is made, or on
+ * host_sync(). Flash memory is a RAM image with the ROM options
+ * from src/options.c loaded into the options pages. Page erases
+ * complete on the next access to the flash controller, and
+ * programming writes the image directly. DMA address
+ * registers hold small handles to host pointers.
+ *
+ * The USB peripheral is driven from the bus side by the host
+ * program, one transaction at a time. Packet memory is a plain
+ * array, endpoint register writes apply their toggle and
+ * clear-by-zero fields at once, and interrupt flag clears are
+ * committed on the next access. Double buffered bulk endpoints
+ * NAK while their data toggle matches the software buffer bit. A
+ * start of frame advances the frame number and raises its flag.
+ */
+#include <string.h>
+#include "stm32f3xx.h"
+#include "flash.h"
+
+// ROM options image
+#include "../src/options.c"
+
+// Register files
+SCB_Type host_scb;
+SysTick_Type host_systick;
+NVIC_Type host_nvic;
+ITM_Type host_itm;
+CoreDebug_Type host_coredebug;
+MPU_Type host_mpu;
+GPIO_TypeDef host_gpioa;
+GPIO_TypeDef host_gpioc;
+TIM_TypeDef host_tim2;
+TIM_TypeDef host_tim3;
+USART_TypeDef host_uart5;
+CRC_TypeDef host_crcreg;
+RCC_TypeDef host_rcc;
+IWDG_TypeDef host_iwdg;
+FLASH_TypeDef host_flashreg;
+DMA_TypeDef host_dma1;
+DMA_Channel_TypeDef host_dma1ch2;
+uint32_t host_flash[sizeof(struct flash_memory) / sizeof(uint32_t)];
+USB_TypeDef host_usbreg;
+uint16_t host_pma[512U];
+
+void (*host_gpio_write)(GPIO_TypeDef * port, enum host_gpio_reg reg,
+			uint32_t val);
+void (*host_preempt)(void);
+uint32_t host_bkpt_count[256U];
+uint32_t host_resets;
+uint32_t host_crc7_table = IS_ENABLED(CRC7_TABLE);
+
+// Pointers registered as DMA addresses
+#define HOST_DMA_ADDRS	16U
+static volatile void *dma_addr[HOST_DMA_ADDRS];
+
+// Endpoint registers in the USB model
+#define HOST_USB_EPRS	8U
+#define HOST_USB_RW	(USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD)
+#define HOST_USB_TOGGLE	(USB_EP_DTOG_RX | USB_EPRX_STAT | USB_EP_DTOG_TX | USB_EPTX_STAT)
+#define HOST_USB_FLAGS	0x7f00U	// clear-by-zero interrupt flags
+
+// USB interrupt status last presented in ISTR
+static uint32_t usbistr;
+
+// CRC computation state
+static struct host_crc_state {
+	uint32_t crc;		// current remainder
+	uint32_t dr;		// value last presented in DR
+} crcstate;
+
+// Apply any pending set/reset writes to ODR
+static void gpio_commit(GPIO_TypeDef * port)
+{
+	uint32_t val = port->BSRR;
+	if (val) {
+		port->BSRR = 0;
+		if (host_gpio_write != NULL) {
+			host_gpio_write(port, HOST_GPIO_BSRR, val);
+		}
+		port->ODR = (port->ODR & ~(val >> 16)) | (val & 0xffffU);
+	}
+	val = port->BRR;
+	if (val) {
+		port->BRR = 0;
+		if (host_gpio_write != NULL) {
+			host_gpio_write(port, HOST_GPIO_BRR, val);
+		}
+		port->ODR &= ~(val & 0xffffU);
+	}
+}
+
+GPIO_TypeDef *host_gpio(GPIO_TypeDef * port)
+{
+	gpio_commit(port);
+	return port;
+}
+
+// Return the configured polynomial width in bits
+static uint32_t crc_width(void)
+{
+	static const uint8_t width[4] = { 32U, 16U, 8U, 7U };
+	return width[(host_crcreg.CR & CRC_CR_POLYSIZE_Msk)
+		     >> CRC_CR_POLYSIZE_Pos];
+}
+
+// Shift one byte through the CRC, msb first
+static void crc_feed(uint32_t val)
+{
+	uint32_t width = crc_width();
+	uint32_t top = 1UL << (width - 1U);
+	uint32_t mask = top | (top - 1U);
+	uint32_t crc = crcstate.crc;
+	uint32_t i = 0;
+	do {
+		uint32_t fb = (crc & top) ^ (((val << i) & 0x80U) ? top : 0U);
+		crc = (crc << 1) & mask;
+		if (fb) {
+			crc ^= host_crcreg.POL & mask;
+		}
+		++i;
+	} while (i < 8U);
+	crcstate.crc = crc;
+}
+
+// Apply a pending reset or word write, present result in DR
+static void crc_commit(void)
+{
+	if (host_crcreg.CR & CRC_CR_RESET) {
+		host_crcreg.CR &= ~CRC_CR_RESET;
+		crcstate.crc = host_crcreg.INIT;
+	} else if (host_crcreg.DR != crcstate.dr) {
+		uint32_t val = host_crcreg.DR;
+		crc_feed(val >> 24);
+		crc_feed((val >> 16) & 0xffU);
+		crc_feed((val >> 8) & 0xffU);
+		crc_feed(val & 0xffU);
+	}
+	crcstate.dr = crcstate.crc;
+	host_crcreg.DR = crcstate.crc;
+}
+
+CRC_TypeDef *host_crc(void)
+{
+	crc_commit();
+	return &host_crcreg;
+}
+
+void host_crc_byte(uint32_t val)
+{
+	crc_commit();
+	crc_feed(val & 0xffU);
+	crcstate.dr = crcstate.crc;
+	host_crcreg.DR = crcstate.crc;
+}
+
+// Erase a started page, AR holds the low word of its host address
+static void flash_commit(void)
+{
+	if ((host_flashreg.CR & (FLASH_CR_PER | FLASH_CR_STRT))
+	    == (FLASH_CR_PER | FLASH_CR_STRT)) {
+		uint32_t offset = host_flashreg.AR - (uint32_t) FLASH_BASE;
+		offset &= ~(FLASH_PAGESZ - 1U);
+		if (offset < sizeof(struct flash_memory)) {
+			memset((uint8_t *) host_flash + offset, 0xff,
+			       FLASH_PAGESZ);
+		}
+	}
+	host_flashreg.CR &= ~FLASH_CR_STRT;
+}
+
+FLASH_TypeDef *host_flashctl(void)
+{
+	flash_commit();
+	return &host_flashreg;
+}
+
+#define EPR(n)	((&host_usbreg.EP0R)[(n) << 1])
+#define PMA(addr)	host_pma[((addr) & 0x3ffU) >> 1]
+
+/* Apply flag clears written to ISTR, then present the lowest
+ * endpoint register with a completed transfer
+ */
+static void usb_commit(void)
+{
+	uint32_t istr = usbistr;
+	uint32_t n = 0;
+	if (host_usbreg.ISTR != usbistr) {
+		istr &= host_usbreg.ISTR | ~HOST_USB_FLAGS;
+	}
+	istr &= HOST_USB_FLAGS;
+	do {
+		uint32_t epr = EPR(n);
+		if (epr & (USB_EP_CTR_RX | USB_EP_CTR_TX)) {
+			istr |= USB_ISTR_CTR | n;
+			if (epr & USB_EP_CTR_RX) {
+				istr |= USB_ISTR_DIR;
+			}
+			break;
+		}
+		++n;
+	} while (n < HOST_USB_EPRS);
+	host_usbreg.ISTR = (uint16_t) istr;
+	usbistr = istr;
+}
+
+// Raise interrupt flags
+static void usb_raise(uint32_t flags)
+{
+	usb_commit();
+	usbistr |= flags;
+	host_usbreg.ISTR = (uint16_t) usbistr;
+}
+
+USB_TypeDef *host_usb(void)
+{
+	usb_commit();
+	return &host_usbreg;
+}
+
+void host_usb_epr(uint32_t n, uint32_t val)
+{
+	uint32_t cur = EPR(n);
+	EPR(n) = (uint16_t) ((val & HOST_USB_RW)
+			     | ((cur ^ val) & HOST_USB_TOGGLE)
+			     | (cur & val & (USB_EP_CTR_RX | USB_EP_CTR_TX))
+			     | (cur & USB_EP_SETUP));
+	usb_commit();
+}
+
+// Return the register for endpoint ep with direction stat enabled
+static int usb_lookup(uint32_t addr, uint32_t ep, uint32_t stat)
+{
+	uint32_t n = 0;
+	if ((host_rcc.APB1ENR & RCC_APB1ENR_USBEN) == 0
+	    || (host_usbreg.CNTR & (USB_CNTR_FRES | USB_CNTR_PDWN))
+	    || (host_usbreg.DADDR & USB_DADDR_EF) == 0
+	    || (host_usbreg.DADDR & USB_DADDR_ADD) != addr) {
+		return -1;
+	}
+	do {
+		uint32_t epr = EPR(n);
+		if ((epr & USB_EPADDR_FIELD) == ep && (epr & stat)) {
+			return (int)n;
+		}
+		++n;
+	} while (n < HOST_USB_EPRS);
+	return -1;
+}
+
+// Return the buffer descriptor of register n used for the next
+// transaction in direction stat, a double buffered endpoint takes
+// the buffer selected by its data toggle
+static uint32_t usb_desc(uint32_t n, uint32_t stat)
+{
+	uint32_t desc = host_usbreg.BTABLE + 8U * n;
+	uint32_t epr = EPR(n);
+	if ((epr & (USB_EP_T_FIELD | USB_EP_KIND)) == (USB_EP_BULK | USB_EP_KIND)) {
+		uint32_t dtog = stat == USB_EPRX_STAT ? USB_EP_DTOG_RX : USB_EP_DTOG_TX;
+		return desc + (epr & dtog ? 4U : 0);
+	}
+	return stat == USB_EPRX_STAT ? desc + 4U : desc;
+}
+
+// Return non-zero if double buffered register n has both buffers on
+// the same side, so its next transaction is NAKed
+static uint32_t usb_dbnak(uint32_t n)
+{
+	uint32_t epr = EPR(n);
+	if ((epr & (USB_EP_T_FIELD | USB_EP_KIND)) != (USB_EP_BULK | USB_EP_KIND)) {
+		return 0;
+	}
+	return !(epr & USB_EP_DTOG_RX) == !(epr & USB_EP_DTOG_TX);
+}
+
+// Return the receive buffer size of descriptor desc
+static uint32_t usb_rxsize(uint32_t desc)
+{
+	uint32_t count = PMA(desc + 2U);
+	uint32_t blocks = (count >> 10) & 0x1fU;
+	return count & 0x8000U ? (blocks + 1U) * 32U : blocks * 2U;
+}
+
+// Store a received packet in the buffer of descriptor desc
+static void usb_store(uint32_t desc, const uint8_t *data, uint32_t len)
+{
+	uint32_t addr = PMA(desc);
+	uint32_t i = 0;
+	while (i < len) {
+		uint32_t half = PMA(addr + i);
+		if (i & 1U) {
+			half = (half & 0x00ffU) | (uint32_t) data[i] << 8;
+		} else {
+			half = (half & 0xff00U) | data[i];
+		}
+		PMA(addr + i) = (uint16_t) half;
+		++i;
+	}
+	PMA(desc + 2U) = (uint16_t) ((PMA(desc + 2U) & ~0x3ffU) | len);
+}
+
+// Set the status field of register n, leaving other fields
+static void usb_stat(uint32_t n, uint32_t field, uint32_t stat)
+{
+	EPR(n) = (uint16_t) ((EPR(n) & ~field) | stat);
+}
+
+void host_usb_reset(void)
+{
+	uint32_t n = 0;
+	do {
+		EPR(n) = 0;
+		++n;
+	} while (n < HOST_USB_EPRS);
+	host_usbreg.DADDR = 0;
+	usb_raise(USB_ISTR_RESET);
+}
+
+void host_usb_sof(void)
+{
+	usb_commit();
+	if ((host_rcc.APB1ENR & RCC_APB1ENR_USBEN) == 0
+	    || (host_usbreg.CNTR & (USB_CNTR_FRES | USB_CNTR_PDWN))) {
+		return;
+	}
+	host_usbreg.FNR = (uint16_t) ((host_usbreg.FNR & ~USB_FNR_FN)
+				      | ((host_usbreg.FNR + 1U) & USB_FNR_FN)
+				      | USB_FNR_LCK);
+	usb_raise(USB_ISTR_SOF);
+}
+
+enum host_usb_handshake host_usb_setup(uint32_t addr, const uint8_t *setup)
+{
+	int n;
+	usb_commit();
+	n = usb_lookup(addr, 0, USB_EPRX_STAT);
+	if (n < 0 || (EPR(n) & USB_EP_T_FIELD) != USB_EP_CONTROL
+	    || usb_rxsize(usb_desc((uint32_t) n, USB_EPRX_STAT)) < 8U) {
+		return HOST_USB_TIMEOUT;
+	}
+	// SETUP is always accepted, data stages start with DATA1
+	usb_store(usb_desc((uint32_t) n, USB_EPRX_STAT), setup, 8U);
+	EPR(n) = (uint16_t) ((EPR(n) & ~HOST_USB_TOGGLE)
+			     | USB_EP_CTR_RX | USB_EP_SETUP
+			     | USB_EP_DTOG_RX | USB_EP_RX_NAK
+			     | USB_EP_DTOG_TX | USB_EP_TX_NAK);
+	usb_commit();
+	return HOST_USB_ACK;
+}
+
+enum host_usb_handshake host_usb_out(uint32_t addr, uint32_t ep,
+				     const uint8_t *data, uint32_t len)
+{
+	uint32_t desc;
+	uint32_t epr;
+	int n;
+	usb_commit();
+	n = usb_lookup(addr, ep, USB_EPRX_STAT);
+	if (n < 0) {
+		return HOST_USB_TIMEOUT;
+	}
+	desc = usb_desc((uint32_t) n, USB_EPRX_STAT);
+	if (len > usb_rxsize(desc)) {
+		return HOST_USB_TIMEOUT;
+	}
+	epr = EPR(n);
+	if ((epr & USB_EPRX_STAT) == USB_EP_RX_STALL) {
+		return HOST_USB_STALL;
+	}
+	if ((epr & USB_EPRX_STAT) == USB_EP_RX_NAK || usb_dbnak((uint32_t) n)) {
+		return HOST_USB_NAK;
+	}
+	usb_store(desc, data, len);
+	EPR(n) = (uint16_t) (((epr & ~USB_EP_SETUP) ^ USB_EP_DTOG_RX)
+			     | USB_EP_CTR_RX);
+	if (!(epr & USB_EP_KIND)) {
+		usb_stat((uint32_t) n, USB_EPRX_STAT, USB_EP_RX_NAK);
+	}
+	usb_commit();
+	return HOST_USB_ACK;
+}
+
+enum host_usb_handshake host_usb_in(uint32_t addr, uint32_t ep,
+				    uint8_t *data, uint32_t *len)
+{
+	uint32_t desc;
+	uint32_t epr;
+	uint32_t i = 0;
+	int n;
+	usb_commit();
+	n = usb_lookup(addr, ep, USB_EPTX_STAT);
+	if (n < 0) {
+		return HOST_USB_TIMEOUT;
+	}
+	epr = EPR(n);
+	if ((epr & USB_EPTX_STAT) == USB_EP_TX_STALL) {
+		return HOST_USB_STALL;
+	}
+	if ((epr & USB_EPTX_STAT) == USB_EP_TX_NAK || usb_dbnak((uint32_t) n)) {
+		return HOST_USB_NAK;
+	}
+	desc = usb_desc((uint32_t) n, USB_EPTX_STAT);
+	*len = PMA(desc + 2U) & 0x3ffU;
+	while (i < *len) {
+		data[i] = (uint8_t) (PMA(PMA(desc) + i) >> ((i & 1U) << 3));
+		++i;
+	}
+	EPR(n) = (uint16_t) ((epr ^ USB_EP_DTOG_TX) | USB_EP_CTR_TX);
+	if (!(epr & USB_EP_KIND)) {
+		usb_stat((uint32_t) n, USB_EPTX_STAT, USB_EP_TX_NAK);
+	}
+	usb_commit();
+	return HOST_USB_ACK;
+}
+
+uint32_t host_usb_pending(void)
+{
+	usb_commit();
+	return usbistr & (host_usbreg.CNTR & 0xff00U);
+}
+
+uint32_t host_dma_addr(volatile void *ptr)
+{
+	uint32_t i = 0;
+	do {
+		if (dma_addr[i] == ptr || dma_addr[i] == NULL) {
+			dma_addr[i] = ptr;
+			return i + 1U;
+		}
+		++i;
+	} while (i < HOST_DMA_ADDRS);
+	return 0;
+}
+
+volatile void *host_dma_ptr(uint32_t addr)
+{
+	if (addr == 0 || addr > HOST_DMA_ADDRS) {
+		return NULL;
+	}
+	return dma_addr[addr - 1U];
+}
+
+void host_bkpt(uint32_t cond)
+{
+	host_bkpt_count[cond & 0xffU]++;
+}
+
+void host_barrier(void)
+{
+	if (host_preempt != NULL) {
+		host_preempt();
+	}
+}
+
+void host_sync(void)
+{
+	gpio_commit(&host_gpioa);
+	gpio_commit(&host_gpioc);
+	crc_commit();
+	flash_commit();
+	usb_commit();
+}
+
+// Busy waits advance the uptime directly
+void delay_uptime(uint32_t delay)
+{
+	Uptime += delay;
+}
+
+void delay_ms(uint32_t delay)
+{
+	delay_uptime(delay << 3);
+}
+
+void host_init(void)
+{
+	memset(&host_scb, 0, sizeof(host_scb));
+	memset(&host_systick, 0, sizeof(host_systick));
+	memset(&host_nvic, 0, sizeof(host_nvic));
+	memset(&host_itm, 0, sizeof(host_itm));
+	memset(&host_coredebug, 0, sizeof(host_coredebug));
+	memset(&host_mpu, 0, sizeof(host_mpu));
+	memset(&host_gpioa, 0, sizeof(host_gpioa));
+	memset(&host_gpioc, 0, sizeof(host_gpioc));
+	memset(&host_tim2, 0, sizeof(host_tim2));
+	memset(&host_tim3, 0, sizeof(host_tim3));
+	memset(&host_uart5, 0, sizeof(host_uart5));
+	memset(&host_crcreg, 0, sizeof(host_crcreg));
+	memset(&host_rcc, 0, sizeof(host_rcc));
+	memset(&host_iwdg, 0, sizeof(host_iwdg));
+	memset(&host_flashreg, 0, sizeof(host_flashreg));
+	memset(&host_dma1, 0, sizeof(host_dma1));
+	memset(&host_dma1ch2, 0, sizeof(host_dma1ch2));
+	memset(&host_usbreg, 0, sizeof(host_usbreg));
+	memset(host_pma, 0, sizeof(host_pma));
+	usbistr = 0;
+	memset((void *)dma_addr, 0, sizeof(dma_addr));
+	memset(host_bkpt_count, 0, sizeof(host_bkpt_count));
+	host_resets = 0;
+
+	// Reset values
+	host_crcreg.INIT = 0xffffffffUL;
+	host_crcreg.POL = 0x04c11db7UL;
+	host_crcreg.DR = 0xffffffffUL;
+	crcstate.crc = 0xffffffffUL;
+	crcstate.dr = 0xffffffffUL;
+	host_tim2.ARR = 0xffffffffUL;
+	host_tim3.ARR = 0xffffU;
+
+	// Breakpoints are counted rather than halting
+	host_coredebug.DHCSR = CoreDebug_DHCSR_C_DEBUGEN_Msk;
+
+	// Erased flash with ROM options
+	memset(host_flash, 0xff, sizeof(host_flash));
+	memcpy(OPTION, &rom, sizeof(rom));
+
+	Uptime = 0;
+}
@@ -0,0 +1,351 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Host peripheral model
+ *
+ * Force-included ahead of every source in the host build. Replaces
+ * the Cortex-M4 core header with host equivalents and redirects the
+ * device peripherals used by the firmware to in-memory register files.
+ *
+ * GPIO, CRC, flash controller and USB accesses pass through an
+ * accessor which commits the previous access before returning the
+ * register file, so that set/reset writes, CRC data writes, page
+ * erases and interrupt flag clears take effect in program order.
+ * Call host_sync() after returning from a handler to commit the
+ * final access.
+ */
+#ifndef HOST_H
+#define HOST_H
+#include <stdint.h>
+
+// Skip the target core header, provide host equivalents below
+#define __CORE_CM4_H_GENERIC
+#define __CORE_CM4_H_DEPENDANT
+#define __I	volatile const
+#define __O	volatile
+#define __IO	volatile
+#define __IM	volatile const
+#define __OM	volatile
+#define __IOM	volatile
+#define __ASM	__asm__
+#define __INLINE		inline
+#define __STATIC_INLINE		static inline
+
+// Intrinsics
+#define __BKPT(value)	host_bkpt(value)
+#define __DSB()		barrier()
+#define __DMB()		barrier()
+#define __ISB()		barrier()
+#define __NOP()		do { } while (0)
+
+// Byte writes to the CRC data register
+#define CRC_BYTE(val)	host_crc_byte(val)
+
+// Sysex CRC-7 is computed from the table while host_crc7_table is set,
+// otherwise through the CRC model
+#define CRC7_LOOKUP	host_crc7_table
+
+// Barriers are where a check may preempt the caller with a handler
+#define barrier()	do { host_barrier(); \
+		__asm__ __volatile__("": : :"memory"); } while (0)
+
+// DMA addresses are handles to host pointers
+#define DMA_ADDR(ptr)	host_dma_addr((volatile void *) (ptr))
+
+// USB endpoint register writes apply toggle and clear-by-zero fields
+#define USB_EPR_WRITE(n, val)	host_usb_epr((n), (val))
+
+// Firmware entry point is renamed so host programs may provide main()
+#define main firmware_main
+#include "stm32f3xx.h"
+#ifndef HOST_FIRMWARE
+#undef main
+void firmware_main(void);
+#endif
+
+// Core peripherals
+typedef struct {
+	__IM uint32_t CPUID;
+	__IOM uint32_t ICSR;
+	__IOM uint32_t VTOR;
+	__IOM uint32_t AIRCR;
+	__IOM uint32_t SCR;
+	__IOM uint32_t CCR;
+	__IOM uint8_t SHP[12U];
+	__IOM uint32_t SHCSR;
+} SCB_Type;
+
+typedef struct {
+	__IOM uint32_t CTRL;
+	__IOM uint32_t LOAD;
+	__IOM uint32_t VAL;
+	__IM uint32_t CALIB;
+} SysTick_Type;
+
+typedef struct {
+	__IOM uint32_t ISER[8U];
+	__IOM uint32_t ICER[8U];
+	__IOM uint32_t ISPR[8U];
+	__IOM uint32_t ICPR[8U];
+	__IOM uint32_t IABR[8U];
+	__IOM uint8_t IP[240U];
+} NVIC_Type;
+
+typedef struct {
+	__OM union {
+		__OM uint8_t u8;
+		__OM uint16_t u16;
+		__OM uint32_t u32;
+	} PORT[32U];
+	__IOM uint32_t TER;
+	__IOM uint32_t TCR;
+} ITM_Type;
+
+typedef struct {
+	__IOM uint32_t DHCSR;
+	__OM uint32_t DCRSR;
+	__IOM uint32_t DCRDR;
+	__IOM uint32_t DEMCR;
+} CoreDebug_Type;
+
+typedef struct {
+	__IM uint32_t TYPE;
+	__IOM uint32_t CTRL;
+	__IOM uint32_t RNR;
+	__IOM uint32_t RBAR;
+	__IOM uint32_t RASR;
+} MPU_Type;
+
+#define SCB_ICSR_PENDSVSET_Msk		(1U << 28U)
+#define SCB_ICSR_PENDSVCLR_Msk		(1U << 27U)
+#define SCB_ICSR_PENDSTSET_Msk		(1U << 26U)
+#define SCB_AIRCR_VECTKEY_Pos		16U
+#define SCB_AIRCR_PRIGROUP_Pos		8U
+#define SCB_AIRCR_PRIGROUP_Msk		(7U << SCB_AIRCR_PRIGROUP_Pos)
+#define SCB_SCR_SLEEPONEXIT_Msk		(1U << 1U)
+#define SysTick_CTRL_COUNTFLAG_Msk	(1U << 16U)
+#define SysTick_CTRL_CLKSOURCE_Msk	(1U << 2U)
+#define SysTick_CTRL_TICKINT_Msk	(1U << 1U)
+#define SysTick_CTRL_ENABLE_Msk		(1U << 0U)
+#define CoreDebug_DHCSR_C_DEBUGEN_Msk	(1U << 0U)
+#define MPU_RBAR_VALID_Msk		(1U << 4U)
+
+// In-memory register files
+extern SCB_Type host_scb;
+extern SysTick_Type host_systick;
+extern NVIC_Type host_nvic;
+extern ITM_Type host_itm;
+extern CoreDebug_Type host_coredebug;
+extern MPU_Type host_mpu;
+extern GPIO_TypeDef host_gpioa;
+extern GPIO_TypeDef host_gpioc;
+extern TIM_TypeDef host_tim2;
+extern TIM_TypeDef host_tim3;
+extern USART_TypeDef host_uart5;
+extern CRC_TypeDef host_crcreg;
+extern RCC_TypeDef host_rcc;
+extern IWDG_TypeDef host_iwdg;
+extern FLASH_TypeDef host_flashreg;
+extern DMA_TypeDef host_dma1;
+extern DMA_Channel_TypeDef host_dma1ch2;
+extern uint32_t host_flash[];
+extern USB_TypeDef host_usbreg;
+extern uint16_t host_pma[];
+
+#define SCB		(&host_scb)
+#define SysTick		(&host_systick)
+#define NVIC		(&host_nvic)
+#define ITM		(&host_itm)
+#define CoreDebug	(&host_coredebug)
+#define MPU		(&host_mpu)
+#undef GPIOA
+#define GPIOA		(host_gpio(&host_gpioa))
+#undef GPIOC
+#define GPIOC		(host_gpio(&host_gpioc))
+#undef TIM2
+#define TIM2		(&host_tim2)
+#undef TIM3
+#define TIM3		(&host_tim3)
+#undef UART5
+#define UART5		(&host_uart5)
+#undef CRC
+#define CRC		(host_crc())
+#undef RCC
+#define RCC		(&host_rcc)
+#undef IWDG
+#define IWDG		(&host_iwdg)
+#undef FLASH
+#define FLASH		(host_flashctl())
+#undef DMA1
+#define DMA1		(&host_dma1)
+#undef DMA1_Channel2
+#define DMA1_Channel2	(&host_dma1ch2)
+#undef FLASH_BASE
+#define FLASH_BASE	((uintptr_t) host_flash)
+#undef USB
+#define USB		(host_usb())
+#undef USB_PMAADDR
+#define USB_PMAADDR	((uintptr_t) host_pma)
+
+// Committed GPIO write register
+enum host_gpio_reg {
+	HOST_GPIO_BSRR,
+	HOST_GPIO_BRR,
+};
+
+// Optional observer called for each non-zero GPIO write before it
+// is applied to ODR
+extern void (*host_gpio_write)(GPIO_TypeDef * port,
+			       enum host_gpio_reg reg, uint32_t val);
+
+// Optional hook called at each barrier(), standing in for an
+// interrupt taken at that point
+extern void (*host_preempt)(void);
+
+// Count of BREAKPOINT() hits by label
+extern uint32_t host_bkpt_count[256U];
+
+// Count of system resets requested
+extern uint32_t host_resets;
+
+// Sysex CRC-7 source, starts as the build selects
+extern uint32_t host_crc7_table;
+
+// Commit pending writes and return GPIO register file
+GPIO_TypeDef *host_gpio(GPIO_TypeDef * port);
+
+// Commit pending writes and return CRC register file
+CRC_TypeDef *host_crc(void);
+
+// Feed a single byte to the CRC model
+void host_crc_byte(uint32_t val);
+
+// Complete a started page erase and return flash register file
+FLASH_TypeDef *host_flashctl(void);
+
+// Return a 32 bit DMA address handle for a host pointer
+uint32_t host_dma_addr(volatile void *ptr);
+
+// Return the host pointer for a DMA address handle
+volatile void *host_dma_ptr(uint32_t addr);
+
+// Commit pending interrupt flag clears and return USB register file
+USB_TypeDef *host_usb(void);
+
+// Write USB endpoint register n with hardware field semantics
+void host_usb_epr(uint32_t n, uint32_t val);
+
+// Handshake seen by the host for a USB transaction
+enum host_usb_handshake {
+	HOST_USB_ACK,
+	HOST_USB_NAK,
+	HOST_USB_STALL,
+	HOST_USB_TIMEOUT,	// no reply
+};
+
+// Signal a bus reset to the USB peripheral
+void host_usb_reset(void);
+
+// Start a frame, advancing the frame number
+void host_usb_sof(void);
+
+// Send the 8 byte SETUP packet to endpoint 0 of device addr
+enum host_usb_handshake host_usb_setup(uint32_t addr, const uint8_t *setup);
+
+// Send an OUT data packet of len bytes to endpoint ep of device addr
+enum host_usb_handshake host_usb_out(uint32_t addr, uint32_t ep,
+				     const uint8_t *data, uint32_t len);
+
+// Take an IN data packet from endpoint ep of device addr, len is set
+// to its length
+enum host_usb_handshake host_usb_in(uint32_t addr, uint32_t ep,
+				    uint8_t *data, uint32_t *len);
+
+// Return the USB interrupt flags raised and enabled
+uint32_t host_usb_pending(void);
+
+// Record a breakpoint
+void host_bkpt(uint32_t cond);
+
+// Run the preemption hook if one is set
+void host_barrier(void);
+
+// Commit all pending peripheral writes
+void host_sync(void);
+
+// Reset the peripheral model and load ROM options into flash
+void host_init(void);
+
+// NVIC access
+static inline void NVIC_SetPriorityGrouping(uint32_t group)
+{
+	uint32_t reg = SCB->AIRCR & ~(0xffffU << SCB_AIRCR_VECTKEY_Pos
+				      | SCB_AIRCR_PRIGROUP_Msk);
+	SCB->AIRCR = reg | (0x5faU << SCB_AIRCR_VECTKEY_Pos)
+	    | ((group & 7U) << SCB_AIRCR_PRIGROUP_Pos);
+}
+
+static inline uint32_t NVIC_GetPriorityGrouping(void)
+{
+	return (SCB->AIRCR & SCB_AIRCR_PRIGROUP_Msk) >> SCB_AIRCR_PRIGROUP_Pos;
+}
+
+static inline void NVIC_EnableIRQ(IRQn_Type irqn)
+{
+	if ((int32_t) irqn >= 0) {
+		uint32_t n = (uint32_t) irqn;
+		NVIC->ISER[n >> 5U] |= 1U << (n & 0x1fU);
+	}
+}
+
+static inline void NVIC_DisableIRQ(IRQn_Type irqn)
+{
+	if ((int32_t) irqn >= 0) {
+		uint32_t n = (uint32_t) irqn;
+		NVIC->ISER[n >> 5U] &= ~(1U << (n & 0x1fU));
+	}
+}
+
+static inline void NVIC_SetPendingIRQ(IRQn_Type irqn)
+{
+	if ((int32_t) irqn >= 0) {
+		uint32_t n = (uint32_t) irqn;
+		NVIC->ISPR[n >> 5U] |= 1U << (n & 0x1fU);
+	}
+}
+
+static inline uint32_t NVIC_GetEnableIRQ(IRQn_Type irqn)
+{
+	if ((int32_t) irqn >= 0) {
+		uint32_t n = (uint32_t) irqn;
+		return (NVIC->ISER[n >> 5U] >> (n & 0x1fU)) & 1U;
+	}
+	return 1U;
+}
+
+static inline void NVIC_SetPriority(IRQn_Type irqn, uint32_t priority)
+{
+	uint8_t val = (uint8_t) ((priority << (8U - __NVIC_PRIO_BITS)) & 0xffU);
+	if ((int32_t) irqn >= 0) {
+		NVIC->IP[(uint32_t) irqn] = val;
+	} else {
+		SCB->SHP[((uint32_t) irqn & 0xfU) - 4U] = val;
+	}
+}
+
+// Reset is counted and execution carries on
+static inline void NVIC_SystemReset(void)
+{
+	host_resets++;
+}
+
+static inline uint32_t NVIC_GetPriority(IRQn_Type irqn)
+{
+	if ((int32_t) irqn >= 0) {
+		return NVIC->IP[(uint32_t) irqn] >> (8U - __NVIC_PRIO_BITS);
+	}
+	return SCB->SHP[((uint32_t) irqn & 0xfU) - 4U] >>
+	    (8U - __NVIC_PRIO_BITS);
+}
+
+#endif // HOST_H
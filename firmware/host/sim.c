@@ -0,0 +1,1164 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Discrete-event simulator
+ *
+ * Runs the host build of the firmware against a virtual core clock.
+ * SysTick, TIM2, TIM3, DMA1 channel 2, UART5 and PendSV are scheduled
+ * from the register state left by the firmware, and dispatched
+ * according to the NVIC priorities programmed in uptime_init(),
+ * timer_init(), trigger_init() and midi_uart_init().
+ *
+ * Handlers run to completion on the host at their virtual start time
+ * and then occupy the virtual core for a fixed cycle cost. PendSV
+ * is charged a further cost for each event it releases, counted by
+ * wrapping midi_event_done() at link time. A pending handler
+ * preempts only if its group priority is higher than the active
+ * handler, otherwise it waits for completion.
+ *
+ * TIM2 update DMA requests are served at the update event, writing
+ * the next word of the circular buffer to its peripheral address
+ * without core involvement.
+ *
+ * A synthetic MIDI clock source (with optional note traffic) drives
+ * the UART5 receiver at 31250 baud. An optional USB-MIDI source
+ * enumerates the device at boot, then queues event packets at a
+ * steady rate and sends them to the bulk OUT endpoint through the
+ * USB peripheral model, up to a full packet per transaction and
+ * retrying when the endpoint NAKs, so that both receive paths
+ * interleave with PendSV. Like a host controller it starts sending
+ * only after each start of frame, behind a random share of bus time
+ * taken by other devices. The clock may be sent over USB instead of
+ * the UART, and in the USB-MIDI 2.0 alternate setting as universal
+ * MIDI packets, each behind a JR timestamp of when it was due, with
+ * a JR clock at the start of a transfer now and then. The
+ * transactions accepted per frame are reported against the bus
+ * limit. Every GPIOC BSRR/BRR write is logged with its virtual time
+ * in nanoseconds, and a summary of the
+ * DIN clock edge timing against the source clock and of the gate
+ * pulse widths, and of the delay from clock byte arrival to the TIM2
+ * period update, is printed on exit.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "stm32f3xx.h"
+#include "midi.h"
+#include "midi_event.h"
+#include "midi_ump.h"
+#include "midi_usb.h"
+#include "flash.h"
+#include "settings.h"
+#include "usb.h"
+
+#define SIM_ENTRY	12U	// exception entry latency in cycles
+#define SIM_EVENTCOST	120U	// PendSV cycles per event handled
+#define SIM_BYTETIME	(SYSTEMCORECLOCK * 10U / 31250U)
+#define SIM_MAXDEPTH	8U
+#define SIM_DINCK	GPIO_ODR_0
+#define SIM_GATES	(GPIO_ODR_3 | GPIO_ODR_15 | GPIO_ODR_13)
+#define SIM_USBADDR	1U
+#define SIM_USBBIT	(SYSTEMCORECLOCK / 12000000U)	// full speed bit time
+#define SIM_USBFRAME	(SYSTEMCORECLOCK / 1000U)
+#define SIM_USBMAX	16U	// bulk transactions scheduled per frame
+#define SIM_USBPKTS	(USB_ENDPOINT_SIZE / 4U)	// event packets per transfer
+#define SIM_USBBUSY	(SIM_USBFRAME / 8U)	// other traffic after SOF, at most
+#define SIM_USBTICK	(SYSTEMCORECLOCK / MIDI_UMP_JRRATE)	// JR clock tick
+#define SIM_USBJR	(SYSTEMCORECLOCK / 4U)	// JR clock interval
+
+// Interrupt sources
+enum sim_irq {
+	SIM_TIM2,
+	SIM_DMA,
+	SIM_TIM3,
+	SIM_SYSTICK,
+	SIM_UART5,
+	SIM_USB,
+	SIM_PENDSV,
+	SIM_NRIRQ,
+};
+
+struct sim_source {
+	const char *name;
+	IRQn_Type irqn;
+	void (*handler)(void);
+	uint32_t cost;		// cycles occupied per call
+	uint32_t event;		// cycles per event released
+	uint32_t pending;
+	uint64_t count;
+};
+
+static struct sim_source source[SIM_NRIRQ] = {
+	{ "tim2", TIM2_IRQn, timer_update, 250U, 0, 0, 0 },
+	{ "dma", DMA1_Channel2_IRQn, timer_dma, 400U, 0, 0, 0 },
+	{ "tim3", TIM3_IRQn, trigger_expire, 80U, 0, 0, 0 },
+	{ "systick", SysTick_IRQn, ms_timer, 24U, 0, 0, 0 },
+	{ "uart5", UART5_IRQn, midi_uart_receive, 120U, 0, 0, 0 },
+	{ "usb", USB_LP_CAN_RX0_IRQn, usb_irq, 200U, 0, 0, 0 },
+	{ "pendsv", PendSV_IRQn, system_update, 400U, SIM_EVENTCOST, 0, 0 },
+};
+
+// Events released by the running handler
+static uint32_t released;
+
+// Linked with --wrap, counts events handled by system_update()
+void __real_midi_event_done(void);
+void __wrap_midi_event_done(void);
+void __wrap_midi_event_done(void)
+{
+	released++;
+	__real_midi_event_done();
+}
+
+// Active handler stack
+static struct sim_frame {
+	enum sim_irq irq;
+	uint64_t remain;
+} stack[SIM_MAXDEPTH];
+static uint32_t depth;
+
+// Virtual core clock in cycles
+static uint64_t sim_now;
+
+// Periodic peripheral state
+static struct sim_timer {
+	uint64_t next;		// cycle of next update
+	uint64_t last;		// cycle of last update
+	uint32_t enabled;
+} systick, tim2;
+
+// TIM3 free running count, channel 1 compare and channel 2 capture
+static struct sim_counter {
+	uint64_t base;		// cycle of count zero
+	uint64_t match;		// cycle of next compare match
+	uint32_t ccr;		// compare value of match
+	uint32_t enabled;
+} tim3;
+
+// TIM2 update DMA channel state
+static struct sim_dma {
+	uint32_t enabled;
+	uint32_t reload;	// transfer count at enable
+	uint32_t cndtr;		// count left by last transfer
+} dma;
+
+// Synthetic MIDI source
+static struct sim_midi {
+	uint64_t period;	// clock period in cycles
+	uint64_t jitter;	// max send jitter in cycles
+	uint64_t clock;		// next clock due
+	uint64_t note;		// next note message due
+	uint64_t notegap;	// mean note interval in cycles
+	uint64_t line;		// line free from cycle
+	uint64_t arrive;	// time of next byte arrival
+	uint64_t idle;		// time of idle line detection, 0 if none
+	uint64_t start;		// cycle of start message
+	uint32_t byte;		// next byte value
+	uint8_t msg[3];		// pending message bytes
+	uint32_t msglen;
+	uint32_t msgpos;
+	uint32_t noteon;
+	uint32_t started;
+	uint64_t clocks;	// clock bytes sent
+} midi;
+
+// Synthetic USB-MIDI source, the host queues event packets at a
+// steady rate and sends as many as fit in each bulk transaction
+static struct sim_usb {
+	uint32_t on;		// device enumerated and frames running
+	uint32_t clock;		// start and clock sent here, not on the UART
+	uint32_t ump;		// universal MIDI packets with JR timestamps
+	uint64_t jrclock;	// cycle of last JR clock accepted
+	uint64_t gap;		// note packet interval in cycles, 0 if none
+	uint64_t start;		// cycle of first packet
+	uint64_t next;		// next bus transaction due
+	uint64_t sof;		// next start of frame
+	uint32_t inframe;	// transactions accepted in frame
+	uint64_t notes;		// note packets accepted
+	uint64_t sent;		// event packets accepted
+	uint64_t transfers;	// transactions accepted
+	uint64_t naks;		// transactions refused by the endpoint
+} usb;
+
+// Edge statistics
+static struct sim_stats {
+	uint64_t warmup;	// ignore edges before this cycle
+	uint64_t last;		// last rising edge
+	uint64_t edges;
+	double sum;
+	double sumsq;
+	double min;
+	double max;
+	double psum;
+	double psumsq;
+	double pmin;
+	double pmax;
+	double lockns;		// phase bound for lock
+	uint64_t unlock;	// last edge outside lock bound
+} stats;
+
+// Gate pulse widths
+static struct sim_pulses {
+	uint64_t rise[16];	// last rising edge per pin
+	uint64_t count;
+	double sum;
+	double sumsq;
+	double min;
+	double max;
+} pulses;
+
+/* Clock byte arrival to TIM2 period update
+ *
+ * timer_clock() traces its phase error on ITM port 2 as it sets the
+ * period. The port is loaded with a marker at each clock arrival.
+ */
+#define SIM_TRACEMARK	0x80000000U
+static struct sim_latency {
+	uint64_t arrive;	// arrival of last clock byte
+	uint32_t open;		// waiting for a period update
+	uint64_t count;
+	double sum;
+	double max;
+} latency;
+
+static FILE *logfile;
+static uint32_t seed = 1U;
+
+// Deterministic PRNG
+static uint32_t sim_rand(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+// Return a value in [0, range)
+static uint64_t sim_randrange(uint64_t range)
+{
+	if (range == 0U) {
+		return 0U;
+	}
+	return (((uint64_t) sim_rand() << 32) | sim_rand()) % range;
+}
+
+// Convert cycles to nanoseconds
+static double sim_ns(uint64_t cycles)
+{
+	return (double)cycles * 1e9 / (double)SYSTEMCORECLOCK;
+}
+
+// Convert nanoseconds to cycles
+static uint64_t sim_cycles(double ns)
+{
+	return (uint64_t) (ns * (double)SYSTEMCORECLOCK / 1e9 + 0.5);
+}
+
+// Return group priority of source for the programmed grouping
+static uint32_t sim_group(enum sim_irq irq)
+{
+	uint32_t prio = NVIC_GetPriority(source[irq].irqn)
+	    << (8U - __NVIC_PRIO_BITS);
+	uint32_t shift = NVIC_GetPriorityGrouping() + 1U;
+	return shift < 8U ? prio >> shift : 0U;
+}
+
+// Return full priority of source, lower is more urgent
+static uint32_t sim_prio(enum sim_irq irq)
+{
+	return (NVIC_GetPriority(source[irq].irqn) << 8) | (uint32_t) irq;
+}
+
+// Track rising edges on the DIN clock output
+static void sim_edge(uint32_t set)
+{
+	if (!(set & SIM_DINCK) || (host_gpioc.ODR & SIM_DINCK)) {
+		return;
+	}
+	uint64_t t = sim_now;
+	if (!midi.started || !stats.last) {
+		stats.last = t;
+		return;
+	}
+
+	// phase against source clock grid
+	double per = sim_ns(midi.period);
+	double ph = fmod(sim_ns(t - midi.start), per);
+	if (ph > per / 2.0)
+		ph -= per;
+	if (fabs(ph) > stats.lockns)
+		stats.unlock = t;
+
+	if (t >= stats.warmup) {
+		double dt = sim_ns(t - stats.last);
+		if (!stats.edges || dt < stats.min)
+			stats.min = dt;
+		if (!stats.edges || dt > stats.max)
+			stats.max = dt;
+		stats.sum += dt;
+		stats.sumsq += dt * dt;
+		if (!stats.edges || ph < stats.pmin)
+			stats.pmin = ph;
+		if (!stats.edges || ph > stats.pmax)
+			stats.pmax = ph;
+		stats.psum += ph;
+		stats.psumsq += ph * ph;
+		stats.edges++;
+	}
+	stats.last = t;
+}
+
+// Record widths of gate pulses ending with this write
+static void sim_pulse(uint32_t set, uint32_t clr)
+{
+	uint32_t odr = host_gpioc.ODR;
+	uint32_t i = 0;
+	do {
+		uint32_t pin = 1U << i;
+		if (SIM_GATES & pin) {
+			if ((clr & pin) && (odr & pin)) {
+				double w = sim_ns(sim_now - pulses.rise[i]);
+				if (!pulses.count || w < pulses.min)
+					pulses.min = w;
+				if (!pulses.count || w > pulses.max)
+					pulses.max = w;
+				pulses.sum += w;
+				pulses.sumsq += w * w;
+				pulses.count++;
+			} else if ((set & pin) && !(odr & pin)) {
+				pulses.rise[i] = sim_now;
+			}
+		}
+		++i;
+	} while (i < 16U);
+}
+
+// Log a committed GPIOC write
+static void sim_gpio(GPIO_TypeDef * port, enum host_gpio_reg reg,
+		     uint32_t val)
+{
+	if (port != &host_gpioc) {
+		return;
+	}
+	if (logfile != NULL) {
+		fprintf(logfile, "%.1f %s 0x%08x\n", sim_ns(sim_now),
+			reg == HOST_GPIO_BSRR ? "BSRR" : "BRR", val);
+	}
+	if (reg == HOST_GPIO_BSRR) {
+		sim_edge(val & 0xffffU);
+		sim_pulse(val & 0xffffU, val >> 16);
+	} else {
+		sim_pulse(0, val & 0xffffU);
+	}
+}
+
+// Track enable of DMA1 channel 2, a count written by the firmware
+// restarts the buffer
+static void sim_dma_enable(void)
+{
+	DMA_Channel_TypeDef *ch = &host_dma1ch2;
+	if (ch->CCR & DMA_CCR_EN) {
+		if (!dma.enabled || ch->CNDTR != dma.cndtr) {
+			dma.enabled = 1U;
+			dma.reload = ch->CNDTR;
+			dma.cndtr = ch->CNDTR;
+		}
+	} else {
+		dma.enabled = 0;
+	}
+}
+
+// Serve a TIM2 update DMA request on DMA1 channel 2
+static void sim_dma(void)
+{
+	DMA_Channel_TypeDef *ch = &host_dma1ch2;
+	sim_dma_enable();
+	if (!(host_tim2.DIER & TIM_DIER_UDE) || !(ch->CCR & DMA_CCR_EN)
+	    || !ch->CNDTR) {
+		return;
+	}
+	volatile uint32_t *src = host_dma_ptr(ch->CMAR);
+	volatile uint32_t *dst = host_dma_ptr(ch->CPAR);
+	if (src != NULL && dst != NULL) {
+		*dst = src[dma.reload - ch->CNDTR];
+		host_sync();
+	}
+	ch->CNDTR--;
+	uint32_t flags = 0;
+	if (ch->CNDTR == dma.reload >> 1) {
+		flags = DMA_ISR_HTIF2;
+	} else if (ch->CNDTR == 0) {
+		flags = DMA_ISR_TCIF2;
+		if (ch->CCR & DMA_CCR_CIRC) {
+			ch->CNDTR = dma.reload;
+		}
+	}
+	dma.cndtr = ch->CNDTR;
+	if (flags) {
+		host_dma1.ISR |= flags | DMA_ISR_GIF2;
+		if (((flags & DMA_ISR_HTIF2) && (ch->CCR & DMA_CCR_HTIE))
+		    || ((flags & DMA_ISR_TCIF2) && (ch->CCR & DMA_CCR_TCIE))) {
+			source[SIM_DMA].pending = 1U;
+		}
+	}
+}
+
+/* Present timer counts at the current time
+ *
+ * Counts hold at their reload value until the next update has been
+ * raised, so they always agree with the update state.
+ */
+static void sim_counts(void)
+{
+	if (tim3.enabled) {
+		host_tim3.CNT = (uint32_t) ((sim_now - tim3.base)
+					    / (host_tim3.PSC + 1U)) & 0xffffU;
+	}
+	if (tim2.enabled) {
+		uint64_t n = sim_now - tim2.last;
+		host_tim2.CNT = n < host_tim2.ARR ? (uint32_t) n : host_tim2.ARR;
+	}
+	if (systick.enabled) {
+		uint64_t n = sim_now - systick.last;
+		host_systick.VAL = n < host_systick.LOAD
+		    ? host_systick.LOAD - (uint32_t) n : 0;
+	}
+}
+
+// Schedule the next TIM3 channel 1 compare match after CCR1 changes
+static void sim_tim3_match(void)
+{
+	if (host_tim3.CCR1 == tim3.ccr) {
+		return;
+	}
+	tim3.ccr = host_tim3.CCR1;
+	uint64_t div = host_tim3.PSC + 1U;
+	uint64_t n = (sim_now - tim3.base) / div;
+	uint64_t d = (host_tim3.CCR1 - n) & 0xffffU;
+	tim3.match = tim3.base + (n + (d ? d : 0x10000U)) * div;
+}
+
+/* Capture the TIM3 count on a TIM2 update
+ *
+ * TIM2 update drives TRGO when MMS selects it, and TIM3 channel 2
+ * captures its count on ITR1 when set as input on TRC.
+ */
+static void sim_trgo(void)
+{
+	if ((host_tim2.CR2 & TIM_CR2_MMS) != TIM_CR2_MMS_1 || !tim3.enabled
+	    || (host_tim3.SMCR & TIM_SMCR_TS) != TIM_SMCR_TS_0
+	    || (host_tim3.CCMR1 & TIM_CCMR1_CC2S) != TIM_CCMR1_CC2S
+	    || !(host_tim3.CCER & TIM_CCER_CC2E)) {
+		return;
+	}
+	host_tim3.CCR2 = (uint32_t) ((sim_now - tim3.base)
+				     / (host_tim3.PSC + 1U)) & 0xffffU;
+	if (host_tim3.SR & TIM_SR_CC2IF) {
+		host_tim3.SR |= TIM_SR_CC2OF;
+	}
+	host_tim3.SR |= TIM_SR_CC2IF;
+	if (host_tim3.DIER & TIM_DIER_CC2IE) {
+		source[SIM_TIM3].pending = 1U;
+	}
+}
+
+// Update timer schedules from register state after a handler
+static void sim_peripherals(void)
+{
+	// SysTick
+	uint32_t on = SysTick_CTRL_ENABLE_Msk | SysTick_CTRL_TICKINT_Msk;
+	if ((host_systick.CTRL & on) == on) {
+		if (!systick.enabled) {
+			systick.enabled = 1U;
+			systick.next = sim_now + host_systick.LOAD + 1U;
+			systick.last = sim_now;
+		}
+	} else {
+		systick.enabled = 0;
+	}
+
+	// TIM3: update generation restarts count, compare follows CCR1
+	if (host_tim3.EGR & TIM_EGR_UG) {
+		host_tim3.EGR = 0;
+		host_tim3.CNT = 0;
+		tim3.base = sim_now;
+		tim3.ccr = ~host_tim3.CCR1;
+	}
+	if (host_tim3.CR1 & TIM_CR1_CEN) {
+		if (!tim3.enabled) {
+			tim3.enabled = 1U;
+			tim3.base = sim_now - (uint64_t)host_tim3.CNT
+			    * (host_tim3.PSC + 1U);
+			tim3.ccr = ~host_tim3.CCR1;
+		}
+		sim_tim3_match();
+	} else {
+		tim3.enabled = 0;
+	}
+
+	// TIM2: update generation reloads counter and raises UIF
+	if (host_tim2.EGR & TIM_EGR_UG) {
+		host_tim2.EGR = 0;
+		host_tim2.CNT = 0;
+		tim2.next = sim_now + host_tim2.ARR + 1U;
+		tim2.last = sim_now;
+		if (host_tim2.DIER & TIM_DIER_UIE) {
+			host_tim2.SR |= TIM_SR_UIF;
+			source[SIM_TIM2].pending = 1U;
+		}
+		sim_trgo();
+		sim_dma();
+	}
+	if (host_tim2.CR1 & TIM_CR1_CEN) {
+		if (!tim2.enabled) {
+			tim2.enabled = 1U;
+			tim2.next = sim_now + host_tim2.ARR + 1U - host_tim2.CNT;
+			tim2.last = sim_now - host_tim2.CNT;
+		}
+	} else {
+		tim2.enabled = 0;
+	}
+
+	// DMA: track enable, clear interrupt flags
+	sim_dma_enable();
+	if (host_dma1.IFCR & DMA_IFCR_CGIF2) {
+		host_dma1.ISR &= ~(DMA_ISR_GIF2 | DMA_ISR_TCIF2 |
+				   DMA_ISR_HTIF2 | DMA_ISR_TEIF2);
+	}
+	host_dma1.ISR &= ~host_dma1.IFCR;
+	host_dma1.IFCR = 0;
+
+	// UART5: data read clears RXNE, ICR clears error flags
+	if (!source[SIM_UART5].pending) {
+		host_uart5.ISR &= ~USART_ISR_RXNE;
+	}
+	if (host_uart5.ICR) {
+		host_uart5.ISR &= ~(host_uart5.ICR & (USART_ICR_FECF |
+						      USART_ICR_NCF |
+						      USART_ICR_ORECF |
+						      USART_ICR_IDLECF));
+		host_uart5.ICR = 0;
+	}
+
+	// PendSV
+	if (host_scb.ICSR & SCB_ICSR_PENDSVSET_Msk) {
+		host_scb.ICSR &= ~SCB_ICSR_PENDSVSET_Msk;
+		source[SIM_PENDSV].pending = 1U;
+	}
+
+	// USB: interrupt flags are held until cleared
+	if (host_usb_pending()) {
+		source[SIM_USB].pending = 1U;
+	}
+
+	// Interrupts set pending by the firmware
+	uint32_t i = 0;
+	do {
+		int32_t n = (int32_t) source[i].irqn;
+		if (n >= 0 && (host_nvic.ISPR[n >> 5] & (1U << (n & 0x1f)))) {
+			host_nvic.ISPR[n >> 5] &= ~(1U << (n & 0x1f));
+			source[i].pending = 1U;
+		}
+		++i;
+	} while (i < SIM_NRIRQ);
+}
+
+// Return non-zero if source may be taken by the core
+static uint32_t sim_enabled(enum sim_irq irq)
+{
+	return NVIC_GetEnableIRQ(source[irq].irqn);
+}
+
+// Select the most urgent pending source able to preempt
+static int sim_select(void)
+{
+	int sel = -1;
+	uint32_t i = 0;
+	do {
+		if (source[i].pending && sim_enabled((enum sim_irq)i)) {
+			if (sel < 0 || sim_prio((enum sim_irq)i)
+			    < sim_prio((enum sim_irq)sel)) {
+				sel = (int)i;
+			}
+		}
+		++i;
+	} while (i < SIM_NRIRQ);
+	if (sel >= 0 && depth) {
+		if (sim_group((enum sim_irq)sel)
+		    >= sim_group(stack[depth - 1U].irq)) {
+			sel = -1;
+		}
+	}
+	return sel;
+}
+
+// Run all handlers able to preempt at the current time
+static void sim_dispatch(void)
+{
+	int sel;
+	while ((sel = sim_select()) >= 0 && depth < SIM_MAXDEPTH) {
+		struct sim_source *src = &source[sel];
+		uint64_t t = sim_now;
+		src->pending = 0;
+		src->count++;
+		sim_now = t + SIM_ENTRY;
+		sim_counts();
+		released = 0;
+		src->handler();
+		host_sync();
+		if (host_itm.PORT[2].u32 != SIM_TRACEMARK) {
+			host_itm.PORT[2].u32 = SIM_TRACEMARK;
+			if (latency.open) {
+				double l = sim_ns(sim_now - latency.arrive);
+				if (l > latency.max)
+					latency.max = l;
+				latency.sum += l;
+				latency.count++;
+				latency.open = 0;
+			}
+		}
+		sim_peripherals();
+		sim_now = t;
+		stack[depth].irq = (enum sim_irq)sel;
+		stack[depth].remain = SIM_ENTRY + src->cost
+		    + (uint64_t) src->event * released;
+		depth++;
+	}
+}
+
+// Prepare the next byte on the synthetic MIDI line
+static void midi_next(void)
+{
+	uint64_t t = midi.line;
+	uint64_t due = usb.clock ? UINT64_MAX : midi.clock;
+
+	if (!usb.clock && !midi.started && midi.start <= due) {
+		due = midi.start;
+	}
+	if (midi.msgpos < midi.msglen) {
+		due = t;
+	} else if (midi.notegap && midi.note < due) {
+		due = midi.note;
+	}
+	if (due == UINT64_MAX) {
+		// Nothing left for the line
+		midi.arrive = UINT64_MAX;
+		return;
+	}
+	if (due > t) {
+		t = due;
+	}
+
+	if (!usb.clock && !midi.started && midi.start <= t) {
+		midi.byte = MIDI_RT_START;
+		midi.started = 1U;
+	} else if (!usb.clock && midi.clock <= t) {
+		midi.byte = MIDI_RT_CLOCK;
+		midi.clocks++;
+		midi.clock = midi.start + (midi.clocks + 1U) * midi.period
+		    + sim_randrange(midi.jitter);
+	} else if (midi.msgpos < midi.msglen) {
+		midi.byte = midi.msg[midi.msgpos++];
+	} else {
+		// Note on/off alternate on a fixed note
+		midi.msg[0] = midi.noteon ? MIDI_STATUS_NOTEOFF
+		    : MIDI_STATUS_NOTEON;
+		midi.msg[1] = 36U;
+		midi.msg[2] = 100U;
+		midi.msglen = 3U;
+		midi.msgpos = 1U;
+		midi.noteon = !midi.noteon;
+		midi.byte = midi.msg[0];
+		midi.note = t + 1U + sim_randrange(midi.notegap << 1);
+	}
+	midi.arrive = t + SIM_BYTETIME;
+	midi.line = midi.arrive;
+}
+
+// Deliver a received byte to the UART model
+static void midi_arrive(void)
+{
+	if (source[SIM_UART5].pending) {
+		// previous byte not yet read
+		host_uart5.ISR |= USART_ISR_ORE;
+	} else {
+		host_uart5.RDR = (uint16_t) midi.byte;
+		host_uart5.ISR |= USART_ISR_RXNE;
+		if (midi.byte == MIDI_RT_CLOCK) {
+			latency.arrive = sim_now;
+			latency.open = 1U;
+		}
+		if (host_uart5.CR1 & USART_CR1_RXNEIE) {
+			source[SIM_UART5].pending = 1U;
+		}
+	}
+	midi_next();
+	// Idle is detected after a frame with no start bit
+	if (midi.arrive - SIM_BYTETIME >= sim_now + SIM_BYTETIME) {
+		midi.idle = sim_now + SIM_BYTETIME;
+	}
+}
+
+// Run the USB interrupt while it has flags raised, at boot
+static void usb_service(void)
+{
+	while (host_usb_pending()) {
+		usb_irq();
+		host_sync();
+	}
+}
+
+// Complete a control transfer with any IN data stage, return the
+// length received or -1 if the device did not complete it
+static int usb_control(uint32_t addr, const uint8_t *setup, uint8_t *data)
+{
+	uint32_t wlength = setup[6] | (uint32_t) setup[7] << 8;
+	uint32_t got = 0;
+	uint32_t len;
+	uint8_t buf[USB_ENDPOINT_SIZE];
+	if (host_usb_setup(addr, setup) != HOST_USB_ACK) {
+		return -1;
+	}
+	usb_service();
+	if (setup[0] & USB_REQ_DIR_IN) {
+		do {
+			if (host_usb_in(addr, 0, buf, &len) != HOST_USB_ACK) {
+				return -1;
+			}
+			usb_service();
+			memcpy(data + got, buf, len);
+			got += len;
+		} while (len == USB_ENDPOINT_SIZE && got < wlength);
+		if (host_usb_out(addr, 0, NULL, 0) != HOST_USB_ACK) {
+			return -1;
+		}
+	} else if (host_usb_in(addr, 0, buf, &len) != HOST_USB_ACK || len) {
+		return -1;
+	}
+	usb_service();
+	return (int)got;
+}
+
+// Reset, address and configure the device, return zero on success
+static int usb_enumerate(void)
+{
+	uint8_t setaddr[8] = { 0, USB_REQ_SET_ADDRESS, SIM_USBADDR };
+	uint8_t getdev[8] = { USB_REQ_DIR_IN, USB_REQ_GET_DESCRIPTOR,
+		0, USB_DEVICE, 0, 0, USB_DEVLEN
+	};
+	uint8_t setcfg[8] = { 0, USB_REQ_SET_CONFIG,
+		OPTION->usb.configuration.cfg_bConfigurationValue
+	};
+	uint8_t getgtb[8] = { USB_REQ_DIR_IN | USB_REQ_INTERFACE,
+		USB_REQ_GET_DESCRIPTOR, USB_GR_TRM_BLOCK_HEADER, USB_CS_GR_TRM_BLOCK,
+		USB_MS_INTERFACE, 0, USB_GTBLEN
+	};
+	uint8_t setalt[8] = { USB_REQ_INTERFACE, USB_REQ_SET_INTERFACE,
+		USB_MS_UMP, 0, USB_MS_INTERFACE
+	};
+	uint8_t dev[USB_DEVLEN];
+	uint8_t gtb[USB_GTBLEN];
+	host_usb_reset();
+	usb_service();
+	if (usb_control(0, setaddr, NULL) < 0
+	    || usb_control(SIM_USBADDR, getdev, dev) != USB_DEVLEN
+	    || dev[1] != USB_DEVICE
+	    || usb_control(SIM_USBADDR, setcfg, NULL) < 0) {
+		return -1;
+	}
+	if (usb.ump
+	    && (usb_control(SIM_USBADDR, getgtb, gtb) != USB_GTBLEN
+		|| gtb[USB_GTBLEN - 5U] != USB_GTB_MIDI1_JRTS
+		|| usb_control(SIM_USBADDR, setalt, NULL) < 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Send queued packets of a note, controller, note off sequence
+ *
+ * Notes are merged in time order with the start and clock when they
+ * are sent over USB. Universal MIDI packets take a JR timestamp of
+ * the time each message was due, and a transfer starts with a JR
+ * clock of the time it is sent once SIM_USBJR has passed. A transaction occupies the bus for its bit time,
+ * and a NAK for the token and handshake before the host retries. At
+ * most SIM_USBMAX transactions are accepted in each frame, and once
+ * the queue is empty the host waits for the next frame.
+ */
+static void usb_send(void)
+{
+	static const uint8_t seq[3][3] = {
+		{ MIDI_STATUS_NOTEON, 38U, 100U },
+		{ MIDI_STATUS_CONTROL, 1U, 64U },
+		{ MIDI_STATUS_NOTEOFF, 38U, 0U },
+	};
+	uint32_t word[SIM_USBPKTS];
+	uint8_t buf[USB_ENDPOINT_SIZE];
+	uint64_t notes = usb.notes;
+	uint64_t clocks = midi.clocks;
+	uint64_t clock = midi.clock;
+	uint32_t started = midi.started;
+	uint32_t size = usb.ump ? 2U : 1U;
+	uint32_t jr = usb.ump && sim_now - usb.jrclock >= SIM_USBJR;
+	uint32_t i = 0;
+	uint32_t n = 0;
+	usb.next = UINT64_MAX;
+	if (usb.inframe == SIM_USBMAX) {
+		return;
+	}
+	if (jr) {
+		word[i++] = (uint32_t) MIDI_UMP_JRCLOCK << 20
+		    | (uint32_t) (sim_now / SIM_USBTICK & 0xffffU);
+	}
+	while (i + size <= SIM_USBPKTS) {
+		uint64_t nt = usb.gap ? usb.start + notes * usb.gap : UINT64_MAX;
+		uint64_t ct = !usb.clock ? UINT64_MAX
+		    : started ? clock : midi.start;
+		uint64_t due;
+		uint32_t pkt;
+		if (ct <= nt && ct <= sim_now) {
+			uint32_t rt = started ? MIDI_RT_CLOCK : MIDI_RT_START;
+			due = ct;
+			pkt = usb.ump ? (uint32_t) MIDI_UMP_SYSTEM << 28 | rt << 16
+			    : rt << 8 | MIDI_CABLE_USB << 4 | MIDI_CIN_BYTE;
+			if (started) {
+				clocks++;
+				clock = midi.start + (clocks + 1U) * midi.period
+				    + sim_randrange(midi.jitter);
+			}
+			started = 1U;
+		} else if (nt <= sim_now) {
+			const uint8_t *q = seq[notes % 3U];
+			due = nt;
+			pkt = usb.ump ? (uint32_t) MIDI_UMP_VOICE1 << 28
+			    | (uint32_t) q[0] << 16 | (uint32_t) q[1] << 8 | q[2]
+			    : (uint32_t) q[2] << 24 | (uint32_t) q[1] << 16
+			    | (uint32_t) q[0] << 8 | MIDI_CABLE_USB << 4 | q[0] >> 4;
+			notes++;
+		} else {
+			break;
+		}
+		if (usb.ump) {
+			word[i++] = (uint32_t) MIDI_UMP_JRSTAMP << 20
+			    | (uint32_t) (due / SIM_USBTICK & 0xffffU);
+		}
+		word[i++] = pkt;
+	}
+	if (i == jr) {
+		return;
+	}
+	while (n < 4U * i) {
+		buf[n] = (uint8_t) (word[n >> 2] >> (8U * (n & 3U)));
+		++n;
+	}
+	if (host_usb_out(SIM_USBADDR, USB_EP_OUT & USB_EP_ADDR, buf,
+			 4U * i) != HOST_USB_ACK) {
+		usb.naks++;
+		usb.next = sim_now + 64U * SIM_USBBIT;
+		return;
+	}
+	if (clocks != midi.clocks) {
+		latency.arrive = sim_now;
+		latency.open = 1U;
+	}
+	if (jr) {
+		usb.jrclock = sim_now;
+	}
+	usb.notes = notes;
+	midi.clocks = clocks;
+	midi.clock = clock;
+	midi.started = started;
+	usb.sent += i;
+	usb.transfers++;
+	usb.inframe++;
+	usb.next = sim_now + (32U * i + 112U) * SIM_USBBIT;
+}
+
+// Advance virtual time to the next event and raise it
+static void sim_step(void)
+{
+	uint64_t ev = midi.arrive;
+	if (systick.enabled && systick.next < ev)
+		ev = systick.next;
+	if (tim2.enabled && tim2.next < ev)
+		ev = tim2.next;
+	if (tim3.enabled && tim3.match < ev)
+		ev = tim3.match;
+	if (midi.idle && midi.idle < ev)
+		ev = midi.idle;
+	if (usb.on && usb.sof < ev)
+		ev = usb.sof;
+	if (usb.on && usb.next < ev)
+		ev = usb.next;
+
+	if (depth) {
+		struct sim_frame *top = &stack[depth - 1U];
+		if (sim_now + top->remain <= ev) {
+			sim_now += top->remain;
+			depth--;
+			return;
+		}
+		top->remain -= ev - sim_now;
+	}
+	sim_now = ev;
+
+	if (systick.enabled && systick.next == ev) {
+		systick.last = ev;
+		systick.next += host_systick.LOAD + 1U;
+		source[SIM_SYSTICK].pending = 1U;
+	}
+	if (tim2.enabled && tim2.next == ev) {
+		// ARR is preloaded: new value applies from this update
+		tim2.last = ev;
+		tim2.next += host_tim2.ARR + 1U;
+		host_tim2.SR |= TIM_SR_UIF;
+		if (host_tim2.DIER & TIM_DIER_UIE) {
+			source[SIM_TIM2].pending = 1U;
+		}
+		sim_trgo();
+		sim_dma();
+	}
+	if (tim3.enabled && tim3.match == ev) {
+		host_tim3.SR |= TIM_SR_CC1IF;
+		if (host_tim3.DIER & TIM_DIER_CC1IE) {
+			source[SIM_TIM3].pending = 1U;
+		}
+		tim3.match += 0x10000U * (host_tim3.PSC + 1U);
+	}
+	if (midi.arrive == ev) {
+		midi_arrive();
+	}
+	if (usb.on && usb.sof == ev) {
+		host_usb_sof();
+		usb.sof += SIM_USBFRAME;
+		usb.inframe = 0;
+		usb.next = ev + sim_randrange(SIM_USBBUSY);
+		source[SIM_USB].pending = 1U;
+	}
+	if (usb.on && usb.next == ev) {
+		usb_send();
+		if (host_usb_pending()) {
+			source[SIM_USB].pending = 1U;
+		}
+	}
+	if (midi.idle == ev) {
+		midi.idle = 0;
+		host_uart5.ISR |= USART_ISR_IDLE;
+		if (host_uart5.CR1 & USART_CR1_IDLEIE) {
+			source[SIM_UART5].pending = 1U;
+		}
+	}
+}
+
+// Set a handler cost from a name=cycles[+event] pair
+static int sim_cost(char *arg)
+{
+	char *val = strchr(arg, '=');
+	char *event;
+	if (val == NULL) {
+		return -1;
+	}
+	*val++ = '\0';
+	uint32_t i = 0;
+	do {
+		if (strcmp(arg, source[i].name) == 0) {
+			source[i].cost = (uint32_t) strtoul(val, &event, 0);
+			if (*event == '+') {
+				source[i].event =
+				    (uint32_t) strtoul(event + 1, NULL, 0);
+			}
+			return 0;
+		}
+		++i;
+	} while (i < SIM_NRIRQ);
+	return -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-b bpm] [-t seconds] [-j jitter_ns] [-n notes/s]\n"
+		"	[-u packets/s] [-k] [-m] [-w warmup_s] [-l lock_ns]\n"
+		"	[-c handler=cycles[+event]] [-s seed] [-q]\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	double bpm = 120.0;
+	double seconds = 10.0;
+	double jitter = 0.0;
+	double notes = 0.0;
+	double packets = 0.0;
+	double warmup = 1.0;
+	double lock = 50000.0;
+	int opt;
+
+	logfile = stdout;
+	while ((opt = getopt(argc, argv, "b:t:j:n:u:kmw:l:c:s:qh")) != -1) {
+		switch (opt) {
+		case 'b':
+			bpm = atof(optarg);
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'j':
+			jitter = atof(optarg);
+			break;
+		case 'n':
+			notes = atof(optarg);
+			break;
+		case 'u':
+			packets = atof(optarg);
+			break;
+		case 'k':
+			usb.clock = 1U;
+			break;
+		case 'm':
+			usb.ump = 1U;
+			break;
+		case 'w':
+			warmup = atof(optarg);
+			break;
+		case 'l':
+			lock = atof(optarg);
+			break;
+		case 'c':
+			if (sim_cost(optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's':
+			seed = (uint32_t) strtoul(optarg, NULL, 0) | 1U;
+			break;
+		case 'q':
+			logfile = NULL;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (bpm <= 0.0 || seconds <= 0.0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Boot: reset handler setup then main, followed by SVC
+	host_init();
+	host_gpio_write = sim_gpio;
+	uptime_init();
+	firmware_main();
+	host_sync();
+	sim_peripherals();
+	source[SIM_PENDSV].pending = 1U;
+
+	// Source starts after one clock period of idle
+	midi.period = sim_cycles(60e9 / (bpm * 24.0));
+	midi.jitter = sim_cycles(jitter);
+	midi.start = midi.period;
+	midi.clock = midi.start + midi.period;
+	midi.notegap = notes > 0.0 ? sim_cycles(1e9 / notes) : 0U;
+	midi.note = midi.start;
+	midi_next();
+
+	if (packets > 0.0 || usb.clock) {
+		if (usb_enumerate()) {
+			fprintf(stderr, "USB enumeration failed\n");
+			return 1;
+		}
+		usb.on = 1U;
+		usb.start = midi.start;
+		if (packets > 0.0) {
+			usb.gap = sim_cycles(1e9 / packets);
+			if (usb.gap == 0) {
+				usb.gap = 1U;
+			}
+			usb.start += sim_randrange(usb.gap);
+		}
+		usb.sof = sim_now + sim_randrange(SIM_USBFRAME);
+		usb.next = UINT64_MAX;
+	}
+
+	stats.warmup = sim_cycles(warmup * 1e9);
+	stats.lockns = lock;
+	uint64_t end = sim_cycles(seconds * 1e9);
+	do {
+		sim_dispatch();
+		sim_step();
+	} while (sim_now < end);
+
+	fprintf(stderr, "simulated %.3f s, %llu clocks at %.3f bpm\n",
+		sim_ns(sim_now) / 1e9, (unsigned long long)midi.clocks, bpm);
+	uint32_t i = 0;
+	do {
+		fprintf(stderr, "  %-8s %llu calls\n", source[i].name,
+			(unsigned long long)source[i].count);
+		++i;
+	} while (i < SIM_NRIRQ);
+	if (stats.edges) {
+		double n = (double)stats.edges;
+		double mean = stats.sum / n;
+		double sd = sqrt(fmax(stats.sumsq / n - mean * mean, 0.0));
+		double pmean = stats.psum / n;
+		double psd = sqrt(fmax(stats.psumsq / n - pmean * pmean, 0.0));
+		fprintf(stderr, "DIN clock: %llu edges, expected period %.1f ns\n",
+			(unsigned long long)stats.edges, sim_ns(midi.period));
+		fprintf(stderr,
+			"  period ns: mean %.1f sd %.1f min %.1f max %.1f\n",
+			mean, sd, stats.min, stats.max);
+		fprintf(stderr,
+			"  phase ns: mean %.1f sd %.1f min %.1f max %.1f\n",
+			pmean, psd, stats.pmin, stats.pmax);
+		fprintf(stderr, "  locked within %.0f ns after %.1f ms\n",
+			stats.lockns, stats.unlock > midi.start
+			? sim_ns(stats.unlock - midi.start) / 1e6 : 0.0);
+	}
+	if (pulses.count) {
+		double n = (double)pulses.count;
+		double mean = pulses.sum / n;
+		double sd = sqrt(fmax(pulses.sumsq / n - mean * mean, 0.0));
+		fprintf(stderr, "Gate pulses: %llu\n",
+			(unsigned long long)pulses.count);
+		fprintf(stderr,
+			"  width ns: mean %.1f sd %.1f min %.1f max %.1f\n",
+			mean, sd, pulses.min, pulses.max);
+	}
+	if (latency.count) {
+		fprintf(stderr,
+			"Clock to period update: %llu, mean %.1f ns max %.1f ns\n",
+			(unsigned long long)latency.count,
+			latency.sum / (double)latency.count, latency.max);
+	}
+	if (host_bkpt_count[24U]) {
+		fprintf(stderr, "MIDI overrun: %u\n", host_bkpt_count[24U]);
+	}
+	if (host_bkpt_count[25U]) {
+		fprintf(stderr, "UART overrun: %u\n", host_bkpt_count[25U]);
+	}
+	i = 0;
+	do {
+		static const char *const name[MIDI_LANES] = {
+			"rt", "voice", "sysex"
+		};
+		struct midi_event_stats *st = &midi_event_stats[i];
+		fprintf(stderr,
+			"Event lane %-5s high %u, merged %u, dropped %u\n",
+			name[i], st->high, st->merged, st->dropped);
+		++i;
+	} while (i < MIDI_LANES);
+	if (usb.sent) {
+		double frames = (double)(sim_now - usb.start) / SIM_USBFRAME;
+		fprintf(stderr, "USB packets: %llu in %llu transfers, NAK %llu\n",
+			(unsigned long long)usb.sent,
+			(unsigned long long)usb.transfers,
+			(unsigned long long)usb.naks);
+		fprintf(stderr, "  %.2f transfers per frame of %u\n",
+			(double)usb.transfers / frames, SIM_USBMAX);
+	}
+	return 0;
+}
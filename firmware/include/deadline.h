@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Deadline wheel
+ *
+ * Hashed timer wheel of callbacks keyed on Uptime, run from
+ * system_update(). All deadline calls must be made from PendSV.
+ */
+#ifndef DEADLINE_H
+#define DEADLINE_H
+#include <stdint.h>
+
+struct deadline;
+
+// Deadline callback, called with the uptime it was run at
+typedef void (*deadline_fn)(struct deadline * d, uint32_t now);
+
+struct deadline {
+	struct deadline *next;
+	deadline_fn expire;
+	uint32_t due;		// uptime of expiry
+	uint32_t slot;		// wheel slot plus one, 0 when idle
+};
+
+// Uptime at which system_update() next has a deadline to run
+extern volatile uint32_t deadline_wake;
+
+// Prepare a deadline with its expiry callback
+void deadline_init(struct deadline *d, deadline_fn expire);
+
+// Register or move a deadline to expire at uptime due
+void deadline_set(struct deadline *d, uint32_t due);
+
+// Remove a pending deadline
+void deadline_clear(struct deadline *d);
+
+// Expire deadlines due at uptime now and update deadline_wake
+void deadline_run(uint32_t now);
+
+#endif // DEADLINE_H
@@ -7,9 +7,12 @@
 #define DISPLAY_H
 #include <stdint.h>
 
-// Update the display state - call once per millisecond with current uptime
+// Update the display state - call after processing events with current uptime
 void display_update(uint32_t clock);
 
+// Prepare display blink deadlines
+void display_init(void);
+
 // Turn on/off the indicators
 void display_midi_on(void);
 void display_midi_off(void);
@@ -14,8 +14,8 @@
 #define FLASH_WORDCOUNT		(FLASH_PAGESZ / sizeof(uint32_t))
 #define FLASH_LOADPAGES 	1U
 #define FLASH_CODEPAGES		8U
-#define FLASH_PRESETPAGES 	7U
-#define FLASH_JNLPAGES 		246UL
+#define FLASH_PRESETPAGES 	6U
+#define FLASH_JNLPAGES 		232UL	// 29 x 16KiB
 
 struct flash_page {
 	uint32_t word[FLASH_WORDCOUNT];
@@ -24,11 +24,27 @@ struct flash_memory {
 	struct flash_page loader;			// Loader
 	struct flash_page application[FLASH_CODEPAGES];	// Application code
 	struct flash_page options[FLASH_PRESETPAGES];	// ROM Options
+	struct flash_page commit;			// Update commit record
 	struct flash_page journal[FLASH_JNLPAGES];	// Settings
+	struct flash_page update[FLASH_CODEPAGES];	// Staged update
 };
 #define FLASHMEM ((struct flash_memory *) FLASH_BASE)
 #define OPTION ((struct option_struct *)(&FLASHMEM->options[0]))
 
+/* Update commit record
+ *
+ * Written once an update is staged and checked. At boot the loader
+ * copies the staged image over the application when the magic is
+ * set and the image matches its CRC-32, then zeroes the magic.
+ */
+#define FLASH_COMMITMAGIC	0x55504454UL	// "TDPU" in flash
+struct flash_commit {
+	uint32_t size;		// image bytes
+	uint32_t crc;		// image CRC-32
+	uint32_t magic;		// programmed last
+};
+#define COMMIT ((struct flash_commit *)(&FLASHMEM->commit))
+
 // Unlock flash memory for writing
 void flash_unlock(void);
 
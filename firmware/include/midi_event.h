@@ -2,6 +2,12 @@
 
 /*
  * MIDI Event and Receiver Interface
+ *
+ * Events are queued in lanes of fixed depth. On a full lane real time
+ * transport messages displace a queued clock or system common
+ * message, a system exclusive notification is dropped and its buffer
+ * released, and any other event is dropped. Each loss is counted in
+ * midi_event_stats and raises breakpoint 24.
  */
 #ifndef MIDI_EVENT_H
 #define MIDI_EVENT_H
@@ -22,7 +28,7 @@ union midi_event_pkt {
 // Timestamped midi event packet
 struct midi_event {
 	union midi_event_pkt evt;
-	uint32_t clock;
+	uint32_t clock;		// core cycles at receipt, or sysex id
 };
 
 // Sysex config packet
@@ -71,20 +77,56 @@ struct midi_sysex_config {
 #define MIDI_CABLE_UART		0x1	// MIDI UART
 #define MIDI_CABLE_USB		0x0	// USB-MIDI
 
-// Enqueue a filtered raw midi event packet
+// Event queue lanes, in drain order
+#define MIDI_LANE_RT		0U	// real time and system common
+#define MIDI_LANE_VOICE		1U	// channel voice and mode
+#define MIDI_LANE_SYSEX		2U	// system exclusive notifications
+#define MIDI_LANES		3U
+
+// Event queue accounting per lane
+struct midi_event_stats {
+	uint32_t dropped;	// events lost on a full lane
+	uint32_t merged;	// events merged into a queued event
+	uint32_t high;		// most events queued at once
+};
+
+extern struct midi_event_stats midi_event_stats[MIDI_LANES];
+
+// Rebuild the cable filters after a change to config.fusb or config.fmidi
+void midi_event_map(void);
+
+// Return non-zero if the cable filter passes code index cin
+uint32_t midi_accept(const uint32_t cable, uint32_t cin);
+
+// Enqueue a filtered raw midi event packet with its receive stamp
 void midi_event_append(uint32_t event, uint32_t clock);
 
-// Check for queued midi event and probe device sense
+// Check for queued midi event
 struct midi_event *midi_event_poll(void);
 
+// Set voice lane depth to 2^bits, 0 for the build depth, and coalescing
+void midi_event_config(uint32_t bits, uint32_t merge);
+
 // Flag the last received event as done
 void midi_event_done(void);
 
 // Reset receive status on the nominated cable
 void midi_reset(const uint32_t cable);
 
-// Receive a single byte on the nominated cable
-void midi_receive(const uint32_t cable, uint32_t val);
+// Receive a single byte on the nominated cable, stamped in core cycles
+void midi_receive(const uint32_t cable, uint32_t val, uint32_t stamp);
+
+// Receive a USB-MIDI event packet on the nominated cable
+void midi_receive_packet(const uint32_t cable, uint32_t pkt, uint32_t stamp);
+
+// Act on a transport byte started at core cycle at, from receive interrupt
+void midi_transport(const uint32_t cable, uint32_t val, uint32_t at);
+
+/*
+ * A received sysex message is announced by an EOX3 event with its
+ * length in midi1 and the CRC-7/MMC of all but its final byte in
+ * midi2, computed as the bytes arrive.
+ */
 
 // Return pointer to sysex config buffer for the provided event handle
 struct midi_sysex_config *midi_sysex_buf(struct midi_event *event);
@@ -92,6 +134,10 @@ struct midi_sysex_config *midi_sysex_buf(struct midi_event *event);
 // Mark the sysex event as done
 void midi_sysex_done(struct midi_event *event);
 
+// Send len config bytes to the USB host as a sysex message with its
+// system ID and CRC-7, return zero if they were not sent
+uint32_t midi_sysex_send(const uint8_t *data, uint32_t len);
+
 // Prepare midi device interfaces
 void midi_event_init(void);
 
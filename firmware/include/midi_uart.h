@@ -7,6 +7,17 @@
 #define MIDI_UART_H
 #include <stdint.h>
 
+#define MIDI_BAUD		31250U
+
+// Core cycles from start bit to receipt of a byte
+#define MIDI_BYTETIME		(SYSTEMCORECLOCK * 10U / MIDI_BAUD)
+
+// Return non-zero if a byte is waiting, with its stamp
+uint32_t midi_uart_pending(uint32_t *stamp);
+
+// Parse one received byte, return zero if none were waiting
+uint32_t midi_uart_poll(void);
+
 // Initialise hardware and enable receive interrupt
 void midi_uart_init(void);
 
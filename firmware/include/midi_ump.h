@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Universal MIDI Packet Interface
+ *
+ * A UMP is one to four 32 bit words, with the message type in the
+ * top four bits of the first. Only the MIDI 1.0 protocol is parsed:
+ * system and MIDI 1.0 channel voice messages, 7 bit system exclusive
+ * data, and the jitter reduction clock and timestamps, on any group.
+ * Other messages are skipped whole.
+ *
+ * Parser state is kept for a single stream, the USB-MIDI 2.0
+ * alternate setting.
+ *
+ * References:
+ *
+ *  - Universal MIDI Packet (UMP) Format and MIDI 2.0 Protocol 1.1
+ */
+#ifndef MIDI_UMP_H
+#define MIDI_UMP_H
+#include <stdint.h>
+
+// Message types
+#define MIDI_UMP_UTILITY	0x0
+#define MIDI_UMP_SYSTEM		0x1	// system real time and common
+#define MIDI_UMP_VOICE1		0x2	// MIDI 1.0 channel voice
+#define MIDI_UMP_DATA64		0x3	// 7 bit system exclusive
+#define MIDI_UMP_MAXWORDS	4U
+
+// Utility message status
+#define MIDI_UMP_NOOP		0x0
+#define MIDI_UMP_JRCLOCK	0x1	// sender time at sending
+#define MIDI_UMP_JRSTAMP	0x2	// sender time of the next message
+
+// System exclusive status
+#define MIDI_UMP_SYSEX_ONLY	0x0	// complete in one packet
+#define MIDI_UMP_SYSEX_START	0x1
+#define MIDI_UMP_SYSEX_CONT	0x2
+#define MIDI_UMP_SYSEX_END	0x3
+#define MIDI_UMP_SYSEX_MAX	6U	// data bytes per packet
+
+// Jitter reduction clock ticks per second
+#define MIDI_UMP_JRRATE		31250U
+
+// Take the next received word, from the receive interrupt with its
+// core cycle stamp, and return the stamp from its JR timestamp if
+// one applies. Real time transport messages are passed to the clock.
+uint32_t midi_ump_scan(const uint32_t cableno, uint32_t w, uint32_t at);
+
+// Parse the next received word into the event queue
+void midi_ump_receive(const uint32_t cableno, uint32_t w, uint32_t stamp);
+
+// Convert an event packet to a UMP in ump, return its length in words,
+// or zero if it has no MIDI 1.0 message
+uint32_t midi_ump_packet(uint32_t pkt, uint32_t *ump);
+
+// Restart both parsers and forget the sender clock
+void midi_ump_reset(void);
+
+#endif /* MIDI_UMP_H */
@@ -7,6 +7,25 @@
 #define MIDI_USB_H
 #include <stdint.h>
 
+// Stamp the packets of a completed bulk OUT transfer, from the USB interrupt
+void midi_usb_receive(void);
+
+// Gather the next IN buffer, from the USB interrupt once one is sent
+void midi_usb_sent(void);
+
+// Reset streaming state for endpoint address ep, opened or closed
+void midi_usb_open(uint32_t ep);
+
+// Return non-zero if a packet is waiting, with its stamp
+uint32_t midi_usb_pending(uint32_t *stamp);
+
+// Parse one received packet, return zero if none were waiting
+uint32_t midi_usb_poll(void);
+
+// Send n event packets to the host, as UMPs in the USB-MIDI 2.0
+// alternate setting, return zero if they did not all fit
+uint32_t midi_usb_send(const uint32_t *pkt, uint32_t n);
+
 // Initialise hardware and enable interrupt
 void midi_usb_init(void);
 
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Output port pins
+ *
+ * GPIOC pins driven by each output number, shared by the event
+ * handlers, the reference clock and the trigger timer.
+ */
+#ifndef OUTPUT_H
+#define OUTPUT_H
+#include <stdint.h>
+#include "settings.h"
+
+#define GATE1 GPIO_ODR_3
+#define GATE2 GPIO_ODR_15
+#define GATE3 GPIO_ODR_13
+#define DINRS GPIO_ODR_1
+#define DINCK GPIO_ODR_0
+#define DINFL GPIO_ODR_2
+#define OUTMASK (DINCK|DINRS|DINFL|GATE1|GATE2|GATE3)
+
+// Output pins by output number
+extern const uint32_t out_pins[SETTINGS_NROUTS];
+
+#endif // OUTPUT_H
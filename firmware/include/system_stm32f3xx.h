@@ -37,13 +37,21 @@
 #define BREAKPOINT(cond) do { if (IS_ENABLED(USE_BKPT)) if (DEBUG_ENABLED) __BKPT( (cond) ); } while(0)
 #define TRACEVAL(port, value) do { if (IS_ENABLED(USE_TRACE)) ITM->PORT[(port)].u32 = (value); } while(0)
 #define PENDSV() do { SCB->ICSR |= SCB_ICSR_PENDSVSET_Msk; } while(0)
+#ifndef CRC_BYTE
+#define CRC_BYTE(val) do { *(__IO uint8_t *) (__IO void *)(&CRC->DR) = (val); } while(0)
+#endif
+#ifndef DMA_ADDR
+#define DMA_ADDR(ptr) ((uint32_t) (ptr))
+#endif
 #define SPIN() do { } while (1U)
 
 // service call
 #define __SVC(code) __ASM volatile ("svc "#code)
 
 // optimisation barrier - for ordering co-dependent register access
+#ifndef barrier
 #define barrier() __asm__ __volatile__("": : :"memory")
+#endif
 
 // Main stack defines for 56k RAM / ~8KiB stack (see loader script)
 #define STACK_TOP	0x20010000UL
@@ -53,6 +61,8 @@
 // CRC Constants
 #define CRC7_POLY		0x09
 #define CRC7_INIT		0x0
+#define CRC32_POLY		0x04c11db7UL
+#define CRC32_INIT		0xffffffffUL
 
 // NVIC Constants
 #define PRIGROUP_4_4		0x5
@@ -101,6 +111,12 @@ extern uint32_t SystemID;
 // System heartbeat clock
 extern volatile uint32_t Uptime;
 
+// Set handler priorities and start the uptime clock
+void uptime_init(void);
+
+// Return core cycles since the uptime clock started
+uint32_t uptime_cycles(void);
+
 // Busy wait roughly delay ms
 void delay_ms(uint32_t delay);
 
@@ -113,11 +129,15 @@ void main(void);
 // Fault/Interrupt handler prototypes
 void system_init(void);
 void system_update(void);
+void system_transport(uint32_t status, uint32_t at);
 void ms_timer(void);
 void nmi_handler(void);
 void fault_handler(void);
 void undefined_handler(void);
 void midi_uart_receive(void);
+void usb_irq(void);
 void timer_update(void);
+void timer_dma(void);
+void trigger_expire(void);
 
 #endif /* SYSTEM_H */
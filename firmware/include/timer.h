@@ -9,7 +9,7 @@
  */
 #ifndef TIMER_H
 #define TIMER_H
-#include "midi_event.h"
+#include <stdint.h>
 
 #define TIMER	TIM2
 
@@ -19,6 +19,7 @@ struct timer_state {
 	uint32_t nextout;
 	uint32_t running;
 	uint32_t on;
+	uint32_t reload;
 };
 
 extern struct timer_state timer;
@@ -26,8 +27,14 @@ extern struct timer_state timer;
 // Halt timer in preparation for a start message
 void timer_preroll(void);
 
-// Handle arrival of a midi timing message
-void timer_clock(struct midi_event *event);
+// Stop run masked outputs from the next update
+void timer_stop(void);
+
+// Reload output clock edges after a config change
+void timer_reload(void);
+
+// Lock the reference clock to a timing message started at core cycle at
+void timer_clock(uint32_t at);
 
 // Prepare timer interface
 void timer_init(void);
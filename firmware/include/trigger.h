@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Trigger pulse timer
+ *
+ * Ends output pulses of trigger length from a timer compare
+ * interrupt, independent of event processing.
+ */
+#ifndef TRIGGER_H
+#define TRIGGER_H
+#include <stdint.h>
+
+#define TRIGGER	TIM3
+
+// Trigger timer count rate and core cycles per count
+#define TRIGGER_CLOCK	100000UL
+#define TRIGGER_DIV	(SYSTEMCORECLOCK / TRIGGER_CLOCK)
+
+// Return current trigger timer count
+uint32_t trigger_now(void);
+
+// Start trigger length on pins set now by a MIDI event
+void trigger_event(uint32_t pins);
+
+// Start trigger length on pins set by reference clock update number
+void trigger_clocked(uint32_t pins, uint32_t update);
+
+// Drop unstarted pulses and number updates from the next roll
+void trigger_restart(void);
+
+// Update trigger outputs and length after a config change
+void trigger_map(void);
+
+// Prepare trigger timer
+void trigger_init(void);
+
+#endif // TRIGGER_H
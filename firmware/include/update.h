@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Firmware update over SysEx
+ *
+ * An image for the application pages is sent as three kinds of
+ * config message, each ending in the usual CRC-7/MMC byte:
+ *
+ *   UPDATE_BEGIN	size, 3 x 7 bits lsb first
+ *   UPDATE_DATA	offset, 3 x 7 bits lsb first, then image bytes
+ *			packed lsb first into 7 bit groups
+ *   UPDATE_COMMIT	CRC-32 of the image, 5 x 7 bits lsb first
+ *
+ * Data messages are not limited to MIDI_MAX_SYSEX: once the header
+ * is received the rest is streamed into one of two RAM page buffers.
+ * A chunk is accepted when its CRC-7 matches and it starts where the
+ * previous one ended, so a rejected chunk may simply be sent again.
+ * Chunks may carry up to one page of data.
+ *
+ * Full pages are programmed into the update pages, the last 16KiB
+ * of flash after the settings journal, while the next arrives. On
+ * commit the staged image is checked with the hardware CRC and a
+ * commit record written before a system reset. The loader copies
+ * the staged image over the application pages at boot, again after
+ * a copy cut short by power loss. All update calls must be made
+ * from PendSV.
+ *
+ * Over USB each message is answered with a status reply:
+ *
+ *   UPDATE_STATUS	bytes accepted, 3 x 7 bits lsb first
+ *			chunks dropped, 2 x 7 bits lsb first
+ *			enum update_state
+ *
+ * A status is also sent as each page buffer is freed, so a chunk
+ * dropped because both buffers were still being programmed can be
+ * sent again then. The last reply before the reset has state
+ * UPDATE_RESET, a failed commit returns to UPDATE_IDLE.
+ */
+#ifndef UPDATE_H
+#define UPDATE_H
+#include <stdint.h>
+#include "midi_event.h"
+
+// Update config message commands
+#define UPDATE_BEGIN		0x07
+#define UPDATE_DATA		0x08
+#define UPDATE_COMMIT		0x09
+#define UPDATE_STATUS		0x0a
+
+// Update state, as reported in UPDATE_STATUS
+enum update_state {
+	UPDATE_IDLE,		// no update in progress
+	UPDATE_RECEIVE,		// receiving and staging image
+	UPDATE_MARK,		// writing commit record
+	UPDATE_RESET,		// record written, reset due
+};
+
+// Sysex bytes buffered before an update data message is streamed
+#define UPDATE_HEADER		8U
+
+// Start a new update for an image of size bytes
+void update_begin(uint32_t size);
+
+// Commit the received image if it matches crc
+void update_commit(uint32_t crc);
+
+// Return non-zero to stream the remainder of the sysex in cfg
+uint32_t update_open(struct midi_sysex_config *cfg);
+
+// Receive one streamed sysex data byte
+void update_data(uint32_t db);
+
+// End the streamed sysex, accepting its data if ok is non-zero
+void update_close(uint32_t ok);
+
+// Prepare update interface
+void update_init(void);
+
+#endif // UPDATE_H
@@ -5,13 +5,24 @@
  *
  * Based on libusb_stm32 by Dmitry Filimonchuk
  *
+ * Descriptors are stored in ROM options, and served by the full
+ * speed device driver in usb.c. Endpoint registers are numbered
+ * separately from the endpoint addresses they answer to. Packet
+ * memory on the STM32F303xE is 1 KiB accessed as 2 x 16 bits per
+ * word, so a byte address in packet memory is also its offset from
+ * USB_PMAADDR.
+ *
  * References:
  *
+ *  - Universal Serial Bus Specification Revision 2.0, chapter 9
  *  - Universal Serial Bus Device Class Definition for MIDI Devices 1.0
+ *  - Universal Serial Bus Device Class Definition for MIDI Devices 2.0
+ *  - RM0316 STM32F303 Reference Manual, USB full-speed device interface
  *  - https://github.com/dmitrystu/libusb_stm32
  */
 #ifndef USB_H
 #define USB_H
+#include <stddef.h>
 #include "stm32f303xe.h"
 
 // USB Constants
@@ -38,6 +49,7 @@
 #define USB_CFG_ATTR_SELFPWR	0x40
 #define USB_CFG_100MA		0x32
 #define USB_MS_GENERAL		0x1
+#define USB_MS_GENERAL_2_0	0x2
 #define USB_MIDI_IN_JACK	0x2
 #define USB_MIDI_OUT_JACK	0x3
 #define USB_ELEMENT		0x4
@@ -45,6 +57,82 @@
 #define USB_EXTERNAL		0x2
 #define USB_ELEMENT_CLOCK	0x2
 #define USB_ELEMENT_CUSTOM	0x1
+#define USB_STRING		0x3
+#define USB_EP_HALT		0x0
+#define USB_EP_DIR		0x80
+#define USB_EP_ADDR		0x0f
+#define USB_CS_GR_TRM_BLOCK	0x26
+#define USB_GR_TRM_BLOCK_HEADER	0x1
+#define USB_GR_TRM_BLOCK	0x2
+#define USB_GTB_BIDIRECTIONAL	0x0
+#define USB_GTB_MIDI1_JRTS	0x2	// MIDI 1.0 protocol with JR timestamps
+
+// MIDI streaming interface and its alternate settings
+#define USB_MS_INTERFACE	1U
+#define USB_MS_MIDI1		0U	// USB-MIDI 1.0 event packets
+#define USB_MS_UMP		1U	// USB-MIDI 2.0 universal MIDI packets
+#define USB_MS_LAST		(IS_ENABLED(USB_UMP) ? USB_MS_UMP : USB_MS_MIDI1)
+
+// Standard requests
+#define USB_REQ_GET_STATUS	0x0
+#define USB_REQ_CLEAR_FEATURE	0x1
+#define USB_REQ_SET_FEATURE	0x3
+#define USB_REQ_SET_ADDRESS	0x5
+#define USB_REQ_GET_DESCRIPTOR	0x6
+#define USB_REQ_GET_CONFIG	0x8
+#define USB_REQ_SET_CONFIG	0x9
+#define USB_REQ_GET_INTERFACE	0xa
+#define USB_REQ_SET_INTERFACE	0xb
+
+// Request type fields
+#define USB_REQ_DIR_IN		0x80
+#define USB_REQ_TYPE_MASK	0x60
+#define USB_REQ_STANDARD	0x00
+#define USB_REQ_RCPT_MASK	0x1f
+#define USB_REQ_DEVICE		0x0
+#define USB_REQ_INTERFACE	0x1
+#define USB_REQ_ENDPOINT	0x2
+
+// Endpoint registers
+#define USB_EPR_CTL		0U	// default control pipe
+#define USB_EPR_MIDIOUT		1U	// MIDI streaming bulk OUT, double buffered
+#define USB_EPR_MIDIIN		2U	// MIDI streaming bulk IN, double buffered
+
+// Packet memory layout, byte addresses
+#define USB_PMA_BTABLE		0x000U
+#define USB_PMA_CTLRX		0x040U
+#define USB_PMA_CTLTX		0x080U
+#define USB_PMA_MIDIRX		0x0c0U	// two OUT buffers
+#define USB_PMA_MIDITX		0x140U	// two IN buffers
+
+// Packet buffer b of a double buffered endpoint at base
+#define USB_PMA_BUF(base, b)	((base) + (b) * USB_ENDPOINT_SIZE)
+
+// Buffer descriptor table entries for endpoint register n
+#define USB_ADDR_TX(n)		(USB_PMA_BTABLE + 8U * (n))
+#define USB_COUNT_TX(n)		(USB_PMA_BTABLE + 8U * (n) + 2U)
+#define USB_ADDR_RX(n)		(USB_PMA_BTABLE + 8U * (n) + 4U)
+#define USB_COUNT_RX(n)		(USB_PMA_BTABLE + 8U * (n) + 6U)
+#define USB_COUNT_MASK		0x3ffU
+
+// Buffer descriptor entries for buffer b of double buffered register n
+#define USB_ADDR_BUF(n, b)	(USB_ADDR_TX(n) + 4U * (b))
+#define USB_COUNT_BUF(n, b)	(USB_COUNT_TX(n) + 4U * (b))
+
+// Receive buffer size of one endpoint packet in 32 byte blocks
+#define USB_COUNT_BLSIZE	0x8000U
+#define USB_RXBLOCKS	(USB_COUNT_BLSIZE | ((USB_ENDPOINT_SIZE / 32U - 1U) << 10))
+
+// Packet memory half-word at byte address addr
+#define USB_PMA(addr)	(*(volatile uint16_t *) (USB_PMAADDR + (addr)))
+
+// Endpoint register n
+#define USB_EPR(n)	((&USB->EP0R)[(n) << 1])
+
+// Write endpoint register n, toggle and clear-by-zero bits apply
+#ifndef USB_EPR_WRITE
+#define USB_EPR_WRITE(n, val) do { USB_EPR(n) = (uint16_t) (val); } while(0)
+#endif
 
 // Information string indices
 enum usb_descr {
@@ -215,13 +303,89 @@ struct usb_device_configuration {
 	uint8_t msin_bNumEmbMIDIJack;
 	uint8_t msin_baAssocJackID1;
 	uint8_t msin_baAssocJackID2;
+
+	// MIDI 2.0 5.2.1 Standard MS Interface Descriptor : Alternate 1
+	uint8_t ump_bLength;
+	uint8_t ump_bDescriptorType;
+	uint8_t ump_bInterfaceNumber;
+	uint8_t ump_bAlternateSetting;
+	uint8_t ump_bNumEndpoints;
+	uint8_t ump_bInterfaceClass;
+	uint8_t ump_bInterfaceSubclass;
+	uint8_t ump_bInterfaceProtocol;
+	uint8_t ump_iInterface;
+
+	// MIDI 2.0 5.2.2.1 Class-Specific MS Interface Header Descriptor
+	uint8_t cump_bLength;
+	uint8_t cump_bDescriptorType;
+	uint8_t cump_bDescriptorSubtype;
+	uint16_t cump_BcdMSC;
+	uint16_t cump_wTotalLength;
+
+	// MIDI 2.0 5.3.1 Standard MS Bulk Data Endpoint Descriptor : Output
+	uint8_t umpout_bLength;
+	uint8_t umpout_bDescriptorType;
+	uint8_t umpout_bEndpointAddress;
+	uint8_t umpout_bmAttributes;
+	uint16_t umpout_wMaxPacketSize;
+	uint8_t umpout_bInterval;
+
+	// MIDI 2.0 5.3.2 Class-Specific MIDI Streaming Data Endpoint : Output
+	uint8_t gtout_bLength;
+	uint8_t gtout_bDescriptorType;
+	uint8_t gtout_bDescriptorSubType;
+	uint8_t gtout_bNumGrpTrmBlock;
+	uint8_t gtout_baAssoGrpTrmBlkID1;
+
+	// MIDI 2.0 5.3.1 Standard MS Bulk Data Endpoint Descriptor : Input
+	uint8_t umpin_bLength;
+	uint8_t umpin_bDescriptorType;
+	uint8_t umpin_bEndpointAddress;
+	uint8_t umpin_bmAttributes;
+	uint16_t umpin_wMaxPacketSize;
+	uint8_t umpin_bInterval;
+
+	// MIDI 2.0 5.3.2 Class-Specific MIDI Streaming Data Endpoint : Input
+	uint8_t gtin_bLength;
+	uint8_t gtin_bDescriptorType;
+	uint8_t gtin_bDescriptorSubType;
+	uint8_t gtin_bNumGrpTrmBlock;
+	uint8_t gtin_baAssoGrpTrmBlkID1;
 } __attribute__((packed));
 #define USB_CFGLEN (sizeof(struct usb_device_configuration))
+// Configuration up to the UMP alternate setting, the whole without USB_UMP
+#define USB_CFGTOTAL (IS_ENABLED(USB_UMP) ? USB_CFGLEN \
+	: offsetof(struct usb_device_configuration, ump_bLength))
 #define USB_CFGPAD (ALIGN16(USB_CFGLEN) - USB_CFGLEN)
 
-// Total length of class-specific descriptors
+// Total length of class-specific descriptors, alternate setting 0
 #define USB_CSLEN 80U
 
+// MIDI 2.0 5.4 Group Terminal Block descriptors of alternate setting 1,
+// read with a separate request to the interface
+struct usb_group_terminal {
+	// 5.4.1 Group Terminal Block Header Descriptor
+	uint8_t hdr_bLength;
+	uint8_t hdr_bDescriptorType;
+	uint8_t hdr_bDescriptorSubtype;
+	uint16_t hdr_wTotalLength;
+
+	// 5.4.2 Group Terminal Block Descriptor : Syncbox
+	uint8_t gtb_bLength;
+	uint8_t gtb_bDescriptorType;
+	uint8_t gtb_bDescriptorSubtype;
+	uint8_t gtb_bGrpTrmBlkID;
+	uint8_t gtb_bGrpTrmBlkType;
+	uint8_t gtb_nGroupTrm;
+	uint8_t gtb_nNumGroupTrm;
+	uint8_t gtb_iBlockItem;
+	uint8_t gtb_bMIDIProtocol;
+	uint16_t gtb_wMaxInputBandwidth;
+	uint16_t gtb_wMaxOutputBandwidth;
+} __attribute__((packed));
+#define USB_GTBLEN (sizeof(struct usb_group_terminal))
+#define USB_GTBPAD (ALIGN16(USB_GTBLEN) - USB_GTBLEN)
+
 // ROM container struct for USB UTF-16LE strings
 struct usb_string {
 	uint16_t wString[USB_MAXSTRLEN];
@@ -235,6 +399,69 @@ struct usb_config {
 	uint8_t devpad[USB_DEVPAD];
 	struct usb_device_configuration configuration;
 	uint8_t cfgpad[USB_CFGPAD];
+	struct usb_group_terminal terminal;
+	uint8_t gtbpad[USB_GTBPAD];
+};
+
+// Standard device request, as received in a SETUP packet
+struct usb_setup {
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
 };
 
+// Read the 32 bit word at byte address addr in packet memory
+uint32_t usb_pma_word(uint32_t addr);
+
+// Write a 32 bit word to byte address addr in packet memory
+void usb_pma_put(uint32_t addr, uint32_t val);
+
+/*
+ * Double buffered bulk endpoints
+ *
+ * The peripheral selects its buffer with the data toggle, and the
+ * application owns the other, marked by the software buffer bit.
+ * When the two match the endpoint NAKs: an OUT endpoint has both
+ * buffers full and an IN endpoint has nothing left to send.
+ */
+
+// Return the buffer last filled on OUT register n
+uint32_t usb_db_filled(uint32_t n);
+
+// Return the byte count of buffer b on register n
+uint32_t usb_db_count(uint32_t n, uint32_t b);
+
+// Return the application buffer on OUT register n to the peripheral
+void usb_db_release(uint32_t n);
+
+// Return non-zero if IN register n has no buffer waiting to be sent
+uint32_t usb_db_idle(uint32_t n);
+
+// Send len bytes from application buffer b on IN register n
+void usb_db_send(uint32_t n, uint32_t b, uint32_t len);
+
+// Hold off the USB interrupts for a short update from PendSV
+void usb_lock(void);
+
+// Release the USB interrupts
+void usb_unlock(void);
+
+// Return the current configuration value, zero if not configured
+uint32_t usb_configured(void);
+
+// Return the alternate setting of the MIDI streaming interface
+uint32_t usb_alternate(void);
+
+// Return the frame period in core cycles, zero until a start of frame
+// is seen, and set *stamp to the core cycle of the last one
+uint32_t usb_frame(uint32_t *stamp);
+
+// Handle USB low and high priority interrupts
+void usb_irq(void);
+
+// Reset the peripheral and attach to the bus
+void usb_init(void);
+
 #endif // USB_H
@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Deadline wheel
+ *
+ * Deadlines are hashed by expiry into one of DEADLINE_SLOTS lists,
+ * each covering one millisecond of uptime per revolution. Running
+ * the wheel walks only the slots passed since the last run, and
+ * expires the entries in them that are due. Entries further than one
+ * revolution away stay in their slot until a later pass.
+ *
+ * SysTick compares Uptime against deadline_wake so that PendSV is
+ * only raised when a deadline is due or a slot holding later entries
+ * has passed, and at least once per revolution.
+ */
+#include "stm32f3xx.h"
+#include <stddef.h>
+#include "deadline.h"
+
+#define DEADLINE_SHIFT	3U	// uptimes per slot, log2
+#define DEADLINE_TICK	(1U << DEADLINE_SHIFT)
+#ifndef DEADLINE_SLOTS
+#define DEADLINE_SLOTS	32U	// power of 2
+#endif
+#define DEADLINE_SPAN	(DEADLINE_SLOTS << DEADLINE_SHIFT)
+
+static struct deadline *wheel[DEADLINE_SLOTS];
+
+// Uptime of the next slot to run
+static uint32_t pos;
+
+volatile uint32_t deadline_wake;
+
+// Return slot index for uptime t
+static uint32_t deadline_index(uint32_t t)
+{
+	return (t >> DEADLINE_SHIFT) & (DEADLINE_SLOTS - 1U);
+}
+
+void deadline_init(struct deadline *d, deadline_fn expire)
+{
+	d->next = NULL;
+	d->expire = expire;
+	d->due = 0;
+	d->slot = 0;
+}
+
+void deadline_set(struct deadline *d, uint32_t due)
+{
+	uint32_t i;
+	deadline_clear(d);
+	d->due = due;
+	// Deadlines already passed are run in the next slot
+	if ((int32_t) (due - pos) < 0) {
+		i = deadline_index(pos);
+	} else {
+		i = deadline_index(due);
+	}
+	d->next = wheel[i];
+	wheel[i] = d;
+	d->slot = i + 1U;
+	if ((int32_t) (due - deadline_wake) < 0) {
+		deadline_wake = due;
+	}
+}
+
+void deadline_clear(struct deadline *d)
+{
+	struct deadline **link;
+	if (!d->slot) {
+		return;
+	}
+	link = &wheel[d->slot - 1U];
+	while (*link != NULL) {
+		if (*link == d) {
+			*link = d->next;
+			break;
+		}
+		link = &(*link)->next;
+	}
+	d->slot = 0;
+}
+
+/* Set deadline_wake from the first occupied slot
+ *
+ * Only that slot's list is read. Its earliest entry due within the
+ * slot sets the wake, otherwise the end of the slot does, and later
+ * slots are looked at once it has been passed.
+ */
+static void deadline_next(void)
+{
+	struct deadline *d;
+	uint32_t t = pos;
+	uint32_t wake = pos + DEADLINE_SPAN;
+	uint32_t i = 0;
+	do {
+		d = wheel[deadline_index(t)];
+		if (d != NULL) {
+			wake = t + DEADLINE_TICK;
+			do {
+				if ((int32_t) (d->due - wake) < 0) {
+					wake = d->due;
+				}
+				d = d->next;
+			} while (d != NULL);
+			break;
+		}
+		t += DEADLINE_TICK;
+		++i;
+	} while (i < DEADLINE_SLOTS);
+	deadline_wake = wake;
+}
+
+void deadline_run(uint32_t now)
+{
+	struct deadline **link;
+	struct deadline *d;
+	uint32_t i = 0;
+	while ((int32_t) (now - pos) >= 0) {
+		link = &wheel[deadline_index(pos)];
+		// Entries set by a callback go to later slots
+		pos += DEADLINE_TICK;
+		while (*link != NULL) {
+			d = *link;
+			if ((int32_t) (now - d->due) >= 0) {
+				*link = d->next;
+				d->slot = 0;
+				d->expire(d, now);
+			} else {
+				link = &d->next;
+			}
+		}
+		// All slots visited after a long gap
+		if (++i == DEADLINE_SLOTS) {
+			pos = (now & ~(DEADLINE_TICK - 1U)) + DEADLINE_TICK;
+			break;
+		}
+	}
+	deadline_next();
+}
@@ -2,9 +2,13 @@
 
 /*
  * Simple 2 LED display
+ *
+ * Blinks invert an LED and register a deadline to restore it, and a
+ * second to end the blink.
  */
 #include "stm32f3xx.h"
 #include "display.h"
+#include "deadline.h"
 
 #define DISPLAY_GPIO	GPIOA
 #define DISPLAY_DIN	GPIO_ODR_0
@@ -23,10 +27,19 @@
 #define DISPLAY_DIN_START (1U<<6)
 #define DISPLAY_MIDI_START (1U<<7)
 
+// Blink state for one LED
+struct display_led {
+	struct deadline dl;	// next blink phase
+	uint32_t pin;
+	uint32_t set;		// latched on flag
+	uint32_t blink;		// blinking flag
+	uint32_t start;		// uptime of blink start
+};
+
 static struct display_stat {
 	uint32_t flags;
-	uint32_t midi_start;
-	uint32_t din_start;
+	struct display_led midi;
+	struct display_led din;
 } display;
 
 // Latch LEDs on or off
@@ -50,27 +63,54 @@ void display_din_off(void)
 	display.flags &= ~DISPLAY_DIN_ON;
 }
 
-// Trigger blink if not already blinking
+// Trigger blink if not already blinking, started by display_update()
 void display_midi_blink(void)
 {
 	if (!(display.flags & DISPLAY_MIDI_BLINK)) {
-		display.midi_start = Uptime;
 		display.flags |= DISPLAY_MIDI_BLINK | DISPLAY_MIDI_START;
+		PENDSV();
 	}
 }
 
 void display_din_blink(void)
 {
 	if (!(display.flags & DISPLAY_DIN_BLINK)) {
-		display.din_start = Uptime;
 		display.flags |= DISPLAY_DIN_BLINK | DISPLAY_DIN_START;
+		PENDSV();
 	}
 }
 
+// Blink deadline - restore latched state, then end the blink
+static void display_phase(struct deadline *d, uint32_t now)
+{
+	struct display_led *led = (struct display_led *)d;
+	if (now - led->start > DISPLAY_PERIOD) {
+		display.flags &= ~led->blink;
+		return;
+	}
+	if (display.flags & led->set) {
+		DISPLAY_GPIO->BSRR = led->pin;
+	} else {
+		DISPLAY_GPIO->BSRR = led->pin << 16;
+	}
+	deadline_set(d, led->start + DISPLAY_PERIOD + 1U);
+}
+
+// Invert an LED and register its restore deadline
+static uint32_t display_start(struct display_led *led, uint32_t clock)
+{
+	led->start = clock;
+	if (display.flags & led->set) {
+		deadline_set(&led->dl, clock + DISPLAY_OFFTIME + 1U);
+		return led->pin << 16;
+	}
+	deadline_set(&led->dl, clock + DISPLAY_ONTIME + 1U);
+	return led->pin;
+}
+
 // Update display state and toggle GPIO as required
 void display_update(uint32_t clock)
 {
-	uint32_t ontime;
 	uint32_t tmp = 0;
 
 	uint32_t set = display.flags & (DISPLAY_DIN_SET | DISPLAY_MIDI_SET);
@@ -95,43 +135,26 @@ void display_update(uint32_t clock)
 
 	tmp = 0;
 	if (display.flags & DISPLAY_MIDI_START) {
-		if (display.flags & DISPLAY_MIDI_SET) {
-			tmp |= DISPLAY_MIDI << 16;
-		} else {
-			tmp |= DISPLAY_MIDI;
-		}
+		tmp |= display_start(&display.midi, clock);
 		display.flags &= ~DISPLAY_MIDI_START;
-	} else if (display.flags & DISPLAY_MIDI_BLINK) {
-		ontime = clock - display.midi_start;
-		if (ontime > DISPLAY_PERIOD) {
-			display.flags &= ~DISPLAY_MIDI_BLINK;
-		} else if (display.flags & DISPLAY_MIDI_SET) {
-			if (ontime > DISPLAY_OFFTIME) {
-				tmp |= DISPLAY_MIDI;
-			}
-		} else if (ontime > DISPLAY_ONTIME) {
-			tmp |= DISPLAY_MIDI << 16;
-		}
 	}
 	if (display.flags & DISPLAY_DIN_START) {
-		if (display.flags & DISPLAY_DIN_SET) {
-			tmp |= DISPLAY_DIN << 16;
-		} else {
-			tmp |= DISPLAY_DIN;
-		}
+		tmp |= display_start(&display.din, clock);
 		display.flags &= ~DISPLAY_DIN_START;
-	} else if (display.flags & DISPLAY_DIN_BLINK) {
-		ontime = clock - display.din_start;
-		if (ontime > DISPLAY_PERIOD) {
-			display.flags &= ~DISPLAY_DIN_BLINK;
-		} else if (display.flags & DISPLAY_DIN_SET) {
-			if (ontime > DISPLAY_OFFTIME) {
-				tmp |= DISPLAY_DIN;
-			}
-		} else if (ontime > DISPLAY_ONTIME) {
-			tmp |= DISPLAY_DIN << 16;
-		}
 	}
 	if (tmp)
 		DISPLAY_GPIO->BSRR = tmp;
 }
+
+// Prepare blink deadlines
+void display_init(void)
+{
+	deadline_init(&display.midi.dl, display_phase);
+	display.midi.pin = DISPLAY_MIDI;
+	display.midi.set = DISPLAY_MIDI_SET;
+	display.midi.blink = DISPLAY_MIDI_BLINK;
+	deadline_init(&display.din.dl, display_phase);
+	display.din.pin = DISPLAY_DIN;
+	display.din.set = DISPLAY_DIN_SET;
+	display.din.blink = DISPLAY_DIN_BLINK;
+}
@@ -3,8 +3,15 @@
 /*
  * Loader (STM32F303xE)
  *
- * Transfer the program code block from flash to ccmram
- * then execute reset handler.
+ * Finish a committed firmware update, then transfer the
+ * program code block from flash to ccmram and execute
+ * reset handler.
+ *
+ * See flash.h for the update commit record. The staged image
+ * is copied over the application pages only when the record
+ * is set and the image matches its CRC-32, and the record is
+ * cleared once the copy is complete. A copy cut short by
+ * power loss is repeated on the next boot.
  */
 	.syntax unified
 	.cpu cortex-m4
@@ -132,6 +139,77 @@ vtable:
 	.section .text.Reset_Handler,"ax",%progbits
 	.type Reset_Handler, %function
 Reset_Handler:
+	ldr r5, =0x08007800		// commit record
+	ldr r0, [r5, #8]
+	ldr r1, =0x55504454		// FLASH_COMMITMAGIC
+	cmp r0, r1
+	bne LoadCode
+	ldr r6, [r5]			// image size
+	sub r0, r6, #1
+	cmp r0, #0x4000
+	bcs LoadCode
+
+/* Check the staged image with the CRC unit at its reset setup */
+	ldr r0, =0x40021000		// RCC
+	ldr r1, [r0, #0x14]
+	orr r1, r1, #0x40		// AHBENR CRCEN
+	str r1, [r0, #0x14]
+	ldr r0, =0x40023000		// CRC
+	mov r1, #1			// CR RESET
+	str r1, [r0, #8]
+	ldr r1, =0x0807c000		// staged update
+	mov r2, #0
+CheckImage:
+	ldr r3, [r1, r2]
+	str r3, [r0]
+	add r2, r2, #4
+	cmp r2, r6
+	bcc CheckImage
+	ldr r3, [r0]
+	ldr r2, [r5, #4]		// image CRC-32
+	cmp r3, r2
+	bne LoadCode
+
+/* Copy staged pages over the application, skipping erased half-words */
+	ldr r0, =0x40022000		// FLASH
+	ldr r2, =0x45670123		// KEY1
+	str r2, [r0, #4]
+	ldr r2, =0xcdef89ab		// KEY2
+	str r2, [r0, #4]
+	ldr r2, =0x08000800		// application
+	add r6, r6, r2
+	movw r7, #0xffff
+ErasePage:
+	mov r3, #2			// CR PER
+	str r3, [r0, #0x10]
+	str r2, [r0, #0x14]
+	orr r3, r3, #0x40		// CR STRT
+	str r3, [r0, #0x10]
+	bl FlashWait
+	mov r3, #1			// CR PG
+	str r3, [r0, #0x10]
+	add r4, r2, #0x800
+CopyHalf:
+	ldrh r3, [r1], #2
+	cmp r3, r7
+	beq NextHalf
+	strh r3, [r2]
+	bl FlashWait
+NextHalf:
+	add r2, r2, #2
+	cmp r2, r4
+	bcc CopyHalf
+	cmp r2, r6
+	bcc ErasePage
+
+/* Clear the commit record magic and lock the flash */
+	mov r3, #0
+	strh r3, [r5, #8]
+	bl FlashWait
+	mov r3, #0x80			// CR LOCK
+	str r3, [r0, #0x10]
+
+LoadCode:
 	mov r0, #0
 	mov r1, #0x08000800
 	mov r2, #0x10000000
@@ -149,3 +227,13 @@ CopyCode:
 	msr msp, r0
 	bx r1
 
+/* Wait for a flash operation and clear its status */
+FlashWait:
+	ldr r3, [r0, #0x0c]		// SR
+	tst r3, #1			// BSY
+	bne FlashWait
+	str r3, [r0, #0x0c]
+	bx lr
+
+	.size Reset_Handler, .-Reset_Handler
+
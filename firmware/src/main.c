@@ -12,24 +12,127 @@
 #include "settings.h"
 #include "flash.h"
 #include "timer.h"
+#include "trigger.h"
+#include "deadline.h"
+#include "update.h"
+#include "output.h"
 
-/* Output port constants */
-#define GATE1 GPIO_ODR_3
-#define GATE2 GPIO_ODR_15
-#define GATE3 GPIO_ODR_13
-#define DINRS GPIO_ODR_1
-#define DINCK GPIO_ODR_0
-#define DINFL GPIO_ODR_2
-#define OUTMASK (DINCK|DINRS|DINFL|GATE1|GATE2|GATE3)
-const uint32_t out_pins[6U] = {
+const uint32_t out_pins[SETTINGS_NROUTS] = {
 	DINCK, DINRS, DINFL, GATE1, GATE2, GATE3
 };
 
-uint32_t trig_start[6U];
-
 /* Device config */
 #define CONFIG_LENGTH	8U
 
+/* Output pins switched by each note number
+ *
+ * Rebuilt by output_map() whenever the output config changes
+ */
+#define NOTE_MAPLEN	128U
+static uint32_t note_mask[NOTE_MAPLEN];
+
+// Outputs taking a controller value, as masks of output numbers
+struct ctrl_target {
+	uint8_t all;		// value replaces parameter
+	uint8_t lo;		// value sets lower 7 bits
+	uint8_t hi;		// value sets upper 7 bits
+};
+
+/* Precompiled controller actions
+ *
+ * Controllers 32-63 carry the lower 7 bits of a 14 bit value
+ * whose upper 7 bits arrive on the controller numbered 32 less.
+ */
+struct ctrl_action {
+	uint16_t pins;		// output pins switched by controller
+	uint8_t outs;		// outputs with a divisor or offset target
+	struct ctrl_target div;
+	struct ctrl_target oft;
+};
+#define CTRL_MAPLEN	128U
+static struct ctrl_action ctrl_map[CTRL_MAPLEN];
+
+// Part of a parameter set by a controller
+enum ctrl_part {
+	CTRL_ALL,
+	CTRL_LO,
+	CTRL_HI,
+};
+
+// Add an output to a controller target
+static void ctrl_add(struct ctrl_target *tgt, enum ctrl_part part, uint8_t bit)
+{
+	switch (part) {
+	case CTRL_LO:
+		tgt->lo |= bit;
+		break;
+	case CTRL_HI:
+		tgt->hi |= bit;
+		break;
+	default:
+		tgt->all |= bit;
+		break;
+	}
+}
+
+// Add divisor and/or offset targets for an output to a controller
+static void ctrl_target(struct ctrl_action *act, uint32_t flags, uint32_t i,
+			enum ctrl_part part)
+{
+	uint8_t bit = (uint8_t) (1U << i);
+	act->outs |= bit;
+	if (flags & SETTING_CTRLDIV) {
+		ctrl_add(&act->div, part, bit);
+	}
+	if (flags & SETTING_CTRLOFT) {
+		ctrl_add(&act->oft, part, bit);
+	}
+}
+
+// Rebuild note and controller lookups from the current output config
+static void output_map(void)
+{
+	struct output_config *out;
+	struct ctrl_action *act;
+	uint32_t i = 0;
+	do {
+		note_mask[i] = 0;
+		act = &ctrl_map[i];
+		act->pins = 0;
+		act->outs = 0;
+		act->div.all = act->div.lo = act->div.hi = 0;
+		act->oft.all = act->oft.lo = act->oft.hi = 0;
+		++i;
+	} while (i < NOTE_MAPLEN);
+	i = 0;
+	do {
+		out = &config.output[i];
+		if (out->note < NOTE_MAPLEN) {
+			if (out->flags & SETTING_NOTE) {
+				note_mask[out->note] |= out_pins[i];
+			}
+			if (out->flags & SETTING_CTRL) {
+				ctrl_map[out->note].pins |=
+				    (uint16_t) out_pins[i];
+			}
+			if (out->flags & (SETTING_CTRLDIV | SETTING_CTRLOFT)) {
+				if (out->note > 31 && out->note < 64) {
+					ctrl_target(&ctrl_map[out->note],
+						    out->flags, i, CTRL_LO);
+					ctrl_target(&ctrl_map[out->note - 32U],
+						    out->flags, i, CTRL_HI);
+				} else {
+					ctrl_target(&ctrl_map[out->note],
+						    out->flags, i, CTRL_ALL);
+				}
+			}
+		}
+		++i;
+	} while (i < SETTINGS_NROUTS);
+	trigger_map();
+	timer_reload();
+}
+
 // Return a bit mask for outputs matching provided condition flags
 static uint32_t output_mask(uint32_t condition)
 {
@@ -46,34 +149,6 @@ static uint32_t output_mask(uint32_t condition)
 	return mask;
 }
 
-// Disable any output configured as trigger or continue that has expired
-static void output_expire(uint32_t nt)
-{
-	struct output_config *out;
-	uint32_t i = 0;
-	uint32_t elap;
-	uint32_t oset = GPIOC->ODR & OUTMASK;
-	if (oset) {
-		uint32_t mask = 0;
-		do {
-			if (oset & out_pins[i]) {
-				// out is currently set
-				out = &config.output[i];
-				if (out->flags &
-				    (SETTING_TRIG | SETTING_CONTINUE)) {
-					elap = nt - trig_start[i];
-					if (elap > config.triglen) {
-						mask |= out_pins[i];
-					}
-				}
-			}
-			out = &config.output[i];
-			++i;
-		} while (i < SETTINGS_NROUTS);
-		GPIOC->BRR = mask;
-	}
-}
-
 // Update outputs in response to an ALL-OFF condition
 static void output_alloff(void)
 {
@@ -83,21 +158,10 @@ static void output_alloff(void)
 // Turn on any outputs matching a note-on message
 static void output_noteon(uint32_t note)
 {
-	struct output_config *out;
-	uint32_t i = 0;
-	uint32_t mask = 0;
-	do {
-		out = &config.output[i];
-		if (out->flags & SETTING_NOTE) {
-			if (out->note == note) {
-				mask |= out_pins[i];
-				trig_start[i] = Uptime;
-			}
-		}
-		++i;
-	} while (i < SETTINGS_NROUTS);
-	GPIOC->BSRR = mask;
+	uint32_t mask = note_mask[note & MIDI_DATA_MASK];
 	if (mask) {
+		trigger_event(mask);
+		GPIOC->BSRR = mask;
 		display_din_blink();
 	}
 }
@@ -105,18 +169,7 @@ static void output_noteon(uint32_t note)
 // Turn off any outputs matching a note-off message
 static void output_noteoff(uint32_t note)
 {
-	struct output_config *out;
-	uint32_t i = 0;
-	uint32_t mask = 0;
-	do {
-		out = &config.output[i];
-		if (out->flags & SETTING_NOTE) {
-			if (out->note == note) {
-				mask |= out_pins[i];
-			}
-		}
-		++i;
-	} while (i < SETTINGS_NROUTS);
+	uint32_t mask = note_mask[note & MIDI_DATA_MASK];
 	GPIOC->BRR = mask;
 	if (IS_ENABLED(NOTE_OFF_BLINK)) {
 		if (mask) {
@@ -135,87 +188,63 @@ static void output_continue(void)
 		out = &config.output[i];
 		if (out->flags & SETTING_CONTINUE) {
 			mask |= out_pins[i];
-			trig_start[i] = Uptime;
 		}
 		++i;
 	} while (i < SETTINGS_NROUTS);
+	trigger_event(mask);
 	GPIOC->BSRR = mask;
 }
 
-// Set the lower 7 bits of divisor and/or offset
-static void set_divlo(struct output_config *out, uint32_t value)
+// Apply a controller value to all, lower or upper bits of a parameter
+static uint32_t ctrl_apply(uint32_t param, const struct ctrl_target *tgt,
+			   uint32_t bit, uint32_t value)
 {
-	if (out->flags & SETTING_CTRLDIV) {
-		out->divisor = (out->divisor & (0x7f << 7)) | value;
-	}
-	if (out->flags & SETTING_CTRLOFT) {
-		out->offset = (out->offset & (0x7f << 7)) | value;
-	}
-}
-
-// Set the upper 7 bits of divisor and/or offset
-static void set_divhi(struct output_config *out, uint32_t value)
-{
-	value <<= 7;
-	if (out->flags & SETTING_CTRLDIV) {
-		out->divisor = (out->divisor & 0x7f) | value;
-	}
-	if (out->flags & SETTING_CTRLOFT) {
-		out->offset = (out->offset & 0x7f) | value;
+	if (tgt->all & bit) {
+		param = value;
+	} else if (tgt->lo & bit) {
+		param = (param & (0x7f << 7)) | value;
+	} else if (tgt->hi & bit) {
+		param = (param & 0x7f) | (value << 7);
 	}
+	return param;
 }
 
 // Set output divisor and/or offset
-static void set_divoft(struct output_config *out, uint32_t number,
-		       uint32_t value)
+static void set_divoft(const struct ctrl_action *act, uint32_t value)
 {
-	if (out->note > 31 && out->note < 64) {
-		// Value is 14 bits in two parts
-		if (out->note == number) {
-			set_divlo(out, value);
-		} else {
-			set_divhi(out, value);
-		}
-	} else {
-		if (out->flags & SETTING_CTRLDIV) {
-			out->divisor = value;
-		}
-		if (out->flags & SETTING_CTRLOFT) {
-			out->offset = value;
+	struct output_config *out;
+	uint32_t i = 0;
+	do {
+		uint32_t bit = 1U << i;
+		if (act->outs & bit) {
+			out = &config.output[i];
+			out->divisor = ctrl_apply(out->divisor, &act->div,
+						  bit, value);
+			out->offset = ctrl_apply(out->offset, &act->oft,
+						 bit, value);
 		}
-	}
+		++i;
+	} while (i < SETTINGS_NROUTS);
 }
 
 // Update outputs with configured with controller flag
 static void output_controller(uint32_t number, uint32_t value)
 {
-	struct output_config *out;
-	uint32_t i = 0;
-	uint32_t mask = 0;
-	do {
-		out = &config.output[i];
-		if (out->flags & (SETTING_CTRLDIV | SETTING_CTRLOFT)) {
-			if (out->note == number
-			    || (out->note > 31 && out->note < 64
-				&& (out->note - 32U) == number)) {
-				set_divoft(out, number, value);
-			}
-		}
-		if (out->flags & SETTING_CTRL) {
-			if (out->note == number) {
-				if (value < 64) {
-					// Switch Off
-					mask |= out_pins[i] << 16;
-				} else {
-					// Switch On
-					mask |= out_pins[i];
-					trig_start[i] = Uptime;
-				}
-			}
+	const struct ctrl_action *act = &ctrl_map[number & MIDI_DATA_MASK];
+	if (act->outs) {
+		set_divoft(act, value);
+		timer_reload();
+	}
+	if (act->pins) {
+		if (value < 64) {
+			// Switch Off
+			GPIOC->BRR = act->pins;
+		} else {
+			// Switch On
+			trigger_event(act->pins);
+			GPIOC->BSRR = act->pins;
 		}
-		++i;
-	} while (i < SETTINGS_NROUTS);
-	GPIOC->BSRR = mask;
+	}
 }
 
 // Handle a MIDI mode message
@@ -275,9 +304,9 @@ static void output_start(void)
 {
 	// Ensure all clocked outputs are lowered before setting run/stop
 	GPIOC->BRR = output_mask(SETTING_CLOCK | SETTING_RUNSTOP);
+	// Temp: start trigger length on output 1
+	trigger_event(out_pins[1U]);
 	GPIOC->BSRR = output_mask(SETTING_RUNSTOP);
-	// Temp: set the uptime on output 1
-	trig_start[1U] = Uptime;
 	display_din_on();
 }
 
@@ -288,14 +317,35 @@ static void output_stop(void)
 	display_din_off();
 }
 
-static void rt_msg(struct midi_event *msg)
+/* Handle a transport message at receive time
+ *
+ * Runs in the receive interrupt, ahead of the queued copy of the
+ * message. Outputs and display follow from rt_msg(), which is reached
+ * well before the first clock after a start. The UART and USB
+ * receive interrupts share a preemption group, so the timer is never
+ * reentered from a second source.
+ */
+void system_transport(uint32_t status, uint32_t at)
 {
-	switch (msg->evt.raw.midi0) {
+	switch (status) {
 	case MIDI_RT_CLOCK:
-		timer_clock(msg);
+		timer_clock(at);
 		break;
 	case MIDI_RT_START:
 		timer_preroll();
+		break;
+	case MIDI_RT_STOP:
+		timer_stop();
+		break;
+	default:
+		break;
+	}
+}
+
+static void rt_msg(struct midi_event *msg)
+{
+	switch (msg->evt.raw.midi0) {
+	case MIDI_RT_START:
 		output_start();
 		break;
 	case MIDI_RT_CONTINUE:
@@ -304,7 +354,6 @@ static void rt_msg(struct midi_event *msg)
 		break;
 	case MIDI_RT_STOP:
 		output_stop();
-		timer.on = 0;
 		break;
 	case MIDI_RT_RESET:
 		output_alloff();
@@ -321,20 +370,28 @@ static void config_preset(uint32_t preset)
 {
 	if (preset < PRESETS_LEN) {
 		settings_preset(preset);
+		midi_event_map();
+		output_map();
 		// Temp
 		TIM2->ARR = config.delay;
 	}
 }
 
-// Handle an output config update
+// Handle an output config update, rejecting a clock with no divisor
 static void config_output(uint8_t * cfg)
 {
+	uint32_t flags = cfg[2] | (cfg[3] << 7);
+	uint32_t divisor = cfg[4] | (cfg[5] << 7);
+	if ((flags & SETTING_CLOCK) && divisor == 0) {
+		return;
+	}
 	if (cfg[1] < SETTINGS_NROUTS) {
 		struct output_config *out = &config.output[cfg[1]];
-		out->flags = cfg[2] | (cfg[3] << 7);
-		out->divisor = cfg[4] | (cfg[5] << 7);
+		out->flags = flags;
+		out->divisor = divisor;
 		out->offset = cfg[6] | (cfg[7] << 7);
 		out->note = cfg[8];
+		output_map();
 	}
 }
 
@@ -349,6 +406,8 @@ static void config_general(uint8_t * cfg)
 	config.fusb = cfg[9] | (cfg[10] << 7) | (cfg[11] << 14);
 	config.fmidi = cfg[12] | (cfg[13] << 7) | (cfg[14] << 14);
 	config.triglen = (cfg[15] << 3);	// Convert triglen ms to uptimes
+	midi_event_map();
+	trigger_map();
 	// Temp
 	TIM2->ARR = config.delay;
 }
@@ -376,30 +435,35 @@ static void config_message(uint8_t * cfg, uint32_t len)
 			config_output(cfg);
 		}
 		break;
+	case 0x06:
+		// Event queue depth and coalescing, not saved
+		if (len == 3) {
+			midi_event_config(cfg[1], cfg[2] & 0x1U);
+		}
+		break;
+	case UPDATE_BEGIN:
+		if (IS_ENABLED(SYSEX_UPDATE) && len == 4) {
+			update_begin(cfg[1] | (cfg[2] << 7) | (cfg[3] << 14));
+		}
+		break;
+	case UPDATE_COMMIT:
+		if (IS_ENABLED(SYSEX_UPDATE) && len == 6) {
+			update_commit(cfg[1] | (cfg[2] << 7) | (cfg[3] << 14)
+				      | (cfg[4] << 21) | ((uint32_t) cfg[5] << 28));
+		}
+		break;
 	default:
 		break;
 	};
 }
 
-// Compute the expected CRC-7/MMC value on the received message
-static uint32_t sysex_crc(struct midi_sysex_config *cfg, uint32_t len)
-{
-	CRC->CR |= CRC_CR_RESET;
-	CRC->DR = SYSEX_INVID;
-	uint32_t i = 0;
-	while (i < len) {
-		*(__IO uint8_t *) (__IO void *)(&CRC->DR) = cfg->data[i];
-		++i;
-	}
-	return CRC->DR;
-}
-
-static void sysex_config(struct midi_sysex_config *cfg, uint32_t len)
+// Apply a config message whose trailing CRC matches the received crc
+static void sysex_config(struct midi_sysex_config *cfg, uint32_t len,
+			 uint32_t crc)
 {
 	// Minimum message includes header, command and crc
 	if (len > 5) {
 		len -= 5;
-		uint32_t crc = sysex_crc(cfg, len);
 		if (crc == cfg->data[len]) {
 			config_message(&cfg->data[0], len);
 		}
@@ -414,7 +478,7 @@ static void sysex(struct midi_event *event)
 	cfg = midi_sysex_buf(event);
 	if (cfg != NULL) {
 		if (cfg->idcfg == SYSEX_ID) {
-			sysex_config(cfg, len);
+			sysex_config(cfg, len, event->evt.raw.midi2);
 		}
 	}
 	midi_sysex_done(event);
@@ -424,7 +488,6 @@ static void sysex(struct midi_event *event)
 void system_update(void)
 {
 	struct midi_event *msg;
-	static uint32_t lt = 0;
 	uint32_t t = Uptime;
 	do {
 		msg = midi_event_poll();
@@ -448,11 +511,8 @@ void system_update(void)
 			midi_event_done();
 		}
 	} while (msg != NULL);
-	if (lt != t) {
-		output_expire(t);
-		display_update(t);
-	}
-	lt = t;
+	display_update(t);
+	deadline_run(t);
 	if (IS_ENABLED(USE_IWDG))
 		IWDG->KR = 0xaaaa;
 }
@@ -460,8 +520,13 @@ void system_update(void)
 void main(void)
 {
 	settings_init();
+	output_map();
+	display_init();
+	trigger_init();
 	timer_init();
 	midi_event_init();
+	if (IS_ENABLED(SYSEX_UPDATE))
+		update_init();
 	if (IS_ENABLED(USE_IWDG))
 		IWDG->KR = 0xcccc;
 }
@@ -10,7 +10,21 @@
  * Sysex packets up to a length of 46 bytes are buffered
  * in the receiver. Valid sysex messages are indicated
  * to the event interface with a three byte sysex event
- * packet containing the length of data received.
+ * packet containing the length of data received. Firmware
+ * update data is streamed to the update interface instead.
+ *
+ * Events are queued in three lanes, each with its own depth and
+ * overflow policy, and are taken out in lane order:
+ *
+ *  - real time, transport and system common
+ *  - channel voice and mode
+ *  - system exclusive notifications
+ *
+ * Received bytes are parsed while every lane has room, so that real
+ * time messages overtake voice traffic already waiting. The UART and
+ * USB receive interrupts each fill their own ring, and are merged
+ * here in order of their stamps, so that the lanes have a single
+ * producer regardless of interrupt priorities.
  *
  * References:
  *
@@ -21,28 +35,65 @@
 #include "midi_event.h"
 #include "midi_uart.h"
 #include "midi_usb.h"
+#include "update.h"
 #include "display.h"
 #include "stm32f303xe.h"
 #include "settings.h"
 #include "timer.h"
+#include "deadline.h"
 
-#define RCVBUFBITS		4U
-#define RCVBUFLEN		(1U << RCVBUFBITS)
-#define	RCVBUFMASK		(RCVBUFLEN - 1U)
+// Lane depths, log2
+#ifndef RTBUFBITS
+#define RTBUFBITS		3U
+#endif
+#ifndef RCVBUFBITS
+#define RCVBUFBITS		4U	// largest voice depth at run time
+#endif
+#ifndef SYXBUFBITS
+#define SYXBUFBITS		1U
+#endif
+#define MIDI_SENSE_POLL		(MIDI_SENSE_TIMEOUT >> 3)
 #define SYSBUFLEN		64U
 #define MIDI_OVERRUN		24U
+#ifndef CRC7_LOOKUP
+#define CRC7_LOOKUP		IS_ENABLED(CRC7_TABLE)	// sysex CRC-7 from table
+#endif
 
 // Shared SysEx packet ID counter
 static uint32_t sysexcount;
 
-static struct midi_event_buf {
-	volatile uint32_t wi;
-	volatile uint32_t ri;
-	struct midi_event rcv[RCVBUFLEN];
-} event_buf;
+// Event ring, head and tail run freely and are masked on access
+struct midi_event_lane {
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	uint32_t mask;		// ring length less one
+	struct midi_event *rcv;
+};
+
+static struct midi_event rt_buf[1U << RTBUFBITS];
+static struct midi_event voice_buf[1U << RCVBUFBITS];
+static struct midi_event syx_buf[1U << SYXBUFBITS];
+
+static struct midi_event_lane lane[MIDI_LANES] = {
+	[MIDI_LANE_RT] = { 0, 0, (1U << RTBUFBITS) - 1U, rt_buf },
+	[MIDI_LANE_VOICE] = { 0, 0, (1U << RCVBUFBITS) - 1U, voice_buf },
+	[MIDI_LANE_SYSEX] = { 0, 0, (1U << SYXBUFBITS) - 1U, syx_buf },
+};
+
+// Lane of the event returned by midi_event_poll()
+static uint32_t polled;
+
+// Voice lane mask, taken up when the lane is next empty
+static uint32_t voicemask = (1U << RCVBUFBITS) - 1U;
+
+// Coalesce controller changes under pressure
+static uint32_t coalesce = IS_ENABLED(MIDI_COALESCE);
+
+struct midi_event_stats midi_event_stats[MIDI_LANES];
 
 struct midi_receiver {
 	uint32_t time;		// system time of last received byte
+	uint32_t stamp;		// core cycle time of last received byte
 	uint32_t status;	// current running status
 	uint32_t cin;		// current Code Index (CIN)
 	uint32_t data1;		// previous data byte
@@ -52,32 +103,241 @@ struct midi_receiver {
 	uint32_t clocked;	// clock pulse received flag
 	uint32_t lastclock;	// uptime of last received clock message
 	uint32_t sysid;		// id of sysex packet for curent buf
+	uint32_t crc;		// CRC-7/MMC of all but the last sysex byte
+	uint32_t stream;	// sysex data passed to update interface
 	uint8_t sysbuf[MIDI_MAX_SYSEX];	// sysex packet buffer
 } rcv[2];
 
-/* Copy raw midi packet into receive buffer
+// Cable filter code index masks, rebuilt by midi_event_map()
+static uint32_t accept[2];
+
+void midi_event_map(void)
+{
+	// Sysex packets are always received
+	accept[MIDI_CABLE_USB] = config.fusb | (1U << MIDI_CIN_EOX_3);
+	accept[MIDI_CABLE_UART] = config.fmidi | (1U << MIDI_CIN_EOX_3);
+}
+
+uint32_t midi_accept(const uint32_t cableno, uint32_t cin)
+{
+	return accept[cableno] & (1U << cin);
+}
+
+// Return the lane for events with code index cin
+static uint32_t lane_select(uint32_t cin)
+{
+	if (cin == MIDI_CIN_EOX_3) {
+		return MIDI_LANE_SYSEX;
+	}
+	if (cin >= MIDI_CIN_NOTE_OFF && cin < MIDI_CIN_BYTE) {
+		return MIDI_LANE_VOICE;
+	}
+	return MIDI_LANE_RT;
+}
+
+// Return non-zero if every lane has room for another event
+static uint32_t lane_room(void)
+{
+	uint32_t i = 0;
+	// A sysex notification holds its receive buffer until it is taken
+	if (lane[MIDI_LANE_SYSEX].head != lane[MIDI_LANE_SYSEX].tail) {
+		return 0;
+	}
+	do {
+		if (lane[i].head - lane[i].tail > lane[i].mask) {
+			return 0;
+		}
+		++i;
+	} while (i < MIDI_LANES);
+	return 1U;
+}
+
+/* Make room on a full real time lane, return zero if there is none
+ *
+ * The newest clock or system common message is removed and the
+ * events after it move down. Clocks have already been passed to the
+ * reference clock by midi_transport().
+ */
+static uint32_t lane_evict(struct midi_event_lane *q)
+{
+	uint32_t i = q->head;
+	while (i != q->tail) {
+		--i;
+		if (q->rcv[i & q->mask].evt.raw.midi0 <= MIDI_RT_CLOCK) {
+			while (i + 1U != q->head) {
+				q->rcv[i & q->mask] = q->rcv[(i + 1U) & q->mask];
+				++i;
+			}
+			q->head = i;
+			return 1U;
+		}
+	}
+	return 0;
+}
+
+/* Merge an event into a queued one, return non-zero if merged
+ *
+ * A clock following a queued clock from the same cable adds to the
+ * count in its midi1. When coalescing and the lane is at least half
+ * full, a controller change takes the place of a queued change to the
+ * same controller. The search stops at the first queued message that
+ * is not a controller change on the same channel, so no change moves
+ * past a note.
+ */
+static uint32_t lane_merge(struct midi_event_lane *q,
+			   union midi_event_pkt e, uint32_t clock)
+{
+	struct midi_event *dst;
+	uint32_t i = q->head;
+	if (i == q->tail) {
+		return 0;
+	}
+	dst = &q->rcv[(i - 1U) & q->mask];
+	if (e.raw.midi0 == MIDI_RT_CLOCK) {
+		if (dst->evt.raw.header != e.raw.header
+		    || dst->evt.raw.midi0 != MIDI_RT_CLOCK) {
+			return 0;
+		}
+		if (dst->evt.raw.midi1 < MIDI_DATA_MASK) {
+			dst->evt.raw.midi1++;
+		}
+		return 1U;
+	}
+	if (!coalesce || (e.raw.header & MIDI_CIN_MASK) != MIDI_CIN_CONTROL
+	    || i - q->tail <= (q->mask >> 1)) {
+		return 0;
+	}
+	do {
+		dst = &q->rcv[--i & q->mask];
+		if (dst->evt.raw.header != e.raw.header
+		    || dst->evt.raw.midi0 != e.raw.midi0) {
+			break;
+		}
+		if (dst->evt.raw.midi1 == e.raw.midi1) {
+			dst->evt.raw.midi2 = e.raw.midi2;
+			dst->clock = clock;
+			return 1U;
+		}
+	} while (i != q->tail);
+	return 0;
+}
+
+/* Copy raw midi packet into its lane
+ *
+ * On a full lane:
+ *
+ *  - start, continue, stop and reset displace the newest queued
+ *    clock or system common message
+ *  - voice events are dropped
+ *  - a sysex notification is dropped and its buffer released, so
+ *    that the cable can receive the next message
  *
- * Drop packet in case of overrun (tbc)
+ * Clocks, and controller changes when coalescing, may instead be
+ * merged into a queued event by lane_merge().
  *
+ * Packets are appended while parsing from midi_event_poll(), so no
+ * PendSV is needed to process them. This must not be called from an
+ * interrupt handler.
  */
 void midi_event_append(uint32_t event, uint32_t clock)
 {
-	uint32_t look = (event_buf.wi + 1U) & RCVBUFMASK;
-	if (look != event_buf.ri) {
-		struct midi_event *dst = &event_buf.rcv[look];
-		dst->evt.val = event;
-		dst->clock = clock;
-		barrier();
-		event_buf.wi = look;
-	} else {
+	union midi_event_pkt e = {.val = event };
+	uint32_t cin = e.raw.header & MIDI_CIN_MASK;
+	uint32_t l = lane_select(cin);
+	struct midi_event_lane *q = &lane[l];
+	struct midi_event_stats *st = &midi_event_stats[l];
+	struct midi_event *dst;
+	uint32_t head = q->head;
+
+	if (lane_merge(q, e, clock)) {
+		st->merged++;
+		return;
+	}
+	if (head - q->tail > q->mask) {
 		BREAKPOINT(MIDI_OVERRUN);
+		st->dropped++;
+		if (cin == MIDI_CIN_EOX_3) {
+			rcv[(e.raw.header & MIDI_CABLE_MASK) >> 4].sysid = 0;
+		}
+		if (q != &lane[MIDI_LANE_RT] || e.raw.midi0 <= MIDI_RT_CLOCK
+		    || !lane_evict(q)) {
+			return;
+		}
+		head = q->head;
+	}
+	dst = &q->rcv[head & q->mask];
+	dst->evt.val = event;
+	dst->clock = clock;
+	barrier();
+	q->head = head + 1U;
+	if (head + 1U - q->tail > st->high) {
+		st->high = head + 1U - q->tail;
+	}
+}
+
+// CRC-7/MMC remainders for (crc << 1) ^ byte
+static const uint8_t crc7_table[256] = {
+	0x00, 0x09, 0x12, 0x1b, 0x24, 0x2d, 0x36, 0x3f,
+	0x48, 0x41, 0x5a, 0x53, 0x6c, 0x65, 0x7e, 0x77,
+	0x19, 0x10, 0x0b, 0x02, 0x3d, 0x34, 0x2f, 0x26,
+	0x51, 0x58, 0x43, 0x4a, 0x75, 0x7c, 0x67, 0x6e,
+	0x32, 0x3b, 0x20, 0x29, 0x16, 0x1f, 0x04, 0x0d,
+	0x7a, 0x73, 0x68, 0x61, 0x5e, 0x57, 0x4c, 0x45,
+	0x2b, 0x22, 0x39, 0x30, 0x0f, 0x06, 0x1d, 0x14,
+	0x63, 0x6a, 0x71, 0x78, 0x47, 0x4e, 0x55, 0x5c,
+	0x64, 0x6d, 0x76, 0x7f, 0x40, 0x49, 0x52, 0x5b,
+	0x2c, 0x25, 0x3e, 0x37, 0x08, 0x01, 0x1a, 0x13,
+	0x7d, 0x74, 0x6f, 0x66, 0x59, 0x50, 0x4b, 0x42,
+	0x35, 0x3c, 0x27, 0x2e, 0x11, 0x18, 0x03, 0x0a,
+	0x56, 0x5f, 0x44, 0x4d, 0x72, 0x7b, 0x60, 0x69,
+	0x1e, 0x17, 0x0c, 0x05, 0x3a, 0x33, 0x28, 0x21,
+	0x4f, 0x46, 0x5d, 0x54, 0x6b, 0x62, 0x79, 0x70,
+	0x07, 0x0e, 0x15, 0x1c, 0x23, 0x2a, 0x31, 0x38,
+	0x41, 0x48, 0x53, 0x5a, 0x65, 0x6c, 0x77, 0x7e,
+	0x09, 0x00, 0x1b, 0x12, 0x2d, 0x24, 0x3f, 0x36,
+	0x58, 0x51, 0x4a, 0x43, 0x7c, 0x75, 0x6e, 0x67,
+	0x10, 0x19, 0x02, 0x0b, 0x34, 0x3d, 0x26, 0x2f,
+	0x73, 0x7a, 0x61, 0x68, 0x57, 0x5e, 0x45, 0x4c,
+	0x3b, 0x32, 0x29, 0x20, 0x1f, 0x16, 0x0d, 0x04,
+	0x6a, 0x63, 0x78, 0x71, 0x4e, 0x47, 0x5c, 0x55,
+	0x22, 0x2b, 0x30, 0x39, 0x06, 0x0f, 0x14, 0x1d,
+	0x25, 0x2c, 0x37, 0x3e, 0x01, 0x08, 0x13, 0x1a,
+	0x6d, 0x64, 0x7f, 0x76, 0x49, 0x40, 0x5b, 0x52,
+	0x3c, 0x35, 0x2e, 0x27, 0x18, 0x11, 0x0a, 0x03,
+	0x74, 0x7d, 0x66, 0x6f, 0x50, 0x59, 0x42, 0x4b,
+	0x17, 0x1e, 0x05, 0x0c, 0x33, 0x3a, 0x21, 0x28,
+	0x5f, 0x56, 0x4d, 0x44, 0x7b, 0x72, 0x69, 0x60,
+	0x0e, 0x07, 0x1c, 0x15, 0x2a, 0x23, 0x38, 0x31,
+	0x46, 0x4f, 0x54, 0x5d, 0x62, 0x6b, 0x70, 0x79,
+};
+
+// Shift one sysex byte through a running CRC-7/MMC
+static uint32_t crc7_byte(uint32_t crc, uint32_t db)
+{
+	if (CRC7_LOOKUP) {
+		return crc7_table[((crc << 1) ^ db) & 0xffU];
+	}
+	// Peripheral is shared by both cables, reload the remainder
+	CRC->INIT = crc;
+	CRC->CR |= CRC_CR_RESET;
+	CRC_BYTE((uint8_t) db);
+	return CRC->DR;
+}
+
+// End a streamed sysex
+static void rcv_close(const uint32_t cableno, uint32_t ok)
+{
+	if (IS_ENABLED(SYSEX_UPDATE) && rcv[cableno].stream) {
+		rcv[cableno].stream = 0;
+		rcv[cableno].sysid = 0;
+		update_close(ok);
 	}
-	PENDSV();
 }
 
 // Reset receive status
 void midi_reset(const uint32_t cableno)
 {
+	rcv_close(cableno, 0);
 	rcv[cableno].cin = MIDI_CIN_RESERVED_0;
 	rcv[cableno].status = MIDI_STATUS_NULL;
 	rcv[cableno].bytes = 0U;
@@ -87,13 +347,32 @@ void midi_reset(const uint32_t cableno)
 // Receive system exclusive data byte
 static void rcv_sys(const uint32_t cableno, uint32_t db)
 {
-	if (rcv[cableno].count >= MIDI_MAX_SYSEX) {
+	uint32_t count = rcv[cableno].count;
+	if (IS_ENABLED(SYSEX_UPDATE) && rcv[cableno].stream
+	    && count > UPDATE_HEADER) {
+		// Pass on all but the last byte, held back for the CRC
+		uint32_t held = rcv[cableno].sysbuf[count - 1U];
+		rcv[cableno].crc = crc7_byte(rcv[cableno].crc, held);
+		update_data(held);
+		rcv[cableno].sysbuf[count - 1U] = (uint8_t) db;
+		return;
+	}
+	if (count >= MIDI_MAX_SYSEX) {
 		// Too many bytes for this device, ignore whole packet
 		midi_reset(cableno);
 		return;
 	}
-	rcv[cableno].sysbuf[rcv[cableno].count] = (uint8_t) db;
-	rcv[cableno].count++;
+	// Checksum trails by one byte, the last is the CRC itself
+	if (count) {
+		rcv[cableno].crc = crc7_byte(rcv[cableno].crc,
+					     rcv[cableno].sysbuf[count - 1U]);
+	}
+	rcv[cableno].sysbuf[count] = (uint8_t) db;
+	rcv[cableno].count = count + 1U;
+	if (IS_ENABLED(SYSEX_UPDATE) && count + 1U == UPDATE_HEADER
+	    && update_open((struct midi_sysex_config *)rcv[cableno].sysbuf)) {
+		rcv[cableno].stream = 1U;
+	}
 }
 
 // Receive a data byte
@@ -111,16 +390,18 @@ static void rcv_data(const uint32_t cableno, uint32_t db)
 				sb &= ~(0x10U);
 			}
 		}
-		e.raw.header |= (uint8_t) cin;
-		e.raw.midi0 = (uint8_t) sb;
-		if (rcv[cableno].bytes == 2U) {
-			e.raw.midi1 = (uint8_t) rcv[cableno].data1;
-			e.raw.midi2 = (uint8_t) db;
-		} else {
-			e.raw.midi1 = (uint8_t) db;
-			e.raw.midi2 = 0U;
+		if (midi_accept(cableno, cin)) {
+			e.raw.header |= (uint8_t) cin;
+			e.raw.midi0 = (uint8_t) sb;
+			if (rcv[cableno].bytes == 2U) {
+				e.raw.midi1 = (uint8_t) rcv[cableno].data1;
+				e.raw.midi2 = (uint8_t) db;
+			} else {
+				e.raw.midi1 = (uint8_t) db;
+				e.raw.midi2 = 0U;
+			}
+			midi_event_append(e.val, rcv[cableno].stamp);
 		}
-		midi_event_append(e.val, rcv[cableno].time);
 		if (rcv[cableno].cin == MIDI_CIN_COMMON_3
 		    || rcv[cableno].cin == MIDI_CIN_COMMON_2) {
 			midi_reset(cableno);
@@ -132,7 +413,7 @@ static void rcv_data(const uint32_t cableno, uint32_t db)
 	}
 }
 
-// Enqueue system exclusive message packet length
+// Enqueue system exclusive message packet length and CRC
 static void sys_msg(const uint32_t cableno)
 {
 	if (rcv[cableno].count) {
@@ -142,7 +423,7 @@ static void sys_msg(const uint32_t cableno)
 				(uint8_t) (cableno << 4) | MIDI_CIN_EOX_3,
 				.midi0 = MIDI_STATUS_SYSTEM,
 				.midi1 = (uint8_t) rcv[cableno].count,
-				.midi2 = MIDI_STATUS_EOX,
+				.midi2 = (uint8_t) rcv[cableno].crc,
 				 }
 		};
 		midi_event_append(e.val, rcv[cableno].sysid);
@@ -153,6 +434,9 @@ static void sys_msg(const uint32_t cableno)
 static void single_byte_msg(const uint32_t cableno, uint32_t cin,
 			    uint32_t midi0)
 {
+	if (!midi_accept(cableno, cin)) {
+		return;
+	}
 	union midi_event_pkt e = {
 		.raw = {
 			.header = (uint8_t) (cin | cableno << 4),
@@ -161,108 +445,133 @@ static void single_byte_msg(const uint32_t cableno, uint32_t cin,
 			.midi2 = 0U,
 			 }
 	};
-	midi_event_append(e.val, rcv[cableno].time);
+	midi_event_append(e.val, rcv[cableno].stamp);
 }
 
-// Prepare for a 2 byte message
-static void status_2_byte(const uint32_t cableno, uint32_t cin, uint32_t status)
-{
-	rcv[cableno].cin = cin;
-	rcv[cableno].status = status;
-	rcv[cableno].bytes = 1U;
-	rcv[cableno].count = 0U;
-}
+// Status byte actions
+enum rcv_action {
+	RCV_IGNORE = 0U,	// ignore, keep running status
+	RCV_CLEAR,		// clear running status
+	RCV_STATUS,		// start of channel or common message
+	RCV_SYSEX,		// start of system exclusive
+	RCV_EOX,		// end of system exclusive
+	RCV_CLOCK,		// timing clock
+	RCV_REALTIME,		// single byte real time message
+	RCV_SINGLE,		// single byte message, clear running status
+};
+
+// Status byte classification
+struct rcv_class {
+	uint8_t action;		// enum rcv_action
+	uint8_t cin;		// Code Index (CIN) of message
+	uint8_t bytes;		// number of data bytes expected (0,1,2)
+};
+
+#define RCV_INDEX(sb)		((sb) & MIDI_DATA_MASK)
+#define RCV_CHANNEL(cin, bytes)	\
+	{ RCV_STATUS, (cin), (bytes) }, { RCV_STATUS, (cin), (bytes) }, \
+	{ RCV_STATUS, (cin), (bytes) }, { RCV_STATUS, (cin), (bytes) }, \
+	{ RCV_STATUS, (cin), (bytes) }, { RCV_STATUS, (cin), (bytes) }, \
+	{ RCV_STATUS, (cin), (bytes) }, { RCV_STATUS, (cin), (bytes) }, \
+	{ RCV_STATUS, (cin), (bytes) }, { RCV_STATUS, (cin), (bytes) }, \
+	{ RCV_STATUS, (cin), (bytes) }, { RCV_STATUS, (cin), (bytes) }, \
+	{ RCV_STATUS, (cin), (bytes) }, { RCV_STATUS, (cin), (bytes) }, \
+	{ RCV_STATUS, (cin), (bytes) }, { RCV_STATUS, (cin), (bytes) }
 
-// Prepare for a 3 byte message
-static void status_3_byte(const uint32_t cableno, uint32_t cin, uint32_t status)
+/* Classification of status bytes, indexed by value less 0x80
+ *
+ * MIDI 1.0 Detailed Specification 4.2, A-1:
+ * "undefined Real Time status bytes (F9H, FDH) [...] should always
+ *  be ignored, and the running status buffer should remain unaffected"
+ * "undefined System Common status bytes (F4H and F5H) [...] should be
+ *  ignored and the running status buffer should be cleared"
+ */
+static const struct rcv_class rcv_class[128] = {
+	[RCV_INDEX(MIDI_STATUS_NOTEOFF)] = RCV_CHANNEL(MIDI_CIN_NOTE_OFF, 2U),
+	[RCV_INDEX(MIDI_STATUS_NOTEON)] = RCV_CHANNEL(MIDI_CIN_NOTE_ON, 2U),
+	[RCV_INDEX(MIDI_STATUS_POLYPRESS)] = RCV_CHANNEL(MIDI_CIN_POLY, 2U),
+	[RCV_INDEX(MIDI_STATUS_CONTROL)] = RCV_CHANNEL(MIDI_CIN_CONTROL, 2U),
+	[RCV_INDEX(MIDI_STATUS_PROGRAM)] = RCV_CHANNEL(MIDI_CIN_PROG, 1U),
+	[RCV_INDEX(MIDI_STATUS_CHANPRESS)] = RCV_CHANNEL(MIDI_CIN_PRESS, 1U),
+	[RCV_INDEX(MIDI_STATUS_BENDER)] = RCV_CHANNEL(MIDI_CIN_BEND, 2U),
+	[RCV_INDEX(MIDI_STATUS_SYSTEM)] = { RCV_SYSEX, MIDI_CIN_EOX_3, 2U },
+	[RCV_INDEX(MIDI_STATUS_MTCQF)] = { RCV_STATUS, MIDI_CIN_COMMON_2, 1U },
+	[RCV_INDEX(MIDI_STATUS_SPP)] = { RCV_STATUS, MIDI_CIN_COMMON_3, 2U },
+	[RCV_INDEX(MIDI_STATUS_SONGSEL)] = { RCV_STATUS, MIDI_CIN_COMMON_2, 1U },
+	[RCV_INDEX(MIDI_STATUS_UNDEF4)] = { RCV_CLEAR, 0U, 0U },
+	[RCV_INDEX(MIDI_STATUS_UNDEF5)] = { RCV_CLEAR, 0U, 0U },
+	[RCV_INDEX(MIDI_STATUS_TUNEREQ)] = { RCV_SINGLE, MIDI_CIN_SYS_1, 0U },
+	[RCV_INDEX(MIDI_STATUS_EOX)] = { RCV_EOX, 0U, 0U },
+	[RCV_INDEX(MIDI_RT_CLOCK)] = { RCV_CLOCK, MIDI_CIN_BYTE, 0U },
+	[RCV_INDEX(MIDI_RT_UNDEF9)] = { RCV_IGNORE, 0U, 0U },
+	[RCV_INDEX(MIDI_RT_START)] = { RCV_REALTIME, MIDI_CIN_BYTE, 0U },
+	[RCV_INDEX(MIDI_RT_CONTINUE)] = { RCV_REALTIME, MIDI_CIN_BYTE, 0U },
+	[RCV_INDEX(MIDI_RT_STOP)] = { RCV_REALTIME, MIDI_CIN_BYTE, 0U },
+	[RCV_INDEX(MIDI_RT_UNDEFd)] = { RCV_IGNORE, 0U, 0U },
+	[RCV_INDEX(MIDI_RT_SENSE)] = { RCV_IGNORE, 0U, 0U },
+	[RCV_INDEX(MIDI_RT_RESET)] = { RCV_SINGLE, MIDI_CIN_BYTE, 0U },
+};
+
+// Prepare for a message with data bytes
+static void status_msg(const uint32_t cableno, const struct rcv_class *cls,
+		       uint32_t status)
 {
-	rcv[cableno].cin = cin;
+	rcv_close(cableno, 0);
+	rcv[cableno].cin = cls->cin;
 	rcv[cableno].status = status;
-	rcv[cableno].bytes = 2U;
+	rcv[cableno].bytes = cls->bytes;
 	rcv[cableno].count = 0U;
 }
 
 // Receive a status byte
 static void rcv_status(const uint32_t cableno, uint32_t sb)
 {
+	const struct rcv_class *cls = &rcv_class[RCV_INDEX(sb)];
 	rcv[cableno].sense = 1U;
-	switch (sb) {
-	case MIDI_RT_CLOCK:
+	switch (cls->action) {
+	case RCV_CLOCK:
 		display_midi_on();
 		rcv[cableno].clocked = 1U;
 		rcv[cableno].lastclock = rcv[cableno].time;
-		single_byte_msg(cableno, MIDI_CIN_BYTE, sb);
+		single_byte_msg(cableno, cls->cin, sb);
 		break;
-	case MIDI_RT_START:
-	case MIDI_RT_CONTINUE:
-	case MIDI_RT_STOP:
-		single_byte_msg(cableno, MIDI_CIN_BYTE, sb);
+	case RCV_REALTIME:
+		single_byte_msg(cableno, cls->cin, sb);
 		break;
-	case MIDI_RT_RESET:
-		single_byte_msg(cableno, MIDI_CIN_BYTE, sb);
+	case RCV_SINGLE:
+		single_byte_msg(cableno, cls->cin, sb);
 		midi_reset(cableno);
 		break;
-	case MIDI_RT_SENSE:
-	case MIDI_RT_UNDEF9:
-	case MIDI_RT_UNDEFd:
-		/* MIDI 1.0 Detailed Specification 4.2, A-1:
-		 * "undefined Real Time status bytes (F9H, FDH)
-		 *  [...] should always be ignored, and the running
-		 *  status buffer should remain unaffected"
-		 */
+	case RCV_STATUS:
+		status_msg(cableno, cls, sb);
 		break;
-	case MIDI_STATUS_SYSTEM:
+	case RCV_SYSEX:
 		// Special case: Sysex msg len in EOX3 packet
 		if (rcv[cableno].sysid == 0) {
 			rcv[cableno].sysid = 0x80000000 | sysexcount++;
-			status_3_byte(cableno, MIDI_CIN_EOX_3,
-				      MIDI_STATUS_SYSTEM);
+			rcv[cableno].crc = CRC7_INIT;
+			status_msg(cableno, cls, sb);
 		} else {
 			// sysbuf still contains unread data, ignore packet
 			midi_reset(cableno);
 		}
 		break;
-	case MIDI_STATUS_SPP:
-		status_3_byte(cableno, MIDI_CIN_COMMON_3, MIDI_STATUS_SPP);
-		break;
-	case MIDI_STATUS_MTCQF:
-	case MIDI_STATUS_SONGSEL:
-		status_2_byte(cableno, MIDI_CIN_COMMON_2, sb);
-		break;
-	case MIDI_STATUS_UNDEF4:
-	case MIDI_STATUS_UNDEF5:
-		/* MIDI 1.0 Detailed Specification 4.2 A-1:
-		 * "undefined System Common status bytes (F4H and F5H)
-		 * [...] should be ignored and the running status buffer
-		 * should be cleared"
-		 */
-		midi_reset(cableno);
-		break;
-	case MIDI_STATUS_TUNEREQ:
-		single_byte_msg(cableno, MIDI_CIN_SYS_1, sb);
+	case RCV_EOX:
+		if (rcv[cableno].stream) {
+			uint32_t count = rcv[cableno].count;
+			rcv_close(cableno, count > UPDATE_HEADER
+				  && rcv[cableno].crc ==
+				  rcv[cableno].sysbuf[count - 1U]);
+		} else {
+			sys_msg(cableno);
+		}
 		midi_reset(cableno);
 		break;
-	case MIDI_STATUS_EOX:
-		sys_msg(cableno);
+	case RCV_CLEAR:
 		midi_reset(cableno);
 		break;
 	default:
-		// Channel Messages
-		switch (sb & MIDI_STATUS_MASK) {
-		case MIDI_STATUS_NOTEOFF:
-		case MIDI_STATUS_NOTEON:
-		case MIDI_STATUS_POLYPRESS:
-		case MIDI_STATUS_CONTROL:
-		case MIDI_STATUS_BENDER:
-			status_3_byte(cableno, sb >> 4, sb);
-			break;
-		case MIDI_STATUS_PROGRAM:
-		case MIDI_STATUS_CHANPRESS:
-			status_2_byte(cableno, sb >> 4, sb);
-			break;
-		default:
-			break;
-		}
+		break;
 	}
 }
 
@@ -297,9 +606,10 @@ static uint32_t rcv_sense(void)
 }
 
 // Receive a single byte from the nominated cable
-void midi_receive(const uint32_t cableno, uint32_t val)
+void midi_receive(const uint32_t cableno, uint32_t val, uint32_t stamp)
 {
 	rcv[cableno].time = Uptime;
+	rcv[cableno].stamp = stamp;
 	if (val & MIDI_STATUS_FLAG) {
 		rcv_status(cableno, val);
 	} else if (rcv[cableno].status == MIDI_STATUS_SYSTEM) {
@@ -309,6 +619,58 @@ void midi_receive(const uint32_t cableno, uint32_t val)
 	}
 }
 
+// MIDI bytes carried by an event packet, indexed by code index
+static const uint8_t cin_len[16] = {
+	0U, 0U, 2U, 3U, 3U, 1U, 2U, 3U, 3U, 3U, 3U, 3U, 2U, 2U, 3U, 1U
+};
+
+/* Receive an event packet from the nominated cable
+ *
+ * A channel voice packet carries a whole message, so it is checked
+ * and queued as it stands rather than split into the byte parser.
+ * Other packets are unpacked into midi_receive().
+ */
+void midi_receive_packet(const uint32_t cableno, uint32_t pkt, uint32_t stamp)
+{
+	union midi_event_pkt e = {.val = pkt };
+	uint32_t cin = e.raw.header & MIDI_CIN_MASK;
+	uint32_t len = cin_len[cin];
+	if (cin >= MIDI_CIN_NOTE_OFF && cin < MIDI_CIN_BYTE) {
+		if ((uint32_t) (e.raw.midi0 >> 4) != cin
+		    || ((e.raw.midi1 | e.raw.midi2) & MIDI_STATUS_FLAG)) {
+			return;
+		}
+		rcv[cableno].time = Uptime;
+		rcv[cableno].stamp = stamp;
+		rcv[cableno].sense = 1U;
+		if (rcv[cableno].status == MIDI_STATUS_SYSTEM) {
+			// Ends a sysex, as its status byte would
+			midi_reset(cableno);
+		}
+		if (cin == MIDI_CIN_NOTE_ON && e.raw.midi2 == 0U) {
+			cin = MIDI_CIN_NOTE_OFF;
+			e.raw.midi0 = (uint8_t) (e.raw.midi0 & ~0x10U);
+		}
+		if (len == 2U) {
+			e.raw.midi2 = 0U;
+		}
+		if (midi_accept(cableno, cin)) {
+			e.raw.header = (uint8_t) (cableno << 4 | cin);
+			midi_event_append(e.val, stamp);
+		}
+		return;
+	}
+	if (len > 0U) {
+		midi_receive(cableno, e.raw.midi0, stamp);
+	}
+	if (len > 1U) {
+		midi_receive(cableno, e.raw.midi1, stamp);
+	}
+	if (len > 2U) {
+		midi_receive(cableno, e.raw.midi2, stamp);
+	}
+}
+
 // Mark sysex buffer event as read
 void midi_sysex_done(struct midi_event *event)
 {
@@ -316,24 +678,66 @@ void midi_sysex_done(struct midi_event *event)
 	rcv[cableno].sysid = 0;
 }
 
-/* Filter event according to config cable filter
+/* Send a config message to the USB host
  *
- * Events not matching cable's filter will be converted
- * to MIDI_CIN_RESERVED_0
- *
- * Sysex packets are always received
+ * The data is framed as sysex behind the system ID and followed by
+ * its CRC-7/MMC, then split into event packets on cable 0.
  */
-static void filter_event(struct midi_event *event)
+uint32_t midi_sysex_send(const uint8_t *data, uint32_t len)
 {
-	uint32_t cableno = (event->evt.raw.header & MIDI_CABLE_MASK) >> 4;
-	uint32_t mask = 1U << (event->evt.raw.header & MIDI_CIN_MASK);
-	if (cableno == MIDI_CABLE_UART) {
-		mask &= config.fmidi | (1U << MIDI_CIN_EOX_3);
-	} else {
-		mask &= config.fusb | (1U << MIDI_CIN_EOX_3);
+	uint8_t msg[MIDI_MAX_SYSEX];
+	uint32_t pkt[MIDI_MAX_SYSEX / 3U + 1U];
+	uint32_t crc = 0;
+	uint32_t n = 0;
+	uint32_t i = 0;
+	if (len + 7U > MIDI_MAX_SYSEX) {
+		return 0;
+	}
+	msg[0] = MIDI_STATUS_SYSTEM;
+	msg[1] = SYSEX_ID & 0xffU;
+	msg[2] = (SYSEX_ID >> 8) & 0xffU;
+	msg[3] = (SYSEX_ID >> 16) & 0xffU;
+	msg[4] = (SYSEX_ID >> 24) & 0xffU;
+	while (i < len) {
+		msg[5U + i] = data[i];
+		++i;
+	}
+	len += 5U;
+	i = 1U;
+	do {
+		crc = crc7_byte(crc, msg[i]);
+		++i;
+	} while (i < len);
+	msg[len++] = (uint8_t) crc;
+	msg[len++] = MIDI_STATUS_EOX;
+	i = 0;
+	do {
+		union midi_event_pkt e = {.val = 0 };
+		uint32_t left = len - i;
+		e.raw.header = left > 3U ? MIDI_CIN_SYSEX
+		    : (uint8_t) (MIDI_CIN_SYS_1 + left - 1U);
+		e.raw.midi0 = msg[i];
+		e.raw.midi1 = left > 1U ? msg[i + 1U] : 0;
+		e.raw.midi2 = left > 2U ? msg[i + 2U] : 0;
+		pkt[n++] = e.val;
+		i += 3U;
+	} while (i < len);
+	return midi_usb_send(pkt, n);
+}
+
+void midi_transport(const uint32_t cableno, uint32_t val, uint32_t at)
+{
+	switch (val) {
+	case MIDI_RT_CLOCK:
+	case MIDI_RT_START:
+	case MIDI_RT_CONTINUE:
+	case MIDI_RT_STOP:
+		if (midi_accept(cableno, MIDI_CIN_BYTE))
+			system_transport(val, at);
+		break;
+	default:
+		break;
 	}
-	if (!mask)
-		event->evt.raw.header = MIDI_CABLE_MASK | MIDI_CIN_RESERVED_0;
 }
 
 /* Extract next event from buffer
@@ -343,23 +747,51 @@ static void filter_event(struct midi_event *event)
  */
 struct midi_event *midi_event_poll(void)
 {
-	struct midi_event *event = NULL;
-	if (event_buf.ri != event_buf.wi) {
-		uint32_t look = (event_buf.ri + 1) & RCVBUFMASK;
-		event = &event_buf.rcv[look];
-		filter_event(event);
-	} else {
-		if (rcv_sense()) {
-			display_midi_off();
+	struct midi_event *event;
+	struct midi_event_lane *q = &lane[MIDI_LANE_VOICE];
+	uint32_t i = 0;
+	if (q->mask != voicemask && q->head == q->tail) {
+		q->mask = voicemask;
+	}
+	// Parse received input in arrival order while every lane has room
+	while (lane_room()) {
+		uint32_t us = 0;
+		uint32_t ss = 0;
+		uint32_t uart = midi_uart_pending(&us);
+		uint32_t usb = midi_usb_pending(&ss);
+		if (uart && (!usb || (int32_t) (us - ss) <= 0)) {
+			midi_uart_poll();
+		} else if (usb) {
+			midi_usb_poll();
+		} else {
+			break;
+		}
+	}
+	do {
+		q = &lane[i];
+		if (q->tail != q->head) {
+			polled = i;
+			event = &q->rcv[q->tail & q->mask];
+			return event;
 		}
+		++i;
+	} while (i < MIDI_LANES);
+	return MIDI_EVENT_NULL;
+}
+
+void midi_event_config(uint32_t bits, uint32_t merge)
+{
+	if (bits == 0 || bits > RCVBUFBITS) {
+		bits = RCVBUFBITS;
 	}
-	return event;
+	voicemask = (1U << bits) - 1U;
+	coalesce = merge;
 }
 
 // Flag the last received event as done
 void midi_event_done(void)
 {
-	event_buf.ri = (event_buf.ri + 1) & RCVBUFMASK;
+	lane[polled].tail++;
 }
 
 // Return pointer to sysex packet buffer if event valid
@@ -378,12 +810,30 @@ static void crc_init(void)
 	CRC->INIT = CRC7_INIT;
 }
 
+// Sense deadline - check for receive timeouts
+static struct deadline sense;
+
+static void midi_sense(struct deadline *d, uint32_t now)
+{
+	if (rcv_sense()) {
+		display_midi_off();
+	}
+	deadline_set(d, now + MIDI_SENSE_POLL);
+}
+
 /* Setup USB and MIDI devices */
 void midi_event_init(void)
 {
-	event_buf.ri = 0U;
-	event_buf.wi = 0U;
+	uint32_t i = 0;
+	do {
+		lane[i].head = 0U;
+		lane[i].tail = 0U;
+		++i;
+	} while (i < MIDI_LANES);
+	midi_event_map();
 	crc_init();
+	deadline_init(&sense, midi_sense);
+	deadline_set(&sense, Uptime + MIDI_SENSE_POLL);
 	midi_uart_init();
 	midi_usb_init();
 }
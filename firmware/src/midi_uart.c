@@ -6,34 +6,200 @@
  * Receive bytes from UART interface and pass
  * on to midi event interface.
  *
+ * The receive interrupt only stamps each byte and stores it in a
+ * ring. Bytes are parsed in batches by midi_uart_poll() from
+ * system_update(). The interrupt follows message lengths so that
+ * PendSV is raised once per complete message, while system exclusive
+ * data waits for the end of the message, an idle line or a half full
+ * ring. Transport bytes are also passed on as they arrive, so that
+ * clock recovery does not wait behind queued messages.
  */
 #include "stm32f3xx.h"
+#include "midi.h"
 #include "midi_event.h"
 #include "midi_uart.h"
 
-#define MIDI_BAUD              31250U
+#define MIDI_UART_OVERRUN	25U
+#define MIDI_UART_RESET		0x100U	// marks a framing or overrun error
+
+#ifndef MIDI_UART_RXLEN
+#define MIDI_UART_RXLEN		64U	// power of 2
+#endif
+
+// Received byte and its core cycle stamp
+struct midi_uart_byte {
+	uint32_t val;
+	uint32_t stamp;
+};
+
+// Single producer ring, filled by the receive interrupt
+static struct midi_uart_rx {
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t lost;	// bytes dropped on a full ring
+	uint32_t seen;		// dropped bytes handled by parser
+	uint32_t sysex;		// receiving system exclusive data
+	uint32_t wanted;	// message passes the cable filter
+	uint32_t need;		// data bytes per message, 0 if none
+	uint32_t count;		// data bytes of message received
+	struct midi_uart_byte byte[MIDI_UART_RXLEN];
+} rx;
+
+// Return number of data bytes following a non real time status byte
+static uint32_t midi_uart_need(uint32_t sb)
+{
+	if (sb < MIDI_STATUS_SYSTEM) {
+		return (sb & 0xe0U) == 0xc0U ? 1U : 2U;
+	}
+	switch (sb) {
+	case 0xf1U:		// time code quarter frame
+	case 0xf3U:		// song select
+		return 1U;
+	case 0xf2U:		// song position
+		return 2U;
+	default:
+		return 0;
+	}
+}
+
+// Return non-zero if messages with status sb pass the cable filter
+static uint32_t midi_uart_wanted(uint32_t sb)
+{
+	uint32_t cin = sb >> 4;
+	if (sb >= MIDI_STATUS_SYSTEM) {
+		return 1U;
+	}
+	// Note on with zero velocity is received as note off
+	if (cin == MIDI_CIN_NOTE_ON
+	    && midi_accept(MIDI_CABLE_UART, MIDI_CIN_NOTE_OFF)) {
+		return 1U;
+	}
+	return midi_accept(MIDI_CABLE_UART, cin);
+}
+
+/* Return non-zero if val completes a message
+ *
+ * Messages rejected by the cable filter do not wake PendSV, and are
+ * parsed along with later bytes.
+ */
+static uint32_t midi_uart_track(uint32_t val)
+{
+	if (val & MIDI_STATUS_FLAG) {
+		if (val >= MIDI_RT_CLOCK) {
+			return 1U;
+		}
+		rx.sysex = val == MIDI_STATUS_SYSTEM;
+		rx.need = rx.sysex ? 0 : midi_uart_need(val);
+		rx.wanted = midi_uart_wanted(val);
+		rx.count = 0;
+		return !rx.sysex && !rx.need;
+	}
+	if (rx.need && ++rx.count == rx.need) {
+		// Running status continues for channel messages
+		rx.count = 0;
+		return rx.wanted;
+	}
+	return 0;
+}
+
+// Store a byte, return non-zero if the ring is now half full
+static uint32_t midi_uart_store(uint32_t val, uint32_t stamp)
+{
+	uint32_t head = rx.head;
+	if (head - rx.tail == MIDI_UART_RXLEN) {
+		BREAKPOINT(MIDI_UART_OVERRUN);
+		rx.lost++;
+		return 1U;
+	}
+	rx.byte[head & (MIDI_UART_RXLEN - 1U)].val = val;
+	rx.byte[head & (MIDI_UART_RXLEN - 1U)].stamp = stamp;
+	barrier();
+	rx.head = head + 1U;
+	return head + 1U - rx.tail >= (MIDI_UART_RXLEN >> 1);
+}
 
 // Receive byte from serial port
 void midi_uart_receive(void)
 {
-	uint32_t tmp = UART5->RDR;
-	if (UART5->ISR & (USART_ISR_FE | USART_ISR_NE)) {
-		// Assume byte was status
-		midi_reset(MIDI_CABLE_UART);
-		UART5->ICR |= (USART_ICR_FECF | USART_ICR_NCF);
-	} else {
-		midi_receive(MIDI_CABLE_UART, tmp);
+	uint32_t stamp = uptime_cycles();
+	uint32_t isr = UART5->ISR;
+	uint32_t wake = 0;
+	if (isr & USART_ISR_IDLE) {
+		// Parse whatever is left once the line falls idle
+		UART5->ICR = USART_ICR_IDLECF;
+		wake = rx.head != rx.tail;
+	}
+	if (isr & USART_ISR_RXNE) {
+		uint32_t val = UART5->RDR;
+		if (isr & (USART_ISR_FE | USART_ISR_NE)) {
+			// Assume byte was status
+			val = MIDI_UART_RESET;
+			UART5->ICR = USART_ICR_FECF | USART_ICR_NCF;
+			rx.need = 0;
+			wake = 1U;
+		} else {
+			if (val >= MIDI_RT_CLOCK) {
+				// Lock to the start bit
+				midi_transport(MIDI_CABLE_UART, val,
+					       stamp - MIDI_BYTETIME);
+			}
+			wake |= midi_uart_track(val);
+		}
+		wake |= midi_uart_store(val, stamp);
 	}
-	if (UART5->ISR & USART_ISR_ORE) {
+	if (isr & USART_ISR_ORE) {
 		// Assume lost byte would have been status
+		UART5->ICR = USART_ICR_ORECF;
+		midi_uart_store(MIDI_UART_RESET, stamp);
+		wake = 1U;
+	}
+	if (wake) {
+		UART5->CR1 &= ~(USART_CR1_IDLEIE);
+		PENDSV();
+	} else if (!(UART5->CR1 & USART_CR1_IDLEIE)) {
+		// Watch for idle while bytes wait in the ring
+		UART5->ICR = USART_ICR_IDLECF;
+		UART5->CR1 |= USART_CR1_IDLEIE;
+	}
+}
+
+uint32_t midi_uart_pending(uint32_t *stamp)
+{
+	uint32_t tail = rx.tail;
+	if (tail == rx.head) {
+		return 0;
+	}
+	*stamp = rx.byte[tail & (MIDI_UART_RXLEN - 1U)].stamp;
+	return 1U;
+}
+
+uint32_t midi_uart_poll(void)
+{
+	struct midi_uart_byte *b;
+	uint32_t tail = rx.tail;
+	if (rx.lost != rx.seen) {
+		rx.seen = rx.lost;
 		midi_reset(MIDI_CABLE_UART);
-		UART5->ICR |= USART_ICR_ORECF;
 	}
+	if (tail == rx.head) {
+		return 0;
+	}
+	b = &rx.byte[tail & (MIDI_UART_RXLEN - 1U)];
+	if (b->val == MIDI_UART_RESET) {
+		midi_reset(MIDI_CABLE_UART);
+	} else {
+		midi_receive(MIDI_CABLE_UART, b->val, b->stamp);
+	}
+	barrier();
+	rx.tail = tail + 1U;
+	return 1U;
 }
 
 // Initialise hardware and enable receive interrupt
 void midi_uart_init(void)
 {
+	rx.head = 0;
+	rx.tail = 0;
 	UART5->CR1 |= USART_CR1_RXNEIE;
 	UART5->BRR = (SYSTEMCORECLOCK / MIDI_BAUD);
 	UART5->CR1 |= USART_CR1_UE | USART_CR1_RE;
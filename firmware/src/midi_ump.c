@@ -0,0 +1,259 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Universal MIDI Packet Parser
+ *
+ * Received words are read twice. The receive interrupt scans them in
+ * arrival order with midi_ump_scan() to stamp each message and pass
+ * transport messages to the clock, then midi_ump_receive() gathers
+ * whole packets from system_update() and hands their MIDI 1.0 bytes
+ * to the event queue with the stamps found by the scan.
+ *
+ * A JR clock gives the sender's time as it sends, and a JR timestamp
+ * the sender's time of the message that follows it. The sender clock
+ * is mapped to core cycles at the earliest arrival seen, rising
+ * slowly to follow a drifting sender, so a timestamped message is
+ * stamped at its send time plus the least delay through the link.
+ * Messages without one, or before a JR clock, keep their arrival
+ * stamp.
+ */
+#include "stm32f3xx.h"
+#include "midi.h"
+#include "midi_event.h"
+#include "midi_ump.h"
+
+#define MIDI_UMP_JRTICK		(SYSTEMCORECLOCK / MIDI_UMP_JRRATE)	// cycles
+#define MIDI_UMP_JRHOLD		(4U * SYSTEMCORECLOCK)	// sender clock kept
+#ifndef MIDI_UMP_JRSHIFT
+#define MIDI_UMP_JRSHIFT	4U	// rise of mapping 2^-n per JR clock
+#endif
+
+// Words in a packet by message type
+static const uint8_t ump_words[16] = {
+	1U, 1U, 1U, 2U, 2U, 4U, 1U, 1U, 2U, 2U, 2U, 3U, 3U, 4U, 4U, 4U
+};
+
+// Sender clock and scan state, from the receive interrupt
+static struct midi_ump_jr {
+	uint32_t valid;		// mapping seeded by a JR clock
+	uint32_t tick;		// sender time of the mapping, 16 bits
+	uint32_t local;		// core cycle of tick
+	uint32_t stamp;		// JR timestamp for the next message
+	uint32_t stamped;	// stamp is waiting
+	uint32_t skip;		// words left of the packet scanned
+	uint32_t last;		// stamp of the packet scanned
+} jr;
+
+// Packet gathered for the event queue
+static struct midi_ump_rx {
+	uint32_t word[MIDI_UMP_MAXWORDS];
+	uint32_t n;
+} rx;
+
+// Return non-zero if the sender clock mapping holds at core cycle at
+static uint32_t ump_mapped(uint32_t at)
+{
+	int32_t age = (int32_t) (at - jr.local);
+	return jr.valid && age < (int32_t) MIDI_UMP_JRHOLD
+	    && age > -(int32_t) MIDI_UMP_JRHOLD;
+}
+
+/* Return the core cycle of 16 bit sender time t, sent near core cycle at
+ *
+ * The mapping is first carried forward to at, so that the 16 bit
+ * sender time is only compared across the short delay of the link.
+ */
+static uint32_t ump_local(uint32_t t, uint32_t at)
+{
+	int32_t n = (int32_t) (at - jr.local) / (int32_t) MIDI_UMP_JRTICK;
+	int32_t dt = (int16_t) (t - jr.tick - (uint32_t) n);
+	return jr.local + (uint32_t) ((n + dt) * (int32_t) MIDI_UMP_JRTICK);
+}
+
+// Map sender time t onto the JR clock received at core cycle at
+static void ump_jrclock(uint32_t t, uint32_t at)
+{
+	if (ump_mapped(at)) {
+		uint32_t pred = ump_local(t, at);
+		int32_t late = (int32_t) (at - pred);
+		jr.tick = t;
+		if (late < 0) {
+			jr.local = at;
+		} else {
+			jr.local = pred + (uint32_t) (late >> MIDI_UMP_JRSHIFT);
+		}
+		return;
+	}
+	jr.valid = 1U;
+	jr.tick = t;
+	jr.local = at;
+}
+
+uint32_t midi_ump_scan(const uint32_t cableno, uint32_t w, uint32_t at)
+{
+	uint32_t mt = w >> 28;
+	uint32_t status = (w >> 16) & 0xffU;
+	if (jr.skip) {
+		jr.skip--;
+		return jr.last;
+	}
+	jr.skip = ump_words[mt] - 1U;
+	if (mt == MIDI_UMP_UTILITY) {
+		uint32_t op = (w >> 20) & 0xfU;
+		if (op == MIDI_UMP_JRCLOCK) {
+			ump_jrclock(w & 0xffffU, at);
+		} else if (op == MIDI_UMP_JRSTAMP) {
+			jr.stamp = w & 0xffffU;
+			jr.stamped = 1U;
+		}
+		jr.last = at;
+		return at;
+	}
+	if (jr.stamped && ump_mapped(at)) {
+		uint32_t t = ump_local(jr.stamp, at);
+		// Not later than it arrived
+		if ((int32_t) (t - at) < 0) {
+			at = t;
+		}
+	}
+	jr.stamped = 0;
+	jr.last = at;
+	if (mt == MIDI_UMP_SYSTEM && status >= MIDI_RT_CLOCK) {
+		midi_transport(cableno, status, at);
+	}
+	return at;
+}
+
+// Return the code index of a system message, zero if not MIDI 1.0
+static uint32_t ump_cin(uint32_t status)
+{
+	switch (status) {
+	case MIDI_STATUS_MTCQF:
+	case MIDI_STATUS_SONGSEL:
+		return MIDI_CIN_COMMON_2;
+	case MIDI_STATUS_SPP:
+		return MIDI_CIN_COMMON_3;
+	case MIDI_STATUS_UNDEF4:
+	case MIDI_STATUS_UNDEF5:
+	case MIDI_STATUS_TUNEREQ:
+		return MIDI_CIN_SYS_1;
+	default:
+		return status >= MIDI_RT_CLOCK ? MIDI_CIN_BYTE : 0;
+	}
+}
+
+// Pass the bytes of a 7 bit system exclusive packet to the parser
+static void ump_sysex(const uint32_t cableno, uint32_t stamp)
+{
+	uint32_t st = (rx.word[0] >> 20) & 0xfU;
+	uint32_t n = (rx.word[0] >> 16) & 0xfU;
+	uint32_t i = 0;
+	if (st > MIDI_UMP_SYSEX_END || n > MIDI_UMP_SYSEX_MAX) {
+		return;
+	}
+	if (st == MIDI_UMP_SYSEX_ONLY || st == MIDI_UMP_SYSEX_START) {
+		midi_receive(cableno, MIDI_STATUS_SYSTEM, stamp);
+	}
+	while (i < n) {
+		uint32_t b = i < 2U ? rx.word[0] >> (8U - 8U * i)
+		    : rx.word[1] >> (40U - 8U * i);
+		midi_receive(cableno, b & MIDI_DATA_MASK, stamp);
+		++i;
+	}
+	if (st == MIDI_UMP_SYSEX_ONLY || st == MIDI_UMP_SYSEX_END) {
+		midi_receive(cableno, MIDI_STATUS_EOX, stamp);
+	}
+}
+
+void midi_ump_receive(const uint32_t cableno, uint32_t w, uint32_t stamp)
+{
+	uint32_t mt;
+	uint32_t status;
+	uint32_t cin;
+	rx.word[rx.n++] = w;
+	mt = rx.word[0] >> 28;
+	if (rx.n < ump_words[mt]) {
+		return;
+	}
+	rx.n = 0;
+	status = (rx.word[0] >> 16) & 0xffU;
+	if (mt == MIDI_UMP_DATA64) {
+		ump_sysex(cableno, stamp);
+		return;
+	}
+	if (mt == MIDI_UMP_VOICE1 && (status & MIDI_STATUS_FLAG)
+	    && status < MIDI_STATUS_SYSTEM) {
+		cin = status >> 4;
+	} else if (mt == MIDI_UMP_SYSTEM) {
+		cin = ump_cin(status);
+	} else {
+		return;
+	}
+	if (cin) {
+		union midi_event_pkt e;
+		e.raw.header = (uint8_t) (cableno << 4 | cin);
+		e.raw.midi0 = (uint8_t) status;
+		e.raw.midi1 = (uint8_t) (rx.word[0] >> 8);
+		e.raw.midi2 = (uint8_t) rx.word[0];
+		midi_receive_packet(cableno, e.val, stamp);
+	}
+}
+
+/* A system exclusive packet becomes one data packet of up to three
+ * bytes, marked as starting or ending the message by its F0 and F7,
+ * which are left out.
+ */
+uint32_t midi_ump_packet(uint32_t pkt, uint32_t *ump)
+{
+	union midi_event_pkt e = {.val = pkt };
+	uint32_t cin = e.raw.header & MIDI_CIN_MASK;
+	uint32_t msg = (uint32_t) e.raw.midi0 << 16
+	    | (uint32_t) e.raw.midi1 << 8 | e.raw.midi2;
+	const uint8_t src[3] = { e.raw.midi0, e.raw.midi1, e.raw.midi2 };
+	uint8_t b[3] = { 0, 0, 0 };
+	uint32_t len;
+	uint32_t st;
+	uint32_t n = 0;
+	uint32_t i = 0;
+	if (cin >= MIDI_CIN_NOTE_OFF && cin < MIDI_CIN_BYTE) {
+		ump[0] = (uint32_t) MIDI_UMP_VOICE1 << 28 | msg;
+		return 1U;
+	}
+	if (cin == MIDI_CIN_COMMON_2 || cin == MIDI_CIN_COMMON_3
+	    || cin == MIDI_CIN_BYTE
+	    || (cin == MIDI_CIN_SYS_1 && e.raw.midi0 != MIDI_STATUS_EOX)) {
+		if (ump_cin(e.raw.midi0) == 0) {
+			return 0;
+		}
+		ump[0] = (uint32_t) MIDI_UMP_SYSTEM << 28 | msg;
+		return 1U;
+	}
+	if (cin < MIDI_CIN_SYSEX || cin > MIDI_CIN_EOX_3) {
+		return 0;
+	}
+	len = cin == MIDI_CIN_SYSEX ? 3U : cin - MIDI_CIN_SYS_1 + 1U;
+	st = e.raw.midi0 == MIDI_STATUS_SYSTEM ? MIDI_UMP_SYSEX_START
+	    : MIDI_UMP_SYSEX_CONT;
+	if (cin != MIDI_CIN_SYSEX) {
+		st = st == MIDI_UMP_SYSEX_START ? MIDI_UMP_SYSEX_ONLY
+		    : MIDI_UMP_SYSEX_END;
+	}
+	do {
+		if (!(src[i] & MIDI_STATUS_FLAG)) {
+			b[n++] = src[i];
+		}
+		++i;
+	} while (i < len);
+	ump[0] = (uint32_t) MIDI_UMP_DATA64 << 28 | st << 20 | n << 16
+	    | (uint32_t) b[0] << 8 | b[1];
+	ump[1] = (uint32_t) b[2] << 24;
+	return 2U;
+}
+
+void midi_ump_reset(void)
+{
+	jr.valid = 0;
+	jr.stamped = 0;
+	jr.skip = 0;
+	rx.n = 0;
+}
@@ -2,24 +2,277 @@
 
 /*
  * USB-MIDI Class Device Interface
+ *
+ * Event packets received from the host stay in the bulk OUT endpoint
+ * buffers. The receive interrupt stamps each packet and passes
+ * transport messages to the clock, then midi_usb_poll() reads one
+ * packet at a time from packet memory into the event queue from
+ * system_update(). The endpoint is double buffered: the host fills
+ * one buffer while the other is read, and is NAKed only once both
+ * are waiting, so it is held off rather than packets dropped, and
+ * the event queue is only written from PendSV.
+ *
+ * The host sends the packets queued over a frame in a burst after the
+ * next start of frame, so their interrupt times are bunched. Instead
+ * each packet is stamped from the start of frame it was sent after,
+ * spread back over the frame by its position at the measured host
+ * send rate, and a clock from USB reaches timer_clock() on the host's
+ * frame clock.
+ *
+ * In the USB-MIDI 2.0 alternate setting the buffers hold universal
+ * MIDI packets instead, parsed by midi_ump.c, and a message the host
+ * has given a JR timestamp is stamped from that in place of its frame.
+ * The alternate setting is only offered in builds with USB_UMP.
+ *
+ * Packets sent to the host are gathered in the IN buffer not being
+ * sent, which is handed over as soon as the other has gone.
  */
 #include "stm32f303xe.h"
 #include "flash.h"
 #include "settings.h"
 #include "usb.h"
+#include "midi.h"
+#include "midi_event.h"
+#include "midi_ump.h"
 #include "midi_usb.h"
 
+#define MIDI_USB_WORDS		(USB_ENDPOINT_SIZE / 4U)	// per buffer
+#define MIDI_USB_UMP(dir)	(IS_ENABLED(USB_UMP) && (dir).ump)
+
+// Bulk OUT transfers held in the endpoint buffers
+static struct midi_usb_rx {
+	volatile uint32_t full[2];	// buffer waiting to be read
+	uint32_t len[2];	// bytes of whole packets received
+	uint32_t at[2][MIDI_USB_WORDS];	// core cycle stamp of each packet
+	uint32_t buf;		// buffer owned by midi_usb_poll()
+	uint32_t pos;		// bytes taken from it
+	uint32_t ump;		// universal MIDI packets
+} rx;
+
+// Host send rate over frames with data
+static struct midi_usb_rate {
+	uint32_t sof;		// start of frame of the last transfer
+	uint32_t count;		// packets received since it
+	uint32_t space;		// smoothed cycles per packet sent
+} rate;
+
+// Bulk IN packets gathered for the host
+static struct midi_usb_tx {
+	uint32_t buf;		// buffer being filled
+	uint32_t len;		// bytes in it
+	uint32_t ump;		// universal MIDI packets
+} tx;
+
+/* Stamp the n packets of buffer b from the start of frame
+ *
+ * Packets are placed at the measured spacing from one frame before
+ * the start of frame, following any already received in the frame,
+ * and those beyond the rate are held at the start of frame, as is a
+ * lone clock. Universal MIDI packets are all stamped at the start of
+ * frame, which the host's JR clock is mapped against. Until frames
+ * are seen the interrupt time at is used.
+ */
+static void midi_usb_frame(uint32_t b, uint32_t n, uint32_t at)
+{
+	uint32_t sof;
+	uint32_t per = usb_frame(&sof);
+	uint32_t space = 0;
+	uint32_t last = at;
+	uint32_t i = 0;
+	if (per && MIDI_USB_UMP(rx)) {
+		// JR timestamps place messages within the frame
+		at = sof;
+		last = sof;
+	} else if (per) {
+		if (rate.space == 0 || rate.space > per) {
+			rate.space = per;
+		}
+		if (sof != rate.sof) {
+			if (rate.count) {
+				int32_t d = (int32_t) (per / rate.count
+						       - rate.space);
+				rate.space += (uint32_t) (d / 4);
+			}
+			rate.sof = sof;
+			rate.count = 0;
+		}
+		space = rate.space;
+		last = sof;
+		at = sof - per + rate.count * space;
+		rate.count += n;
+	}
+	while (i < n) {
+		at += space;
+		rx.at[b][i] = (int32_t) (at - last) > 0 ? last : at;
+		++i;
+	}
+}
+
+void midi_usb_receive(void)
+{
+	uint32_t at = uptime_cycles();
+	uint32_t b = usb_db_filled(USB_EPR_MIDIOUT);
+	uint32_t len = usb_db_count(USB_EPR_MIDIOUT, b) & ~3U;
+	uint32_t pos = 0;
+	midi_usb_frame(b, len >> 2, at);
+	while (pos < len) {
+		uint32_t w = usb_pma_word(USB_PMA_BUF(USB_PMA_MIDIRX, b) + pos);
+		union midi_event_pkt e = {.val = w };
+		if (MIDI_USB_UMP(rx)) {
+			rx.at[b][pos >> 2] = midi_ump_scan(MIDI_CABLE_USB, w,
+							   rx.at[b][pos >> 2]);
+		} else if ((e.raw.header & MIDI_CIN_MASK) == MIDI_CIN_BYTE) {
+			midi_transport(MIDI_CABLE_USB, e.raw.midi0,
+				       rx.at[b][pos >> 2]);
+		}
+		pos += 4U;
+	}
+	rx.len[b] = len;
+	barrier();
+	rx.full[b] = 1U;
+	PENDSV();
+}
+
+// Hand over the gathered IN buffer if the other has been sent
+static void midi_usb_flush(void)
+{
+	if (tx.len && usb_db_idle(USB_EPR_MIDIIN)) {
+		usb_db_send(USB_EPR_MIDIIN, tx.buf, tx.len);
+		tx.buf ^= 1U;
+		tx.len = 0;
+	}
+}
+
+void midi_usb_sent(void)
+{
+	midi_usb_flush();
+}
+
+void midi_usb_open(uint32_t ep)
+{
+	if (ep & USB_EP_DIR) {
+		tx.buf = 0;
+		tx.len = 0;
+		tx.ump = usb_alternate() == USB_MS_UMP;
+	} else {
+		rx.ump = usb_alternate() == USB_MS_UMP;
+		if (IS_ENABLED(USB_UMP)) {
+			midi_ump_reset();
+		}
+		rx.full[0] = 0;
+		rx.full[1] = 0;
+		rx.len[1] = 0;
+		rx.buf = 1U;
+		rx.pos = 0;
+		rate.count = 0;
+		rate.space = 0;
+	}
+}
+
+/* Take the next full buffer once the one owned is read
+ *
+ * Taking it releases the one read to the peripheral. The interrupt
+ * is held off so that a bus reset cannot reopen the endpoint between
+ * the check and the release.
+ */
+static uint32_t midi_usb_next(void)
+{
+	uint32_t ok = 1U;
+	if (rx.pos < rx.len[rx.buf]) {
+		return 1U;
+	}
+	if (!rx.full[rx.buf ^ 1U]) {
+		return 0;
+	}
+	usb_lock();
+	while (rx.pos >= rx.len[rx.buf]) {
+		uint32_t next = rx.buf ^ 1U;
+		if (!rx.full[next]) {
+			ok = 0;
+			break;
+		}
+		rx.full[rx.buf] = 0;
+		rx.len[rx.buf] = 0;
+		rx.buf = next;
+		rx.pos = 0;
+		usb_db_release(USB_EPR_MIDIOUT);
+	}
+	usb_unlock();
+	return ok;
+}
+
+uint32_t midi_usb_pending(uint32_t *stamp)
+{
+	if (!midi_usb_next()) {
+		return 0;
+	}
+	*stamp = rx.at[rx.buf][rx.pos >> 2];
+	return 1U;
+}
+
+uint32_t midi_usb_poll(void)
+{
+	uint32_t pkt;
+	uint32_t stamp;
+	if (!midi_usb_next()) {
+		return 0;
+	}
+	pkt = usb_pma_word(USB_PMA_BUF(USB_PMA_MIDIRX, rx.buf) + rx.pos);
+	stamp = rx.at[rx.buf][rx.pos >> 2];
+	rx.pos += 4U;
+	if (MIDI_USB_UMP(rx)) {
+		midi_ump_receive(MIDI_CABLE_USB, pkt, stamp);
+	} else {
+		midi_receive_packet(MIDI_CABLE_USB, pkt, stamp);
+	}
+	return 1U;
+}
+
+uint32_t midi_usb_send(const uint32_t *pkt, uint32_t n)
+{
+	uint32_t w[MIDI_USB_WORDS + 1U];	// a UMP may take two words
+	uint32_t len = 0;
+	uint32_t sent = 0;
+	uint32_t i = 0;
+	if (!usb_configured()) {
+		return 0;
+	}
+	// Convert all first, so that none are sent if they do not fit
+	do {
+		if (len >= MIDI_USB_WORDS) {
+			return 0;
+		}
+		if (MIDI_USB_UMP(tx)) {
+			len += midi_ump_packet(pkt[i], &w[len]);
+		} else {
+			w[len++] = pkt[i];
+		}
+		++i;
+	} while (i < n);
+	usb_lock();
+	if (tx.len + len * sizeof(w[0]) <= USB_ENDPOINT_SIZE) {
+		i = 0;
+		while (i < len) {
+			usb_pma_put(USB_PMA_BUF(USB_PMA_MIDITX, tx.buf) + tx.len,
+				    w[i]);
+			tx.len += sizeof(w[0]);
+			++i;
+		}
+		sent = 1U;
+	}
+	midi_usb_flush();
+	usb_unlock();
+	return sent;
+}
+
 // Initialise hardware and enable interrupts
 void midi_usb_init(void)
 {
+	midi_usb_open(USB_EP_OUT);
+	midi_usb_open(USB_EP_IN);
 	// Check for a sane-ish USB config
 	if (OPTION->usb.device.bLength == USB_DEVLEN
 	    && OPTION->usb.device.bDescriptorType == USB_DEVICE) {
-		// Force USB re-enumeration
-		GPIOA->BSRR = GPIO_BSRR_BR_12;
-		uint32_t nm = GPIOA->MODER & ~GPIO_MODER_MODER12_Msk;
-		GPIOA->MODER = nm | (0x1 << GPIO_MODER_MODER12_Pos);
-		delay_ms(6);
-		GPIOA->MODER = nm | (0x3 << GPIO_MODER_MODER12_Pos);
+		usb_init();
 	}
 }
@@ -155,7 +155,7 @@ struct option_struct rom = {
 		.configuration = {
 				  .cfg_bLength = 9U,
 				  .cfg_bDescriptorType = USB_CONFIGURATION,
-				  .cfg_wTotalLength = USB_CFGLEN,
+				  .cfg_wTotalLength = USB_CFGTOTAL,
 				  .cfg_bNumInterfaces = 2U,
 				  .cfg_bConfigurationValue = 1U,
 				  .cfg_bmAttributes =
@@ -262,8 +262,67 @@ struct option_struct rom = {
 				  .msin_bNumEmbMIDIJack = 2U,
 				  .msin_baAssocJackID1 = 2U,
 				  .msin_baAssocJackID2 = 3U,
+
+				  .ump_bLength = 9U,
+				  .ump_bDescriptorType = USB_INTERFACE,
+				  .ump_bInterfaceNumber = USB_MS_INTERFACE,
+				  .ump_bAlternateSetting = USB_MS_UMP,
+				  .ump_bNumEndpoints = 2U,
+				  .ump_bInterfaceClass = USB_AUDIO,
+				  .ump_bInterfaceSubclass = USB_MIDISTREAMING,
+				  .ump_iInterface = USB_DESCR_IF,
+
+				  .cump_bLength = 7U,
+				  .cump_bDescriptorType = USB_CS_INTERFACE,
+				  .cump_bDescriptorSubtype = USB_HEADER,
+				  .cump_BcdMSC = 0x0200,
+				  .cump_wTotalLength = 7U,	// Header only
+
+				  .umpout_bLength = 7U,
+				  .umpout_bDescriptorType = USB_ENDPOINT,
+				  .umpout_bEndpointAddress = USB_EP_OUT,
+				  .umpout_bmAttributes = USB_ENDPOINT_BULK,
+				  .umpout_wMaxPacketSize = USB_ENDPOINT_SIZE,
+
+				  .gtout_bLength = 5U,
+				  .gtout_bDescriptorType = USB_CS_ENDPOINT,
+				  .gtout_bDescriptorSubType = USB_MS_GENERAL_2_0,
+				  .gtout_bNumGrpTrmBlock = 1U,
+				  .gtout_baAssoGrpTrmBlkID1 = 1U,
+
+				  .umpin_bLength = 7U,
+				  .umpin_bDescriptorType = USB_ENDPOINT,
+				  .umpin_bEndpointAddress = USB_EP_IN,
+				  .umpin_bmAttributes = USB_ENDPOINT_BULK,
+				  .umpin_wMaxPacketSize = USB_ENDPOINT_SIZE,
+
+				  .gtin_bLength = 5U,
+				  .gtin_bDescriptorType = USB_CS_ENDPOINT,
+				  .gtin_bDescriptorSubType = USB_MS_GENERAL_2_0,
+				  .gtin_bNumGrpTrmBlock = 1U,
+				  .gtin_baAssoGrpTrmBlkID1 = 1U,
 				  },
 
+		// Group Terminal Blocks of the UMP alternate setting
+		.terminal = {
+			     .hdr_bLength = 5U,
+			     .hdr_bDescriptorType = USB_CS_GR_TRM_BLOCK,
+			     .hdr_bDescriptorSubtype = USB_GR_TRM_BLOCK_HEADER,
+			     .hdr_wTotalLength = USB_GTBLEN,
+
+			     .gtb_bLength = 13U,
+			     .gtb_bDescriptorType = USB_CS_GR_TRM_BLOCK,
+			     .gtb_bDescriptorSubtype = USB_GR_TRM_BLOCK,
+			     .gtb_bGrpTrmBlkID = 1U,
+			     .gtb_bGrpTrmBlkType = USB_GTB_BIDIRECTIONAL,
+			     .gtb_nGroupTrm = 0,	// Group 1
+			     .gtb_nNumGroupTrm = 1U,
+			     .gtb_iBlockItem = USB_DESCR_SYNC,
+			     .gtb_bMIDIProtocol = USB_GTB_MIDI1_JRTS,
+			     .gtb_wMaxInputBandwidth = 0,	// Unknown
+			     .gtb_wMaxOutputBandwidth = 0,	// Unknown
+			     },
+
 		// Description Strings
 		.string = {
 			   // Language
@@ -3,14 +3,13 @@
 /*
  * System Initialisation
  *
- * Includes default, reset, systick and fault handlers.
+ * Includes default, reset and fault handlers.
  */
 #include "stm32f3xx.h"
 #include "flash.h"
 
 // Exported globals
 uint32_t SystemID;
-volatile uint32_t Uptime;
 
 // Values provided by linker
 extern uint32_t _sidata;
@@ -118,8 +117,9 @@ static void enable_peripherals(void)
 {
 	RCC->AHBENR |= RCC_AHBENR_CRCEN | RCC_AHBENR_GPIOAEN |
 	    RCC_AHBENR_GPIOBEN | RCC_AHBENR_GPIOCEN |
-	    RCC_AHBENR_GPIODEN | RCC_AHBENR_GPIOFEN;
-	RCC->APB1ENR |= RCC_APB1ENR_UART5EN | RCC_APB1ENR_TIM2EN;
+	    RCC_AHBENR_GPIODEN | RCC_AHBENR_GPIOFEN | RCC_AHBENR_DMA1EN;
+	RCC->APB1ENR |= RCC_APB1ENR_UART5EN | RCC_APB1ENR_TIM2EN |
+	    RCC_APB1ENR_TIM3EN;
 	barrier();
 }
 
@@ -147,6 +147,7 @@ void system_init(void)
 	flash_set_options();
 
 	// I/O Port configuration
+	GPIOA->AFR[1] = 0x000ee000;	// PA11, PA12 -> USB DM, DP
 	GPIOA->MODER = 0xebfffff5;	// DA, MA, SWD, SENSE
 	GPIOB->MODER = 0xffffffbf;	// SWO
 	GPIOC->MODER = 0x76ffff55;	// CK, RS, FL, G1, G2, G3
@@ -156,21 +157,8 @@ void system_init(void)
 
 	setup_mpu();
 
-	// Update interrupt priority grouping field
-	NVIC_SetPriorityGrouping(PRIGROUP_4_4);
-
-	// Set PendSV and SVCall to lowest priority
-	NVIC_SetPriority(PendSV_IRQn, PRIGROUP3 | PRISUB2);
-	NVIC_SetPriority(SVCall_IRQn, PRIGROUP3 | PRISUB2);
-	NVIC_SetPriority(SysTick_IRQn, PRIGROUP1 | PRISUB1);
-
-	// Configure the SysTick timer at 1ms, AHB/1
-	Uptime = 0;
-	SysTick->LOAD = SYSTEMTICKLEN - 1U;
-	SysTick->VAL = 0;
-	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk |
-	    SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
-	__DSB();
+	// Set handler priorities and start SysTick
+	uptime_init();
 
 	if (IS_ENABLED(LOCK_GPIO)) {
 		// Lock GPIO configurations
@@ -217,16 +205,6 @@ void delay_ms(uint32_t delay)
 	delay_uptime(delay << 3);
 }
 
-/* ARM SysTick Handler */
-void ms_timer(void)
-{
-	Uptime++;
-	// Flag PENDSV every millisecond except the zero'th
-	if (!(Uptime & 0x7)) {
-		PENDSV();
-	}
-}
-
 void undefined_handler(void)
 {
 	BREAKPOINT(BKPT_UNDEF);
@@ -11,10 +11,8 @@
 #include "timer.h"
 #include "settings.h"
 #include "display.h"
-
-// Import io pins from main [temp]
-extern const uint32_t out_pins[6U];
-extern uint32_t trig_start[6U];
+#include "trigger.h"
+#include "output.h"
 
 // Global timer status
 struct timer_state timer;
@@ -22,44 +20,310 @@ struct timer_state timer;
 // Cached period calc
 static uint32_t delinv;
 
+#ifndef TIMER_SCHEDLEN
+#define TIMER_SCHEDLEN	256U	// edge schedule entries per buffer
+#endif
+#define TIMER_SCHEDMAX	0x10000U	// longest schedule cycle in ticks
+
+// Output register update at a tick of the schedule cycle
+struct timer_event {
+	uint32_t tick;
+	uint32_t bsrr;
+};
+
+/* Compiled output edge schedule
+ *
+ * All clocked outputs are compiled into a sorted list of set/reset
+ * words covering one least common multiple of the output periods.
+ * Two buffers are held so that a new schedule may be compiled while
+ * the update handler steps through the other one. An empty schedule
+ * selects the per-output counters below.
+ */
+static struct timer_sched {
+	uint32_t len;		// number of events, 0 to use counters
+	uint32_t cycle;		// ticks per schedule cycle
+	uint32_t trig;		// pins with trigger length
+	uint32_t runmask;	// pins held off when not running
+	struct timer_event event[TIMER_SCHEDLEN];
+} sched[2];
+
+// Schedule position, owned by update handler
+static uint32_t cur;		// buffer in use
+static uint32_t pos;		// tick within schedule cycle
+static uint32_t idx;		// next event in schedule
+
+/* Per-output clock edge counters
+ *
+ * Used when the schedule would not fit in TIMER_SCHEDLEN events.
+ * Each clocked output counts down the ticks to its next set edge.
+ * The clear edge falls when the count equals the divisor, half a
+ * period after the set edge.
+ */
+static struct timer_edge {
+	uint32_t count;		// ticks until next set edge
+	uint32_t period;	// ticks per output cycle
+	uint32_t width;		// ticks from set edge to clear edge
+} edge[SETTINGS_NROUTS];
+
+// Mask of output numbers with a running edge counter
+static uint32_t clocked;
+
+/* DMA output buffer
+ *
+ * With TIMER_DMA each TIM2 update requests a transfer of the next
+ * word from a circular buffer into GPIOC->BSRR. The half not being
+ * transferred is refilled on the half and full transfer interrupts.
+ */
+#ifndef TIMER_DMAHALF
+#define TIMER_DMAHALF	4U	// ticks per buffer half, multiple of 4
+#endif
+#define TIMER_DMALEN	(TIMER_DMAHALF << 1)
+#define TIMER_DMACH	DMA1_Channel2	// TIM2_UP request
+#define TIMER_IRQn	(IS_ENABLED(TIMER_DMA) ? DMA1_Channel2_IRQn : TIM2_IRQn)
+
+// Buffer refills may wait behind trigger ends, single updates may not
+#define TIMER_PRIORITY	(IS_ENABLED(TIMER_DMA) ? PRIGROUP1 | PRISUB0 \
+			 : PRIGROUP0 | PRISUB1)
+static uint32_t dmabuf[TIMER_DMALEN];
+
+/* Clock recovery loop
+ *
+ * A second order PLL locks each fourth update to incoming MIDI clock.
+ * Phase error is measured at each clock and corrects the period over
+ * the following four updates, while its integral tracks the rate.
+ * The loop is critically damped with a proportional gain of 2^-shift
+ * per clock. A wide bandwidth is used after start and after a large
+ * error, narrowing once locked.
+ */
+#ifndef TIMER_PLLSHIFT
+#define TIMER_PLLSHIFT	4U	// locked gain, log2
+#endif
+#define TIMER_ACQSHIFT	2U	// acquire gain, log2
+#define TIMER_ACQUIRE	24U	// clocks per gain step after acquire
+
+// Core cycle of a reference clock edge, latched by the update handlers
+static volatile uint32_t edge_at;
+
+// Return greatest common divisor
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+	while (b) {
+		uint32_t r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+/* Compile clocked outputs into an edge schedule
+ *
+ * Outputs alternate between set and clear edges every divisor ticks.
+ * Edges of all outputs are merged in tick order over one schedule
+ * cycle. Outputs with a zero divisor are not clocked. The schedule is
+ * left empty if the cycle or number of events would exceed the limits.
+ */
+static void compile_sched(struct timer_sched *s)
+{
+	struct output_config *out;
+	uint32_t next[SETTINGS_NROUTS];
+	uint32_t set = 0;
+	uint32_t outs = 0;
+	uint32_t cycle = 1U;
+	uint32_t i = 0;
+	s->len = 0;
+	s->trig = 0;
+	s->runmask = 0;
+	do {
+		out = &config.output[i];
+		if ((out->flags & SETTING_CLOCK) && out->divisor) {
+			uint32_t period = out->divisor << 1;
+			if (period > TIMER_SCHEDMAX) {
+				return;
+			}
+			cycle = cycle / gcd(cycle, period) * period;
+			if (cycle > TIMER_SCHEDMAX) {
+				return;
+			}
+			next[i] = out->offset % out->divisor;
+			if (out->offset % period < out->divisor) {
+				set |= 1U << i;
+			}
+			if (out->flags & SETTING_TRIG) {
+				s->trig |= out_pins[i];
+			}
+			if (out->flags & SETTING_RUNMASK) {
+				s->runmask |= out_pins[i];
+			}
+			outs |= 1U << i;
+		}
+		++i;
+	} while (i < SETTINGS_NROUTS);
+	s->cycle = cycle;
+
+	uint32_t len = 0;
+	while (outs) {
+		// Find next edge tick
+		uint32_t tick = cycle;
+		i = 0;
+		do {
+			if ((outs & (1U << i)) && next[i] < tick) {
+				tick = next[i];
+			}
+			++i;
+		} while (i < SETTINGS_NROUTS);
+		if (tick >= cycle) {
+			break;
+		}
+		if (len == TIMER_SCHEDLEN) {
+			return;
+		}
+		// Merge edges at this tick
+		uint32_t bsrr = 0;
+		i = 0;
+		do {
+			if ((outs & (1U << i)) && next[i] == tick) {
+				if (set & (1U << i)) {
+					bsrr |= out_pins[i];
+				} else {
+					bsrr |= out_pins[i] << 16;
+				}
+				set ^= 1U << i;
+				next[i] += config.output[i].divisor;
+			}
+			++i;
+		} while (i < SETTINGS_NROUTS);
+		s->event[len].tick = tick;
+		s->event[len].bsrr = bsrr;
+		++len;
+	}
+	s->len = len;
+}
+
+// Switch to a newly compiled schedule
+static void take_sched(void)
+{
+	timer.reload = 0;
+	cur ^= 1U;
+}
+
+// Load edge counters or schedule position at the current phase
+static void load_edges(void)
+{
+	struct timer_sched *s = &sched[cur];
+	struct output_config *out;
+	struct timer_edge *e;
+	uint32_t i = 0;
+	clocked = 0;
+	if (s->len) {
+		// Find first event at or after phase
+		uint32_t lo = 0;
+		uint32_t hi = s->len;
+		pos = timer.phase % s->cycle;
+		while (lo < hi) {
+			uint32_t mid = (lo + hi) >> 1;
+			if (s->event[mid].tick < pos) {
+				lo = mid + 1U;
+			} else {
+				hi = mid;
+			}
+		}
+		idx = lo < s->len ? lo : 0;
+		return;
+	}
+	do {
+		out = &config.output[i];
+		e = &edge[i];
+		if ((out->flags & SETTING_CLOCK) && out->divisor) {
+			e->period = out->divisor << 1;
+			e->width = out->divisor;
+			e->count = (out->offset % e->period + e->period
+				    - timer.phase % e->period) % e->period;
+			clocked |= 1U << i;
+		}
+		++i;
+	} while (i < SETTINGS_NROUTS);
+}
+
+// Start trigger length on outputs set by the word being prepared
+static void stamp_trig(uint32_t mask)
+{
+	// The word is written by the update numbered as its phase
+	trigger_clocked(mask, timer.phase);
+}
+
+// Set the next output register from the compiled schedule
+static void sched_nextout(struct timer_sched *s)
+{
+	uint32_t out = 0;
+	if (s->event[idx].tick == pos) {
+		out = s->event[idx].bsrr;
+		if (++idx == s->len) {
+			idx = 0;
+		}
+		// Masked set edges take no trigger length
+		if (!timer.on) {
+			out &= ~s->runmask;
+		}
+		if (out & s->trig) {
+			stamp_trig(out & s->trig);
+		}
+	}
+	if (++pos == s->cycle) {
+		pos = 0;
+	}
+	timer.nextout = out;
+}
+
 // Set the next output register based on phase and config
 static void update_nextout(void)
 {
 	struct output_config *out;
-	uint32_t phase;
-	uint32_t period;
-	uint32_t setmark;
-	uint32_t clrmark;
+	struct timer_edge *e;
+	uint32_t trig = 0;
 	uint32_t i = 0;
+	if (sched[cur].len) {
+		sched_nextout(&sched[cur]);
+		return;
+	}
 	timer.nextout = 0;
 	do {
-		out = &config.output[i];
-		if (out->flags & SETTING_CLOCK) {
-			period = out->divisor << 1;
-			setmark = out->offset % period;
-			clrmark = (out->divisor + out->offset) % period;
-			phase = timer.phase % period;
-
-			if (phase == setmark) {
-				// Set output
-				timer.nextout |= out_pins[i];
-				if (out->flags & SETTING_TRIG) {
-					// This has not yet happened - fudge
-					trig_start[i] =
-					    Uptime +
-					    config.delay / SYSTEMTICKLEN;
+		if (clocked & (1U << i)) {
+			e = &edge[i];
+			if (e->count == 0) {
+				// Set output unless masked while stopped
+				e->count = e->period;
+				out = &config.output[i];
+				if (!(out->flags & SETTING_RUNMASK) || timer.on) {
+					timer.nextout |= out_pins[i];
+					if (out->flags & SETTING_TRIG) {
+						trig |= out_pins[i];
+					}
 				}
-				// TODO: this requires attention
-				if ((out->flags & SETTING_RUNMASK) && !timer.on) {
-					timer.nextout &= ~out_pins[i];
-				}
-			} else if (phase == clrmark) {
+			} else if (e->count == e->width) {
 				// outputs clear even if trig set
 				timer.nextout |= (out_pins[i] << 16);
 			}
+			e->count--;
 		}
 		++i;
 	} while (i < SETTINGS_NROUTS);
+	if (trig) {
+		stamp_trig(trig);
+	}
+}
+
+// Advance phase and prepare the output word for the next tick
+static void timer_tick(void)
+{
+	if (timer.phase % 96U == 0) {
+		display_midi_blink();
+	}
+	timer.phase++;
+	if (timer.reload) {
+		take_sched();
+		load_edges();
+	}
+	update_nextout();
 }
 
 // Timer update handler
@@ -67,24 +331,118 @@ void timer_update(void)
 {
 	// Update
 	GPIOC->BSRR = timer.nextout;
-	if (timer.phase % 96U == 0) {
-		display_midi_blink();
+	if ((timer.phase & 3U) == 0) {
+		edge_at = uptime_cycles() - TIM2->CNT;
 	}
+
 	// Prepare
-	timer.phase++;
-	update_nextout();
+	timer_tick();
 
 	// Clear interrupt flag
 	TIM2->SR &= ~(TIM_SR_UIF);
 }
 
+// Fill a DMA buffer half with output words
+static void dma_fill(uint32_t first, uint32_t count)
+{
+	uint32_t i = 0;
+	do {
+		dmabuf[first + i] = timer.nextout;
+		timer_tick();
+		++i;
+	} while (i < count);
+}
+
+/* DMA half and full transfer handler
+ *
+ * Each half ends one update before a clock edge, so the edge is one
+ * period after the update that raised this interrupt.
+ */
+void timer_dma(void)
+{
+	uint32_t isr = DMA1->ISR;
+	DMA1->IFCR = DMA_IFCR_CGIF2;
+	edge_at = uptime_cycles() - TIM2->CNT + TIM2->ARR + 1U;
+	if (isr & DMA_ISR_HTIF2) {
+		dma_fill(0, TIMER_DMAHALF);
+	}
+	if (isr & DMA_ISR_TCIF2) {
+		dma_fill(TIMER_DMAHALF, TIMER_DMAHALF);
+	}
+}
+
+// Restart DMA from the start of a freshly filled buffer
+static void dma_prime(void)
+{
+	TIMER_DMACH->CCR &= ~(DMA_CCR_EN);
+	update_nextout();
+	dma_fill(0, TIMER_DMALEN);
+	TIMER_DMACH->CNDTR = TIMER_DMALEN;
+	TIMER_DMACH->CCR |= DMA_CCR_EN;
+}
+
 // halt timer in preparation for a start message
 void timer_preroll(void)
 {
 	TIM2->CR1 &= ~(TIM_CR1_CEN);
+	NVIC_DisableIRQ(TIMER_IRQn);
 	timer.running = 0;
 	timer.phase = 0;
-	update_nextout();
+	trigger_restart();
+	if (timer.reload) {
+		take_sched();
+	}
+	load_edges();
+	if (IS_ENABLED(TIMER_DMA)) {
+		dma_prime();
+	} else {
+		// First word is written by the update generated on roll
+		update_nextout();
+	}
+	NVIC_EnableIRQ(TIMER_IRQn);
+}
+
+/* Stop run masked outputs
+ *
+ * Set edges already prepared for the coming updates are withdrawn,
+ * so the outputs stop at the next update rather than a buffer later.
+ */
+void timer_stop(void)
+{
+	uint32_t mask = 0;
+	uint32_t i = 0;
+	timer.on = 0;
+	do {
+		if (config.output[i].flags & SETTING_RUNMASK) {
+			mask |= out_pins[i];
+		}
+		++i;
+	} while (i < SETTINGS_NROUTS);
+	NVIC_DisableIRQ(TIMER_IRQn);
+	timer.nextout &= ~mask;
+	if (IS_ENABLED(TIMER_DMA)) {
+		i = 0;
+		do {
+			dmabuf[i] &= ~mask;
+			++i;
+		} while (i < TIMER_DMALEN);
+	}
+	NVIC_EnableIRQ(TIMER_IRQn);
+}
+
+/* Compile output edges after a config change
+ *
+ * The new schedule is compiled into the buffer not in use and taken
+ * up by the update handler on its next tick. A pending schedule not
+ * yet taken up is withdrawn and replaced.
+ */
+void timer_reload(void)
+{
+	timer.reload = 0;
+	barrier();
+	compile_sched(&sched[cur ^ 1U]);
+	barrier();
+	timer.reload = 1U;
 }
 
 // Generate a reset event and roll timer
@@ -95,56 +453,119 @@ static void timer_roll(void)
 		TIM2->CNT = 0;
 		TIM2->CR1 |= TIM_CR1_CEN;
 		TIM2->EGR = TIM_EGR_UG;
+		edge_at = uptime_cycles();
 		timer.running = 1U;
 	}
 }
 
-// Handle arrival of a midi timing message
-void timer_clock(struct midi_event *event)
+/* Return cycles from the reference clock edge nearest to at
+ *
+ * Every fourth update is a clock edge, the first at roll. The update
+ * handlers latch the time of an edge, and the result is wrapped to
+ * within two updates of it.
+ */
+static int32_t timer_phase(uint32_t at)
+{
+	int32_t per = (int32_t) (TIM2->ARR + 1U);
+	int32_t err = (int32_t) (at - edge_at);
+	while (err >= per << 1) {
+		err -= per << 2;
+	}
+	while (err < -(per << 1)) {
+		err += per << 2;
+	}
+	return err;
+}
+
+/* Lock the reference clock to a timing message
+ *
+ * Called from the receive interrupt with the core cycle at which the
+ * message started, so that queued traffic does not delay the update.
+ */
+void timer_clock(uint32_t at)
 {
 	static uint32_t lco;
 	static uint32_t bc;
-	uint32_t co = event->clock;
+	static uint32_t acq;
+	static uint64_t rate;	// period in 1/65536 cycles
 
 	if (timer.running) {
-		if (bc > 1) {
-			// temp: track rate and ignore phase
-			uint32_t dt = SYSTEMTICKLEN * (co - lco);
-			uint64_t dc = ((uint64_t) config.delay) << 2;
-			uint32_t nv =
-			    (uint32_t) ((31 * dc + dt + (1U << 6)) >> 7);
-			TRACEVAL(2, nv);
-			config.delay = nv;
-
+		if (bc) {
+			int32_t err = timer_phase(at);
+			if (err > (int32_t) config.delay
+			    || err < -(int32_t) config.delay) {
+				acq = 0;
+			}
+			// Narrow the loop one step per TIMER_ACQUIRE clocks
+			uint32_t shift = TIMER_ACQSHIFT + acq / TIMER_ACQUIRE;
+			if (shift < TIMER_PLLSHIFT) {
+				acq++;
+			} else {
+				shift = TIMER_PLLSHIFT;
+			}
+			uint64_t dr = (uint64_t) (at - lco) << 14;
+			if (bc == 1U) {
+				// Seed rate from the first clock interval
+				rate = dr;
+				acq = 0;
+			} else if (shift == TIMER_ACQSHIFT) {
+				// Rate follows the clock interval while acquiring
+				rate += (uint64_t) ((int64_t) (dr - rate) / 4);
+			} else {
+				// Integral gain of 2^-(2 * shift + 2) per clock
+				rate += (uint64_t) ((int64_t) err * 65536
+						    / (1 << (2U * shift + 4U)));
+			}
+			TRACEVAL(2, (uint32_t) err);
+			config.delay = (uint32_t) (rate >> 16) - 1U;
 			delinv = config.delay / SYSTEMTICKLEN;
-			TIM2->ARR = config.delay;
-			//GPIOC->BSRR = out_pins[1];
-			//trig_start[1] = Uptime;
+
+			// Proportional correction spread over four updates
+			TIM2->ARR = config.delay
+			    + (uint32_t) (err / (int32_t) (1U << (shift + 2U)));
 		}
 	} else {
 		timer_roll();
+		rate = (uint64_t) (config.delay + 1U) << 16;
 		bc = 0;
 	}
 
-	++bc;
-	lco = co;
+	if (bc < 2U) {
+		++bc;
+	}
+	lco = at;
 }
 
 // Prepare timer interface
 void timer_init(void)
 {
-	NVIC_SetPriority(TIM2_IRQn, PRIGROUP0 | PRISUB1);
-	NVIC_EnableIRQ(TIM2_IRQn);
+	NVIC_SetPriority(TIMER_IRQn, TIMER_PRIORITY);
+	NVIC_EnableIRQ(TIMER_IRQn);
 
 	// Reset timer peripheral 
 	RCC->APB1RSTR |= (RCC_APB1RSTR_TIM2RST);
 	RCC->APB1RSTR &= ~(RCC_APB1RSTR_TIM2RST);
 
-	// Enale interrupt on event, shadow ARR register
-	TIM2->DIER |= TIM_DIER_UIE;
+	if (IS_ENABLED(TIMER_DMA)) {
+		// Word transfers from circular buffer to port on update
+		TIMER_DMACH->CCR = 0;
+		TIMER_DMACH->CPAR = DMA_ADDR(&GPIOC->BSRR);
+		TIMER_DMACH->CMAR = DMA_ADDR(dmabuf);
+		TIMER_DMACH->CCR = DMA_CCR_PL_1 | DMA_CCR_MSIZE_1 |
+		    DMA_CCR_PSIZE_1 | DMA_CCR_MINC | DMA_CCR_CIRC |
+		    DMA_CCR_DIR | DMA_CCR_TCIE | DMA_CCR_HTIE;
+		TIM2->DIER |= TIM_DIER_UDE;
+	} else {
+		// Enale interrupt on event
+		TIM2->DIER |= TIM_DIER_UIE;
+	}
+	// Shadow ARR register, trigger starts captured on update
 	TIM2->CR1 = TIM_CR1_ARPE;
+	TIM2->CR2 = TIM_CR2_MMS_1;
 
-	// Set initial delay and enable timer
+	// Set initial delay, prepare outputs and enable timer
 	TIM2->ARR = config.delay;
+	timer_reload();
+	timer_preroll();
 	timer_roll();
 }
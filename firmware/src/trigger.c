@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Trigger pulse timer
+ *
+ * TIM3 counts freely at TRIGGER_CLOCK and its channel 1 compare
+ * interrupt clears outputs as their trigger length elapses. Pulse
+ * widths are exact to the count, regardless of event processing.
+ *
+ * Pulses are started from two contexts. MIDI events set outputs
+ * immediately, so each output holds a single end count and a later
+ * pulse extends an earlier one. The reference clock prepares output
+ * words ahead of time, so its pulses are queued in start order by
+ * the update that writes them. TIM2 update drives TRGO, which channel
+ * 2 captures, and each pulse end is counted from the capture of its
+ * own update.
+ */
+#include "stm32f3xx.h"
+#include "trigger.h"
+#include "settings.h"
+#include "output.h"
+
+#define TRIGGER_PRESCALE	(TRIGGER_DIV - 1U)
+#define TRIGGER_MASK		0xffffU	// 16 bit counter
+#define TRIGGER_LATE		0x1000U	// counts past an end still expired
+
+// Clocked pulse ends queued by the reference clock
+#ifndef TRIGGER_QUEUELEN
+#define TRIGGER_QUEUELEN	32U	// power of 2
+#endif
+struct trigger_pulse {
+	uint32_t update;	// reference clock update setting pins
+	uint32_t end;		// end count, once started
+	uint32_t pins;
+};
+
+/* Single producer ring, consumed by the timer handler
+ *
+ * Pulses from tail to start have an end count, those from start to
+ * head wait for their update. A pulse is dropped when the ring is
+ * full. Clocked outputs are still cleared by their own clear edge
+ * half a period later.
+ */
+static struct trigger_queue {
+	volatile uint32_t head;
+	volatile uint32_t start;
+	volatile uint32_t tail;
+	struct trigger_pulse pulse[TRIGGER_QUEUELEN];
+} queue;
+
+// Reference clock updates captured since roll, less one
+static uint32_t updates;
+
+// Pending event pulse end per output
+static struct trigger_slot {
+	volatile uint32_t end;
+	volatile uint32_t armed;
+} slot[SETTINGS_NROUTS];
+
+// Pins cleared at the end of a pulse
+static uint32_t trigmask;
+
+// Trigger length in counts
+static uint32_t triglen = 1U;
+
+// Return non-zero if count t has been reached at count now
+static uint32_t trigger_due(uint32_t t, uint32_t now)
+{
+	return ((now - t) & TRIGGER_MASK) < TRIGGER_LATE;
+}
+
+// Return counts from now until count t
+static uint32_t trigger_wait(uint32_t t, uint32_t now)
+{
+	return (t - now) & TRIGGER_MASK;
+}
+
+// Start queued pulses set by the update captured at count at
+static void trigger_start(uint32_t at)
+{
+	struct trigger_pulse *p;
+	while (queue.start != queue.head) {
+		p = &queue.pulse[queue.start & (TRIGGER_QUEUELEN - 1U)];
+		if ((int32_t)(p->update - updates) > 0) {
+			break;
+		}
+		p->end = at + triglen;
+		queue.start++;
+	}
+}
+
+// Timer handler - start captured pulses, clear expired outputs
+void trigger_expire(void)
+{
+	struct trigger_slot *s;
+	struct trigger_pulse *p;
+	uint32_t now;
+	uint32_t wait;
+	uint32_t sr = TRIGGER->SR;
+	TRIGGER->SR &= ~(sr & (TIM_SR_CC1IF | TIM_SR_CC2IF | TIM_SR_CC2OF));
+	if (sr & TIM_SR_CC2IF) {
+		// An overcapture lost an update, its pulses start late
+		updates += (sr & TIM_SR_CC2OF) ? 2U : 1U;
+		trigger_start(TRIGGER->CCR2);
+	}
+	do {
+		uint32_t pins = 0;
+		uint32_t i = 0;
+		now = TRIGGER->CNT;
+		wait = TRIGGER_MASK + 1U;
+		do {
+			s = &slot[i];
+			if (s->armed) {
+				if (trigger_due(s->end, now)) {
+					s->armed = 0;
+					pins |= out_pins[i];
+				} else if (trigger_wait(s->end, now) < wait) {
+					wait = trigger_wait(s->end, now);
+				}
+			}
+			++i;
+		} while (i < SETTINGS_NROUTS);
+		while (queue.tail != queue.start) {
+			p = &queue.pulse[queue.tail & (TRIGGER_QUEUELEN - 1U)];
+			if (!trigger_due(p->end, now)) {
+				if (trigger_wait(p->end, now) < wait) {
+					wait = trigger_wait(p->end, now);
+				}
+				break;
+			}
+			pins |= p->pins;
+			queue.tail++;
+		}
+		GPIOC->BRR = pins & trigmask;
+		if (wait > TRIGGER_MASK) {
+			TRIGGER->DIER &= ~(TIM_DIER_CC1IE);
+			return;
+		}
+		TRIGGER->CCR1 = (now + wait) & TRIGGER_MASK;
+		TRIGGER->DIER |= TIM_DIER_CC1IE;
+		// Repeat if the compare count passed while arming
+	} while (((TRIGGER->CNT - now) & TRIGGER_MASK) >= wait);
+}
+
+uint32_t trigger_now(void)
+{
+	return TRIGGER->CNT;
+}
+
+void trigger_event(uint32_t pins)
+{
+	uint32_t end = TRIGGER->CNT + triglen;
+	uint32_t i = 0;
+	pins &= trigmask;
+	if (!pins) {
+		return;
+	}
+	do {
+		if (pins & out_pins[i]) {
+			slot[i].end = end;
+			slot[i].armed = 1U;
+		}
+		++i;
+	} while (i < SETTINGS_NROUTS);
+	NVIC_SetPendingIRQ(TIM3_IRQn);
+}
+
+void trigger_clocked(uint32_t pins, uint32_t update)
+{
+	uint32_t head = queue.head;
+	pins &= trigmask;
+	if (!pins || head - queue.tail == TRIGGER_QUEUELEN) {
+		return;
+	}
+	queue.pulse[head & (TRIGGER_QUEUELEN - 1U)].update = update;
+	queue.pulse[head & (TRIGGER_QUEUELEN - 1U)].pins = pins;
+	barrier();
+	// Started by the handler when the update is captured
+	queue.head = head + 1U;
+}
+
+void trigger_restart(void)
+{
+	NVIC_DisableIRQ(TIM3_IRQn);
+	// Drop pulses for updates that will not come
+	queue.head = queue.start;
+	updates = UINT32_MAX;
+	TRIGGER->SR &= ~(TIM_SR_CC2IF | TIM_SR_CC2OF);
+	NVIC_EnableIRQ(TIM3_IRQn);
+}
+
+void trigger_map(void)
+{
+	struct output_config *out;
+	uint32_t mask = 0;
+	uint32_t i = 0;
+	do {
+		out = &config.output[i];
+		if (out->flags & (SETTING_TRIG | SETTING_CONTINUE)) {
+			mask |= out_pins[i];
+		}
+		++i;
+	} while (i < SETTINGS_NROUTS);
+	trigmask = mask;
+
+	// Trigger length is held in uptimes
+	uint32_t len = config.triglen * TRIGGER_CLOCK / 8000U;
+	triglen = len ? len : 1U;
+}
+
+void trigger_init(void)
+{
+	NVIC_SetPriority(TIM3_IRQn, PRIGROUP0 | PRISUB0);
+	NVIC_EnableIRQ(TIM3_IRQn);
+
+	// Reset timer peripheral
+	RCC->APB1RSTR |= (RCC_APB1RSTR_TIM3RST);
+	RCC->APB1RSTR &= ~(RCC_APB1RSTR_TIM3RST);
+
+	// Free running count at TRIGGER_CLOCK
+	TRIGGER->PSC = TRIGGER_PRESCALE;
+	TRIGGER->ARR = TRIGGER_MASK;
+	TRIGGER->EGR = TIM_EGR_UG;
+
+	// Capture the count at each reference clock update
+	TRIGGER->SMCR = TIM_SMCR_TS_0;	// ITR1, TIM2 TRGO
+	TRIGGER->CCMR1 = TIM_CCMR1_CC2S_0 | TIM_CCMR1_CC2S_1;	// TRC
+	TRIGGER->CCER = TIM_CCER_CC2E;
+	TRIGGER->SR = 0;
+	TRIGGER->DIER = TIM_DIER_CC2IE;
+	TRIGGER->CR1 = TIM_CR1_CEN;
+}
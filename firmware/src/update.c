@@ -0,0 +1,403 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Firmware update over SysEx
+ *
+ * Received chunks fill two RAM page buffers in turn. A buffer is
+ * queued for programming once accepted data runs past its end, and
+ * is free again when written to its update page. The programmer runs
+ * from a deadline in short bursts, so reception carries on while a
+ * page is being written. The blocking routines in flash.c would hold
+ * up PendSV for the length of a page.
+ *
+ * Once the staged image has been checked, a commit record is written
+ * after the presets and the device reset. The loader copies the
+ * staged pages over the application at boot and then clears the
+ * record, so a copy cut short by power loss is repeated on the next
+ * boot.
+ */
+#include "stm32f3xx.h"
+#include "flash.h"
+#include "deadline.h"
+#include "midi.h"
+#include "update.h"
+
+#define UPDATE_REJECT		40U	// chunk rejected
+#define UPDATE_FAIL		41U	// image check or flash error
+
+#ifndef UPDATE_BURST
+#define UPDATE_BURST		8U	// half-words programmed per pass
+#endif
+#define UPDATE_HALFS		(FLASH_PAGESZ / sizeof(uint16_t))
+#define UPDATE_RESETWAIT	80U	// ~10ms for the last reply to be read
+#define UPDATE_MAXSIZE		(FLASH_CODEPAGES * FLASH_PAGESZ)
+
+// RAM page buffer state
+enum update_buf {
+	UPDATE_FREE,		// available for the next page
+	UPDATE_FILL,		// receiving data
+	UPDATE_READY,		// waiting to be programmed
+};
+
+struct update_page {
+	uint32_t page;		// image page number
+	uint32_t state;		// enum update_buf
+	uint16_t half[UPDATE_HALFS];
+};
+
+static struct update_page buf[2];
+
+// Page write in progress
+static struct update_job {
+	volatile const uint16_t *src;
+	volatile uint16_t *dst;
+	struct update_page *from;	// RAM buffer to free when done
+	uint32_t len;		// half-words to program
+	uint32_t half;		// next half-word to program
+	uint32_t erased;	// erase started
+} job;
+
+// Commit record for the loader
+static struct flash_commit record;
+
+static struct update {
+	uint32_t state;		// enum update_state
+	uint32_t size;		// image size in bytes
+	uint32_t fill;		// bytes accepted
+	uint32_t pos;		// bytes received, including open chunk
+	uint32_t open;		// chunk streaming
+	uint32_t skip;		// open chunk rejected
+	uint32_t acc;		// unpacked bits
+	uint32_t bits;		// count of bits in acc
+	uint32_t commit;	// commit requested
+	uint32_t crc;		// expected image CRC-32
+	uint32_t dropped;	// chunks sent while their buffer was busy
+} up;
+
+static struct deadline step;
+
+// Hardware CRC-32 of len words from src, CRC-7 setup is restored
+static uint32_t update_crc(volatile const uint32_t *src, uint32_t len)
+{
+	uint32_t cr = CRC->CR;
+	uint32_t pol = CRC->POL;
+	uint32_t init = CRC->INIT;
+	uint32_t crc;
+	CRC->CR = 0;
+	CRC->POL = CRC32_POLY;
+	CRC->INIT = CRC32_INIT;
+	CRC->CR |= CRC_CR_RESET;
+	do {
+		CRC->DR = *src++;
+		len--;
+	} while (len);
+	crc = CRC->DR;
+	CRC->POL = pol;
+	CRC->INIT = init;
+	CRC->CR = cr;
+	return crc;
+}
+
+// Set write access to the loader, application and commit pages
+static void update_protect(uint32_t ro)
+{
+	uint32_t ap = ro ? RASR_AP_RONX : RASR_AP_RWNX;
+	MPU->RBAR = FLASH_BASE | MPU_RBAR_VALID_Msk | 5U;
+	barrier();
+	MPU->RASR = ap | RASR_TSCB_FLASH | RASR_SZ_32K | RASR_ENABLE;
+	barrier();
+}
+
+// Abandon update and lock flash
+static void update_stop(void)
+{
+	if (up.state == UPDATE_MARK) {
+		update_protect(1U);
+	}
+	up.state = UPDATE_IDLE;
+	up.commit = 0;
+	job.src = NULL;
+	FLASH->CR = 0;
+	FLASH->CR |= FLASH_CR_LOCK;
+}
+
+/* Report progress to the USB host
+ *
+ * The reply holds the image bytes accepted, the count of chunks
+ * dropped and the enum update_state.
+ */
+static void update_status(void)
+{
+	uint8_t msg[7];
+	msg[0] = UPDATE_STATUS;
+	msg[1] = up.fill & MIDI_DATA_MASK;
+	msg[2] = (up.fill >> 7) & MIDI_DATA_MASK;
+	msg[3] = (up.fill >> 14) & MIDI_DATA_MASK;
+	msg[4] = up.dropped & MIDI_DATA_MASK;
+	msg[5] = (up.dropped >> 7) & MIDI_DATA_MASK;
+	msg[6] = (uint8_t) up.state;
+	midi_sysex_send(msg, sizeof(msg));
+}
+
+// Abandon update after a check or flash error
+static void update_fail(void)
+{
+	BREAKPOINT(UPDATE_FAIL);
+	update_stop();
+	update_status();
+}
+
+// Queue filled buffers whose pages are complete
+static void update_ready(void)
+{
+	uint32_t i = 0;
+	do {
+		struct update_page *b = &buf[i];
+		if (b->state == UPDATE_FILL
+		    && ((b->page + 1U) * FLASH_PAGESZ <= up.fill
+			|| up.fill == up.size)) {
+			b->state = UPDATE_READY;
+		}
+		++i;
+	} while (i < 2U);
+}
+
+// Return the buffer for image page, or NULL if it is still in use
+static struct update_page *update_claim(uint32_t page)
+{
+	struct update_page *b = &buf[page & 1U];
+	uint32_t i = 0;
+	if (b->state == UPDATE_FILL && b->page == page) {
+		return b;
+	}
+	if (b->state != UPDATE_FREE) {
+		return NULL;
+	}
+	b->page = page;
+	b->state = UPDATE_FILL;
+	do {
+		b->half[i] = 0xffffU;
+		++i;
+	} while (i < UPDATE_HALFS);
+	return b;
+}
+
+// Select the next page to program, return zero if none
+static uint32_t update_next(void)
+{
+	struct update_page *b = NULL;
+	uint32_t i = 0;
+	if (up.state == UPDATE_RECEIVE) {
+		do {
+			if (buf[i].state == UPDATE_READY
+			    && (b == NULL || buf[i].page < b->page)) {
+				b = &buf[i];
+			}
+			++i;
+		} while (i < 2U);
+		if (b != NULL) {
+			job.src = b->half;
+			job.dst = (volatile uint16_t *)
+			    &FLASHMEM->update[b->page];
+			job.len = UPDATE_HALFS;
+			job.from = b;
+		} else if (up.commit) {
+			// Image complete and staged
+			up.commit = 0;
+			if (update_crc(FLASHMEM->update[0].word, up.size >> 2)
+			    != up.crc) {
+				update_fail();
+				return 0;
+			}
+			// Magic is programmed last, after an erase
+			record.size = up.size;
+			record.crc = up.crc;
+			record.magic = FLASH_COMMITMAGIC;
+			update_protect(0);
+			up.state = UPDATE_MARK;
+			job.src = (volatile const uint16_t *) &record;
+			job.dst = (volatile uint16_t *) COMMIT;
+			job.len = sizeof(record) / sizeof(uint16_t);
+			job.from = NULL;
+		}
+	} else if (up.state == UPDATE_MARK) {
+		// Record written, the loader copies the image on reset
+		if (COMMIT->magic != FLASH_COMMITMAGIC
+		    || COMMIT->size != record.size
+		    || COMMIT->crc != record.crc) {
+			update_fail();
+			return 0;
+		}
+		update_stop();
+		up.state = UPDATE_RESET;
+		update_status();
+		deadline_set(&step, Uptime + UPDATE_RESETWAIT);
+		return 0;
+	}
+	if (job.src == NULL) {
+		return 0;
+	}
+	job.half = 0;
+	job.erased = 0;
+	return 1U;
+}
+
+/* Program a burst of half-words while the controller is idle
+ *
+ * The wheel runs this once a millisecond. A page erase is started
+ * and left to finish by a later pass, while each pass programs up
+ * to UPDATE_BURST half-words, waiting out each write of about 50us,
+ * so PendSV is held for well under a millisecond. A page takes
+ * about 0.2s to stage, and the pass is only rearmed while
+ * there is work left.
+ */
+static void update_step(struct deadline *d, uint32_t now)
+{
+	uint32_t sr = FLASH->SR;
+	uint32_t n = 0;
+	if (up.state == UPDATE_RESET) {
+		NVIC_SystemReset();
+		return;
+	}
+	if (sr & FLASH_SR_BSY) {
+		// Erase in progress
+		deadline_set(d, now + 1U);
+		return;
+	}
+	do {
+		if (sr & (FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPERR)) {
+			FLASH->SR = sr;
+			if (sr & (FLASH_SR_PGERR | FLASH_SR_WRPERR)) {
+				update_fail();
+				return;
+			}
+		}
+		if (job.src == NULL && !update_next()) {
+			return;
+		}
+		if (!job.erased) {
+			job.erased = 1U;
+			FLASH->CR = FLASH_CR_PER;
+			FLASH->AR = (uint32_t) (uintptr_t) job.dst;
+			FLASH->CR |= FLASH_CR_STRT;
+			break;
+		}
+		// Erased half-words are skipped
+		while (job.half < job.len && job.src[job.half] == 0xffffU) {
+			job.half++;
+		}
+		if (job.half < job.len) {
+			FLASH->CR = FLASH_CR_PG;
+			job.dst[job.half] = job.src[job.half];
+			job.half++;
+			do {
+				sr = FLASH->SR;
+			} while (sr & FLASH_SR_BSY);
+		} else {
+			job.src = NULL;
+			if (job.from != NULL) {
+				job.from->state = UPDATE_FREE;
+				update_status();
+			}
+			sr = FLASH->SR;
+		}
+	} while (++n < UPDATE_BURST);
+	deadline_set(d, now + 1U);
+}
+
+void update_begin(uint32_t size)
+{
+	if (size == 0 || size > UPDATE_MAXSIZE || (size & 3U)
+	    || up.state >= UPDATE_MARK) {
+		update_status();
+		return;
+	}
+	up.state = UPDATE_RECEIVE;
+	up.size = size;
+	up.fill = 0;
+	up.pos = 0;
+	up.commit = 0;
+	up.dropped = 0;
+	buf[0].state = UPDATE_FREE;
+	buf[1].state = UPDATE_FREE;
+	job.src = NULL;
+	if ((FLASH->CR & FLASH_CR_LOCK) != 0UL) {
+		FLASH->KEYR = FLASH_KEY1;
+		FLASH->KEYR = FLASH_KEY2;
+	}
+	update_status();
+}
+
+void update_commit(uint32_t crc)
+{
+	if (up.state == UPDATE_RECEIVE && up.fill == up.size) {
+		up.crc = crc;
+		up.commit = 1U;
+		deadline_set(&step, Uptime);
+	} else {
+		update_status();
+	}
+}
+
+uint32_t update_open(struct midi_sysex_config *cfg)
+{
+	uint32_t offset;
+	if (up.open || cfg->idcfg != SYSEX_ID || cfg->data[0] != UPDATE_DATA) {
+		return 0;
+	}
+	offset = cfg->data[1] | (cfg->data[2] << 7) | (cfg->data[3] << 14);
+	up.open = 1U;
+	up.skip = up.state != UPDATE_RECEIVE || offset != up.fill;
+	up.pos = up.fill;
+	up.acc = 0;
+	up.bits = 0;
+	return 1U;
+}
+
+void update_data(uint32_t db)
+{
+	struct update_page *b;
+	if (up.skip) {
+		return;
+	}
+	up.acc |= db << up.bits;
+	up.bits += 7U;
+	if (up.bits < 8U) {
+		return;
+	}
+	b = NULL;
+	if (up.pos < up.size && up.pos - up.fill < FLASH_PAGESZ) {
+		b = update_claim(up.pos / FLASH_PAGESZ);
+		if (b == NULL) {
+			// Sent before its buffer was programmed
+			up.dropped++;
+		}
+	}
+	if (b == NULL) {
+		up.skip = 1U;
+		return;
+	}
+	((uint8_t *) b->half)[up.pos % FLASH_PAGESZ] = (uint8_t) up.acc;
+	up.acc >>= 8;
+	up.bits -= 8U;
+	up.pos++;
+}
+
+void update_close(uint32_t ok)
+{
+	up.open = 0;
+	if (up.skip || !ok) {
+		BREAKPOINT(UPDATE_REJECT);
+		update_status();
+		return;
+	}
+	up.fill = up.pos;
+	update_ready();
+	update_status();
+	deadline_set(&step, Uptime);
+}
+
+void update_init(void)
+{
+	deadline_init(&step, update_step);
+}
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * System heartbeat clock
+ *
+ * SysTick setup and handler advancing the 1/8 ms uptime counter.
+ */
+#include "stm32f3xx.h"
+#include "deadline.h"
+
+// Exported globals
+volatile uint32_t Uptime;
+
+/* ARM SysTick Handler */
+void ms_timer(void)
+{
+	Uptime++;
+	// Flag PENDSV when the next deadline is due
+	if ((int32_t) (Uptime - deadline_wake) >= 0) {
+		PENDSV();
+	}
+}
+
+/* Return core cycles since the uptime clock started, modulo 2^32
+ *
+ * Combines Uptime with the SysTick count. A reload not yet counted
+ * by the handler is detected from the pending flag.
+ */
+uint32_t uptime_cycles(void)
+{
+	uint32_t t;
+	uint32_t val;
+	do {
+		t = Uptime;
+		val = SysTick->VAL;
+		if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+			val = SysTick->VAL;
+			t++;
+		}
+	} while (t != Uptime && t != Uptime + 1U);
+	return t * SYSTEMTICKLEN + (SYSTEMTICKLEN - 1U - val);
+}
+
+// Set handler priority grouping and start the uptime clock
+void uptime_init(void)
+{
+	// Update interrupt priority grouping field
+	NVIC_SetPriorityGrouping(PRIGROUP_4_4);
+
+	// Set PendSV and SVCall to lowest priority
+	NVIC_SetPriority(PendSV_IRQn, PRIGROUP3 | PRISUB2);
+	NVIC_SetPriority(SVCall_IRQn, PRIGROUP3 | PRISUB2);
+	NVIC_SetPriority(SysTick_IRQn, PRIGROUP1 | PRISUB1);
+
+	// Configure the SysTick timer at 1/8 ms, AHB/1
+	Uptime = 0;
+	SysTick->LOAD = SYSTEMTICKLEN - 1U;
+	SysTick->VAL = 0;
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk |
+	    SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+	__DSB();
+}
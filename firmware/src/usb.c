@@ -0,0 +1,617 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * USB Full Speed Device Driver
+ *
+ * Enumeration and standard requests on the default control pipe,
+ * with the MIDI streaming bulk endpoints passed to midi_usb.c once
+ * the device is configured. The MIDI streaming interface has two
+ * alternate settings on the same endpoints, USB-MIDI 1.0 event
+ * packets by default and, in builds with USB_UMP, USB-MIDI 2.0
+ * universal MIDI packets, and selecting either reopens the endpoints.
+ * Without USB_UMP the configuration descriptor ends before the second
+ * setting. The streaming endpoints are double buffered, each
+ * direction in its own endpoint register, so the host may send or
+ * collect one packet while the other is being worked on.
+ * The device is self powered and does not handle suspend.
+ *
+ * Each start of frame is stamped against the core cycle count and
+ * tracked by a phase locked loop, so that bulk transfers, which the
+ * host sends in bursts at the start of a frame, can be placed on the
+ * host's 1 ms frame clock rather than at their interrupt time.
+ *
+ * Control IN data is written to packet memory one packet at a time
+ * directly from the ROM descriptors, except for string descriptors
+ * which are assembled in RAM. Requests with an OUT data stage are
+ * not supported and are stalled, as are all class and vendor
+ * requests.
+ *
+ * Endpoint registers have toggle and clear-by-zero fields, so each
+ * write holds the bits to flip rather than the new value, and writes
+ * one to the CTR flags that are to be kept.
+ */
+#include "stm32f303xe.h"
+#include "flash.h"
+#include "settings.h"
+#include "usb.h"
+#include "midi_usb.h"
+
+#define USB_STALL		32U	// request not supported
+
+// Start of frame tracking
+#define USB_SOF_CYCLES		(SYSTEMCORECLOCK / 1000U)	// nominal frame
+#define USB_SOF_SLEW		(USB_SOF_CYCLES >> 10)	// ~1000 ppm range
+#define USB_SOF_MISS		8U	// frames missed before restart
+#ifndef USB_SOF_SHIFT
+#define USB_SOF_SHIFT		3U	// phase gain 2^-n per frame
+#endif
+
+// Endpoint register toggle fields
+#define USB_EP_TOGGLES	(USB_EP_DTOG_RX | USB_EPRX_STAT | USB_EP_DTOG_TX | USB_EPTX_STAT)
+
+// Control pipe
+static struct usb_ctl {
+	const uint8_t *src;	// IN data remaining
+	uint32_t len;		// IN bytes remaining
+	uint32_t zlp;		// end IN data with a zero length packet
+	uint32_t address;	// address to take after the status stage
+	uint32_t config;	// configuration value
+	uint32_t alt;		// MIDI streaming alternate setting
+	uint8_t buf[2U + 2U * USB_MAXSTRLEN];	// assembled descriptor
+} ctl;
+
+// Start of frame clock
+static struct usb_sof {
+	uint32_t stamp;		// core cycle of the last start of frame
+	uint32_t frac;		// fraction of stamp in 1/256 cycles
+	uint32_t period;	// frame period in 1/256 cycles, 0 if not tracked
+	uint32_t fn;		// frame number of stamp
+} sof;
+
+uint32_t usb_pma_word(uint32_t addr)
+{
+	return USB_PMA(addr) | ((uint32_t) USB_PMA(addr + 2U) << 16);
+}
+
+void usb_pma_put(uint32_t addr, uint32_t val)
+{
+	USB_PMA(addr) = (uint16_t) val;
+	USB_PMA(addr + 2U) = (uint16_t) (val >> 16);
+}
+
+// Copy len bytes from src to packet memory at byte address addr
+static void usb_pma_copy(uint32_t addr, const uint8_t *src, uint32_t len)
+{
+	while (len > 1U) {
+		USB_PMA(addr) = (uint16_t) (src[0] | (src[1] << 8));
+		addr += 2U;
+		src += 2U;
+		len -= 2U;
+	}
+	if (len) {
+		USB_PMA(addr) = src[0];
+	}
+}
+
+// Set endpoint register n to val, with the given toggle field values
+static void usb_ep_set(uint32_t n, uint32_t val)
+{
+	uint32_t cur = USB_EPR(n);
+	USB_EPR_WRITE(n, (val & ~(uint32_t) USB_EP_TOGGLES
+			       & ~(uint32_t) (USB_EP_CTR_RX | USB_EP_CTR_TX))
+		      | ((cur ^ val) & USB_EP_TOGGLES));
+}
+
+// Set the receive status of register n
+static void usb_rx_stat(uint32_t n, uint32_t stat)
+{
+	uint32_t cur = USB_EPR(n);
+	USB_EPR_WRITE(n, ((cur & USB_EPRX_DTOGMASK) ^ stat)
+		      | USB_EP_CTR_RX | USB_EP_CTR_TX);
+}
+
+// Set the transmit status of register n
+static void usb_tx_stat(uint32_t n, uint32_t stat)
+{
+	uint32_t cur = USB_EPR(n);
+	USB_EPR_WRITE(n, ((cur & USB_EPTX_DTOGMASK) ^ stat)
+		      | USB_EP_CTR_RX | USB_EP_CTR_TX);
+}
+
+// Clear the flags in ctr on register n
+static void usb_ep_clear(uint32_t n, uint32_t ctr)
+{
+	uint32_t cur = USB_EPR(n);
+	USB_EPR_WRITE(n, (cur & USB_EPREG_MASK & ~ctr)
+		      | ((USB_EP_CTR_RX | USB_EP_CTR_TX) & ~ctr));
+}
+
+// Return the byte count of the last packet received on register n
+static uint32_t usb_rx_count(uint32_t n)
+{
+	return USB_PMA(USB_COUNT_RX(n)) & USB_COUNT_MASK;
+}
+
+uint32_t usb_db_filled(uint32_t n)
+{
+	return (USB_EPR(n) & USB_EP_DTOG_RX) == 0;
+}
+
+uint32_t usb_db_count(uint32_t n, uint32_t b)
+{
+	return USB_PMA(USB_COUNT_BUF(n, b)) & USB_COUNT_MASK;
+}
+
+/* The software buffer bit is a toggle field, so a single write flips
+ * it without disturbing a change made by the interrupt.
+ */
+void usb_db_release(uint32_t n)
+{
+	uint32_t cur = USB_EPR(n);
+	USB_EPR_WRITE(n, (cur & USB_EPREG_MASK
+			       & ~(uint32_t) (USB_EP_CTR_RX | USB_EP_CTR_TX))
+		      | USB_EP_CTR_RX | USB_EP_CTR_TX | USB_EP_DTOG_TX);
+}
+
+uint32_t usb_db_idle(uint32_t n)
+{
+	uint32_t epr = USB_EPR(n);
+	return !(epr & USB_EP_DTOG_TX) == !(epr & USB_EP_DTOG_RX);
+}
+
+void usb_db_send(uint32_t n, uint32_t b, uint32_t len)
+{
+	uint32_t cur = USB_EPR(n);
+	USB_PMA(USB_COUNT_BUF(n, b)) = (uint16_t) len;
+	USB_EPR_WRITE(n, (cur & USB_EPREG_MASK
+			       & ~(uint32_t) (USB_EP_CTR_RX | USB_EP_CTR_TX))
+		      | USB_EP_CTR_RX | USB_EP_CTR_TX | USB_EP_DTOG_RX);
+}
+
+void usb_lock(void)
+{
+	NVIC_DisableIRQ(USB_LP_CAN_RX0_IRQn);
+	NVIC_DisableIRQ(USB_HP_CAN_TX_IRQn);
+}
+
+void usb_unlock(void)
+{
+	NVIC_EnableIRQ(USB_HP_CAN_TX_IRQn);
+	NVIC_EnableIRQ(USB_LP_CAN_RX0_IRQn);
+}
+
+// Transmit len bytes from the control IN buffer
+static void usb_ctl_tx(uint32_t len)
+{
+	USB_PMA(USB_COUNT_TX(USB_EPR_CTL)) = (uint16_t) len;
+	usb_tx_stat(USB_EPR_CTL, USB_EP_TX_VALID);
+}
+
+uint32_t usb_configured(void)
+{
+	return ctl.config;
+}
+
+uint32_t usb_alternate(void)
+{
+	return ctl.alt;
+}
+
+/* Open the double buffered register for MIDI endpoint address ep
+ *
+ * Both toggles start at DATA0. An OUT endpoint gives the application
+ * the second buffer, so the peripheral may fill the first, while an
+ * IN endpoint starts with nothing to send.
+ */
+static void usb_ep_open(uint32_t ep)
+{
+	if (ep & USB_EP_DIR) {
+		uint32_t n = USB_EPR_MIDIIN;
+		USB_PMA(USB_ADDR_BUF(n, 0)) = USB_PMA_BUF(USB_PMA_MIDITX, 0);
+		USB_PMA(USB_COUNT_BUF(n, 0)) = 0;
+		USB_PMA(USB_ADDR_BUF(n, 1U)) = USB_PMA_BUF(USB_PMA_MIDITX, 1U);
+		USB_PMA(USB_COUNT_BUF(n, 1U)) = 0;
+		usb_ep_set(n, USB_EP_BULK | USB_EP_KIND | USB_EP_TX_VALID
+			   | USB_EP_RX_DIS | (ep & USB_EP_ADDR));
+	} else {
+		uint32_t n = USB_EPR_MIDIOUT;
+		USB_PMA(USB_ADDR_BUF(n, 0)) = USB_PMA_BUF(USB_PMA_MIDIRX, 0);
+		USB_PMA(USB_COUNT_BUF(n, 0)) = USB_RXBLOCKS;
+		USB_PMA(USB_ADDR_BUF(n, 1U)) = USB_PMA_BUF(USB_PMA_MIDIRX, 1U);
+		USB_PMA(USB_COUNT_BUF(n, 1U)) = USB_RXBLOCKS;
+		usb_ep_set(n, USB_EP_BULK | USB_EP_KIND | USB_EP_RX_VALID
+			   | USB_EP_TX_DIS | USB_EP_DTOG_TX | (ep & USB_EP_ADDR));
+	}
+	midi_usb_open(ep);
+}
+
+// Open the MIDI streaming endpoints, or close them if cfg is zero
+static void usb_configure(uint32_t cfg)
+{
+	ctl.config = cfg;
+	ctl.alt = USB_MS_MIDI1;
+	if (cfg) {
+		usb_ep_open(USB_EP_OUT);
+		usb_ep_open(USB_EP_IN);
+	} else {
+		usb_ep_set(USB_EPR_MIDIOUT, 0);
+		usb_ep_set(USB_EPR_MIDIIN, 0);
+		midi_usb_open(USB_EP_OUT);
+		midi_usb_open(USB_EP_IN);
+	}
+}
+
+// Prepare the default control pipe after a bus reset
+static void usb_reset(void)
+{
+	USB->BTABLE = USB_PMA_BTABLE;
+	USB_PMA(USB_ADDR_TX(USB_EPR_CTL)) = USB_PMA_CTLTX;
+	USB_PMA(USB_COUNT_TX(USB_EPR_CTL)) = 0;
+	USB_PMA(USB_ADDR_RX(USB_EPR_CTL)) = USB_PMA_CTLRX;
+	USB_PMA(USB_COUNT_RX(USB_EPR_CTL)) = USB_RXBLOCKS;
+	usb_ep_set(USB_EPR_CTL, USB_EP_CONTROL | USB_EP_RX_VALID | USB_EP_TX_NAK);
+	ctl.len = 0;
+	ctl.zlp = 0;
+	ctl.address = 0;
+	sof.period = 0;
+	if (ctl.config) {
+		usb_configure(0);
+	}
+	USB->DADDR = USB_DADDR_EF;
+}
+
+// Send the next packet of control IN data
+static void usb_ctl_send(void)
+{
+	uint32_t len = ctl.len;
+	if (len > USB_ENDPOINT_SIZE) {
+		len = USB_ENDPOINT_SIZE;
+	}
+	usb_pma_copy(USB_PMA_CTLTX, ctl.src, len);
+	ctl.src += len;
+	ctl.len -= len;
+	if (len < USB_ENDPOINT_SIZE) {
+		ctl.zlp = 0;
+	}
+	usb_ctl_tx(len);
+}
+
+// Start an IN data stage of len bytes, limited to the requested length
+static void usb_ctl_data(const void *src, uint32_t len, uint32_t wlength)
+{
+	ctl.src = src;
+	ctl.zlp = len < wlength;
+	ctl.len = len < wlength ? len : wlength;
+	usb_ctl_send();
+}
+
+// Assemble string descriptor i in the control buffer, return its length
+static uint32_t usb_string(uint32_t i)
+{
+	const struct usb_string *str = &OPTION->usb.string[i];
+	uint32_t len = str->length;
+	uint32_t j = 0;
+	if (len > USB_MAXSTRLEN) {
+		len = USB_MAXSTRLEN;
+	}
+	ctl.buf[0] = (uint8_t) (2U + 2U * len);
+	ctl.buf[1] = USB_STRING;
+	while (j < len) {
+		ctl.buf[2U + 2U * j] = (uint8_t) str->wString[j];
+		ctl.buf[3U + 2U * j] = (uint8_t) (str->wString[j] >> 8);
+		++j;
+	}
+	return 2U + 2U * len;
+}
+
+// Return the register and stall field for endpoint address ep, or zero
+static uint32_t usb_ep_lookup(uint32_t ep, uint32_t *n)
+{
+	if (ctl.config == 0
+	    || (ep & ~(uint32_t) USB_EP_DIR) != (USB_EP_OUT & USB_EP_ADDR)) {
+		return 0;
+	}
+	if (ep & USB_EP_DIR) {
+		*n = USB_EPR_MIDIIN;
+		return USB_EPTX_STAT;
+	}
+	*n = USB_EPR_MIDIOUT;
+	return USB_EPRX_STAT;
+}
+
+// Set or clear an endpoint halt, clearing restarts the endpoint
+static uint32_t usb_ep_halt(uint32_t ep, uint32_t halt)
+{
+	uint32_t n;
+	uint32_t stat = usb_ep_lookup(ep, &n);
+	if (stat == 0) {
+		return USB_STALL;
+	}
+	if (!halt) {
+		usb_ep_open(ep);
+	} else if (stat == USB_EPTX_STAT) {
+		usb_tx_stat(n, USB_EP_TX_STALL);
+	} else {
+		usb_rx_stat(n, USB_EP_RX_STALL);
+	}
+	return 0;
+}
+
+/* Handle a standard request
+ *
+ * Return zero if the request was answered with data or is to be
+ * completed with a zero length status packet.
+ */
+static uint32_t usb_request(const struct usb_setup *req)
+{
+	static uint8_t reply[2];
+	uint32_t rcpt = req->bmRequestType & USB_REQ_RCPT_MASK;
+	uint32_t type = req->wValue >> 8;
+	uint32_t index = req->wValue & 0xffU;
+	uint32_t n;
+
+	if ((req->bmRequestType & USB_REQ_TYPE_MASK) != USB_REQ_STANDARD) {
+		return USB_STALL;
+	}
+	if ((req->bmRequestType & USB_REQ_DIR_IN) == 0 && req->wLength) {
+		return USB_STALL;
+	}
+	switch (req->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		if (type == USB_DEVICE) {
+			usb_ctl_data(&OPTION->usb.device, USB_DEVLEN, req->wLength);
+		} else if (type == USB_CONFIGURATION && index == 0) {
+			usb_ctl_data(&OPTION->usb.configuration,
+				     OPTION->usb.configuration.cfg_wTotalLength,
+				     req->wLength);
+		} else if (type == USB_STRING && index < USB_NRDESCR) {
+			usb_ctl_data(ctl.buf, usb_string(index), req->wLength);
+		} else if (IS_ENABLED(USB_UMP) && type == USB_CS_GR_TRM_BLOCK
+			   && index == USB_MS_UMP && rcpt == USB_REQ_INTERFACE
+			   && req->wIndex == USB_MS_INTERFACE) {
+			usb_ctl_data(&OPTION->usb.terminal,
+				     OPTION->usb.terminal.hdr_wTotalLength,
+				     req->wLength);
+		} else {
+			return USB_STALL;
+		}
+		return 0;
+	case USB_REQ_SET_ADDRESS:
+		ctl.address = USB_DADDR_EF | (req->wValue & USB_DADDR_ADD);
+		break;
+	case USB_REQ_GET_CONFIG:
+		reply[0] = (uint8_t) ctl.config;
+		usb_ctl_data(reply, 1U, req->wLength);
+		return 0;
+	case USB_REQ_SET_CONFIG:
+		if (req->wValue != 0 && req->wValue
+		    != OPTION->usb.configuration.cfg_bConfigurationValue) {
+			return USB_STALL;
+		}
+		usb_configure(req->wValue);
+		break;
+	case USB_REQ_GET_STATUS:
+		reply[0] = 0;
+		reply[1] = 0;
+		if (rcpt == USB_REQ_DEVICE) {
+			if (OPTION->usb.configuration.cfg_bmAttributes
+			    & USB_CFG_ATTR_SELFPWR) {
+				reply[0] = 1U;
+			}
+		} else if (rcpt == USB_REQ_ENDPOINT) {
+			uint32_t stat = usb_ep_lookup(req->wIndex, &n);
+			uint32_t halt = stat == USB_EPTX_STAT
+			    ? USB_EP_TX_STALL : USB_EP_RX_STALL;
+			if (stat) {
+				reply[0] = (USB_EPR(n) & stat) == halt;
+			} else if ((req->wIndex & USB_EP_ADDR) != 0) {
+				return USB_STALL;
+			}
+		} else if (rcpt != USB_REQ_INTERFACE || ctl.config == 0) {
+			return USB_STALL;
+		}
+		usb_ctl_data(reply, 2U, req->wLength);
+		return 0;
+	case USB_REQ_CLEAR_FEATURE:
+	case USB_REQ_SET_FEATURE:
+		if (rcpt != USB_REQ_ENDPOINT || req->wValue != USB_EP_HALT) {
+			return USB_STALL;
+		}
+		if ((req->wIndex & USB_EP_ADDR) == 0) {
+			break;
+		}
+		if (usb_ep_halt(req->wIndex,
+				req->bRequest == USB_REQ_SET_FEATURE)) {
+			return USB_STALL;
+		}
+		break;
+	case USB_REQ_GET_INTERFACE:
+		if (ctl.config == 0
+		    || req->wIndex >= OPTION->usb.configuration.cfg_bNumInterfaces) {
+			return USB_STALL;
+		}
+		reply[0] = (uint8_t) (req->wIndex == USB_MS_INTERFACE ? ctl.alt : 0);
+		usb_ctl_data(reply, 1U, req->wLength);
+		return 0;
+	case USB_REQ_SET_INTERFACE:
+		if (ctl.config == 0
+		    || req->wIndex >= OPTION->usb.configuration.cfg_bNumInterfaces) {
+			return USB_STALL;
+		}
+		if (req->wIndex == USB_MS_INTERFACE
+		    && req->wValue <= USB_MS_LAST) {
+			// Restart both endpoints in the new format
+			ctl.alt = req->wValue;
+			usb_ep_open(USB_EP_OUT);
+			usb_ep_open(USB_EP_IN);
+		} else if (req->wValue != 0) {
+			return USB_STALL;
+		}
+		break;
+	default:
+		return USB_STALL;
+	}
+	// Zero length status
+	usb_ctl_tx(0);
+	return 0;
+}
+
+// Handle a completed transfer on the default control pipe
+static void usb_control(uint32_t epr)
+{
+	if (epr & USB_EP_CTR_TX) {
+		usb_ep_clear(USB_EPR_CTL, USB_EP_CTR_TX);
+		if (ctl.address) {
+			USB->DADDR = (uint16_t) ctl.address;
+			ctl.address = 0;
+		}
+		if (ctl.len || ctl.zlp) {
+			usb_ctl_send();
+		}
+	}
+	if (epr & USB_EP_CTR_RX) {
+		usb_ep_clear(USB_EPR_CTL, USB_EP_CTR_RX);
+		if (epr & USB_EP_SETUP) {
+			struct usb_setup req;
+			req.bmRequestType = (uint8_t) USB_PMA(USB_PMA_CTLRX);
+			req.bRequest = (uint8_t) (USB_PMA(USB_PMA_CTLRX) >> 8);
+			req.wValue = USB_PMA(USB_PMA_CTLRX + 2U);
+			req.wIndex = USB_PMA(USB_PMA_CTLRX + 4U);
+			req.wLength = USB_PMA(USB_PMA_CTLRX + 6U);
+			ctl.len = 0;
+			ctl.zlp = 0;
+			ctl.address = 0;
+			if (usb_rx_count(USB_EPR_CTL) != sizeof(req)
+			    || usb_request(&req)) {
+				BREAKPOINT(USB_STALL);
+				usb_tx_stat(USB_EPR_CTL, USB_EP_TX_STALL);
+				usb_rx_stat(USB_EPR_CTL, USB_EP_RX_STALL);
+				return;
+			}
+		}
+		// Status OUT, or an aborted IN data stage
+		usb_rx_stat(USB_EPR_CTL, USB_EP_RX_VALID);
+	}
+}
+
+/* Track the start of frame seen by the interrupt at core cycle at
+ *
+ * The stamp carries the interrupt latency, so the loop predicts each
+ * frame from the last and takes only a share of the error, with the
+ * period following the host clock. Frames the interrupt was held off
+ * for are counted by frame number, and after a long gap or a large
+ * error the loop restarts from the nominal period.
+ */
+static void usb_sof(uint32_t at)
+{
+	uint32_t fn = USB->FNR & USB_FNR_FN;
+	uint32_t k = (fn - sof.fn) & USB_FNR_FN;
+	sof.fn = fn;
+	if (sof.period && k && k <= USB_SOF_MISS) {
+		uint32_t adv = sof.frac + k * sof.period;
+		uint32_t pred = sof.stamp + (adv >> 8);
+		int32_t err = (int32_t) (at - pred);
+		if (err < (int32_t) USB_SOF_CYCLES / 4
+		    && err > -(int32_t) USB_SOF_CYCLES / 4) {
+			int32_t ph = (int32_t) (adv & 0xffU)
+			    + err * (256 >> USB_SOF_SHIFT);
+			sof.stamp = pred + (uint32_t) (ph >> 8);
+			sof.frac = (uint32_t) ph & 0xffU;
+			sof.period += (uint32_t) err;
+			if (sof.period > (USB_SOF_CYCLES + USB_SOF_SLEW) << 8) {
+				sof.period = (USB_SOF_CYCLES + USB_SOF_SLEW) << 8;
+			} else if (sof.period
+				   < (USB_SOF_CYCLES - USB_SOF_SLEW) << 8) {
+				sof.period = (USB_SOF_CYCLES - USB_SOF_SLEW) << 8;
+			}
+			return;
+		}
+	}
+	sof.stamp = at;
+	sof.frac = 0;
+	sof.period = USB_SOF_CYCLES << 8;
+}
+
+uint32_t usb_frame(uint32_t *stamp)
+{
+	*stamp = sof.stamp;
+	return sof.period >> 8;
+}
+
+/* USB low and high priority interrupts
+ *
+ * Correct transfers on the double buffered endpoints raise the high
+ * priority interrupt. Both run at the same priority, and handle all
+ * correct transfers in the order the peripheral reports them, the
+ * MIDI streaming endpoints through midi_usb.c.
+ */
+void usb_irq(void)
+{
+	uint32_t at = uptime_cycles();
+	uint32_t istr = USB->ISTR;
+	if (istr & USB_ISTR_RESET) {
+		USB->ISTR = (uint16_t) ~USB_ISTR_RESET;
+		usb_reset();
+		return;
+	}
+	if (istr & (USB_ISTR_PMAOVR | USB_ISTR_ERR)) {
+		USB->ISTR = (uint16_t) ~(USB_ISTR_PMAOVR | USB_ISTR_ERR);
+	}
+	// Ahead of transfers, which were sent in the frame it starts
+	if (istr & USB_ISTR_SOF) {
+		USB->ISTR = (uint16_t) ~USB_ISTR_SOF;
+		usb_sof(at);
+	}
+	while (istr & USB_ISTR_CTR) {
+		uint32_t n = istr & USB_ISTR_EP_ID;
+		uint32_t epr = USB_EPR(n);
+		if (n == USB_EPR_CTL) {
+			usb_control(epr);
+		} else if (n == USB_EPR_MIDIOUT && (epr & USB_EP_CTR_RX)) {
+			usb_ep_clear(n, USB_EP_CTR_RX);
+			midi_usb_receive();
+		} else if (n == USB_EPR_MIDIIN && (epr & USB_EP_CTR_TX)) {
+			usb_ep_clear(n, USB_EP_CTR_TX);
+			midi_usb_sent();
+		} else {
+			usb_ep_clear(n, USB_EP_CTR_RX | USB_EP_CTR_TX);
+		}
+		istr = USB->ISTR;
+	}
+}
+
+void usb_init(void)
+{
+	ctl.config = 0;
+	ctl.alt = USB_MS_MIDI1;
+	ctl.len = 0;
+	ctl.zlp = 0;
+	ctl.address = 0;
+	sof.period = 0;
+
+	RCC->APB1ENR |= RCC_APB1ENR_USBEN;
+	barrier();
+
+	// Power up the transceiver held in reset, then release it
+	USB->CNTR = USB_CNTR_FRES;
+	delay_uptime(1U);
+	USB->CNTR = 0;
+	USB->ISTR = 0;
+	USB->BTABLE = USB_PMA_BTABLE;
+	USB->CNTR = USB_CNTR_CTRM | USB_CNTR_RESETM | USB_CNTR_SOFM;
+	// Group of UART5, so the two never nest in system_transport()
+	NVIC_SetPriority(USB_LP_CAN_RX0_IRQn, PRIGROUP2 | PRISUB2);
+	NVIC_SetPriority(USB_HP_CAN_TX_IRQn, PRIGROUP2 | PRISUB2);
+	NVIC_EnableIRQ(USB_LP_CAN_RX0_IRQn);
+	NVIC_EnableIRQ(USB_HP_CAN_TX_IRQn);
+
+	// Force re-enumeration by holding DP low, then hand it to USB
+	GPIOA->BSRR = GPIO_BSRR_BR_12;
+	uint32_t nm = GPIOA->MODER
+	    & ~(GPIO_MODER_MODER11_Msk | GPIO_MODER_MODER12_Msk);
+	GPIOA->MODER = nm | (0x1 << GPIO_MODER_MODER12_Pos)
+	    | (0x2 << GPIO_MODER_MODER11_Pos);
+	delay_ms(6);
+	GPIOA->MODER = nm | (0x2 << GPIO_MODER_MODER12_Pos)
+	    | (0x2 << GPIO_MODER_MODER11_Pos);
+}
@@ -38,15 +38,15 @@ void (*vtable[])(void) = {
 	undefined_handler,	// EXTI3_IRQHandler
 	undefined_handler,	// EXTI4_IRQHandler
 	undefined_handler,	// DMA1_Channel1_IRQHandler
-	undefined_handler,	// DMA1_Channel2_IRQHandler
+	timer_dma,		// DMA1_Channel2_IRQHandler
 	undefined_handler,	// DMA1_Channel3_IRQHandler
 	undefined_handler,	// DMA1_Channel4_IRQHandler
 	undefined_handler,	// DMA1_Channel5_IRQHandler
 	undefined_handler,	// DMA1_Channel6_IRQHandler
 	undefined_handler,	// DMA1_Channel7_IRQHandler
 	undefined_handler,	// ADC1_2_IRQHandler
-	undefined_handler,	// USB_HP_CAN_TX_IRQHandler
-	undefined_handler,	// USB_LP_CAN_RX0_IRQHandler
+	usb_irq,		// USB_HP_CAN_TX_IRQHandler
+	usb_irq,		// USB_LP_CAN_RX0_IRQHandler
 	undefined_handler,	// CAN_RX1_IRQHandler
 	undefined_handler,	// CAN_SCE_IRQHandler
 	undefined_handler,	// EXTI9_5_IRQHandler
@@ -55,7 +55,7 @@ void (*vtable[])(void) = {
 	undefined_handler,	// TIM1_TRG_COM_TIM17_IRQHandler
 	undefined_handler,	// TIM1_CC_IRQHandler
 	timer_update,		// TIM2_IRQHandler
-	undefined_handler,	// TIM3_IRQHandler
+	trigger_expire,		// TIM3_IRQHandler
 	undefined_handler,	// TIM4_IRQHandler
 	undefined_handler,	// I2C1_EV_IRQHandler
 	undefined_handler,	// I2C1_ER_IRQHandler
@@ -6,8 +6,8 @@ Crude SysEx settings editor for syncbox
 
 """
 
-from struct import pack_into
-from math import gcd
+from struct import pack_into, unpack_from
+from math import gcd, ceil
 from time import sleep
 import sys
 import argparse
@@ -26,6 +26,20 @@ COMMAND_GENERAL = 0x4
 COMMAND_GENERALREQ = 0x14
 COMMAND_OUTPUT = 0x5
 COMMAND_OUTPUTREQ = 0x15
+COMMAND_UPDATEBEGIN = 0x7
+COMMAND_UPDATEDATA = 0x8
+COMMAND_UPDATECOMMIT = 0x9
+COMMAND_UPDATESTATUS = 0xa
+
+# Firmware Update Constants
+FLASH_PAGESZ = 0x800
+UPDATE_OFFSET = FLASH_PAGESZ
+UPDATE_MAXSIZE = 8 * FLASH_PAGESZ
+UPDATE_PAGEWAIT = 0.25  # a page is erased and written in about 0.2 s
+UPDATE_STATUSWAIT = 1.0  # longest wait for a status reply
+UPDATE_COMMITWAIT = 5.0  # image check and commit record write
+UPDATE_RECEIVE = 1
+UPDATE_RESET = 3
 
 # Config Constants
 FLAG_CLOCK = 1 << 0
@@ -635,6 +649,149 @@ def unmk_output(cfg, onum):
     return cr
 
 
+def crc32stm(image):
+    """Return STM32 hardware CRC-32 over the words in image"""
+    r = 0xffffffff
+    for i in range(0, len(image), 4):
+        r ^= image[i] | image[i + 1] << 8 | image[i + 2] << 16 | image[
+            i + 3] << 24
+        for b in range(0, 32):
+            if r & 0x80000000:
+                r = ((r << 1) ^ 0x04c11db7) & 0xffffffff
+            else:
+                r = (r << 1) & 0xffffffff
+    return r
+
+
+def mk_update(cmd, value, count):
+    """Return a SysEx update message with value packed in count bytes"""
+    msg = bytearray(count + 8)
+    msg[0] = 0xf0
+    pack_into('<L', msg, 1, SYSID)
+    msg[5] = cmd
+    for i in range(0, count):
+        msg[6 + i] = (value >> (7 * i)) & 0x7f
+    msg[-2] = crc7mmc(msg[1:-2])
+    msg[-1] = 0xf7
+    return msg
+
+
+def mk_updatedata(image, offset, length):
+    """Return a SysEx update data message for a chunk of image"""
+    msg = mk_update(COMMAND_UPDATEDATA, offset, 3)[0:-2]
+    acc = 0
+    bits = 0
+    for b in image[offset:offset + length]:
+        acc |= b << bits
+        bits += 8
+        while bits >= 7:
+            msg.append(acc & 0x7f)
+            acc >>= 7
+            bits -= 7
+    if bits:
+        msg.append(acc & 0x7f)
+    msg.append(crc7mmc(msg[1:]))
+    msg.append(0xf7)
+    return msg
+
+
+def load_firmware(filename):
+    """Return the application image from a firmware binary"""
+    with open(filename, 'rb') as f:
+        fw = f.read()
+    image = fw[UPDATE_OFFSET:UPDATE_OFFSET + UPDATE_MAXSIZE]
+    if len(image) == 0 or len(image) & 3:
+        raise RuntimeError('Invalid firmware image')
+    return image
+
+
+def unmk_status(data):
+    """Return (fill, dropped, state) from an update status reply"""
+    if len(data) != 12 or unpack_from('<L', bytes(data), 0)[0] != SYSID:
+        return None
+    if data[4] != COMMAND_UPDATESTATUS or crc7mmc(data[0:11]) != data[11]:
+        return None
+    return (data[5] | data[6] << 7 | data[7] << 14, data[8] | data[9] << 7,
+            data[10])
+
+
+def wait_status(iport, timeout):
+    """Return the next update status reply, or None after timeout"""
+    count = 0
+    while count < timeout * 100:
+        msg = iport.poll()
+        if msg and msg.type == 'sysex':
+            st = unmk_status(msg.data)
+            if st is not None:
+                return st
+        elif not msg:
+            count += 1
+            sleep(0.01)
+    return None
+
+
+def send_firmware_usb(oport, iport, image):
+    """Send image to device, pacing chunks on its status replies"""
+    while iport.poll():
+        pass
+    print('Sending firmware update', file=sys.stderr)
+    oport.send(
+        Message.from_bytes(mk_update(COMMAND_UPDATEBEGIN, len(image), 3)))
+    st = wait_status(iport, UPDATE_STATUSWAIT)
+    if st is None or st[2] != UPDATE_RECEIVE:
+        raise RuntimeError('Update not started by device')
+    offset = 0
+    while offset < len(image):
+        length = min(FLASH_PAGESZ, len(image) - offset)
+        while iport.poll():
+            pass
+        oport.send(Message.from_bytes(mk_updatedata(image, offset, length)))
+        st = wait_status(iport, UPDATE_STATUSWAIT)
+        if st is None or st[2] != UPDATE_RECEIVE:
+            raise RuntimeError('Update abandoned by device')
+        if st[0] >= offset + length:
+            offset += length
+        else:
+            # dropped while both page buffers were being written, or
+            # rejected, send again once a buffer is free
+            wait_status(iport, UPDATE_PAGEWAIT)
+    if st[1]:
+        print('Resent %d chunks dropped by device' % (st[1], ),
+              file=sys.stderr)
+    oport.send(
+        Message.from_bytes(
+            mk_update(COMMAND_UPDATECOMMIT, crc32stm(image), 5)))
+    # pages still being written are reported before the commit
+    while st is not None and st[2] == UPDATE_RECEIVE:
+        st = wait_status(iport, UPDATE_COMMITWAIT)
+    if st is None:
+        raise RuntimeError('Timeout waiting for update commit')
+    if st[2] != UPDATE_RESET:
+        raise RuntimeError('Firmware image rejected by device')
+    print('Update committed, device restarting', file=sys.stderr)
+
+
+def send_firmware(port, image):
+    """Send image to device one flash page at a time"""
+    print('Sending firmware update', file=sys.stderr)
+    port.send(
+        Message.from_bytes(mk_update(COMMAND_UPDATEBEGIN, len(image), 3)))
+    for offset in range(0, len(image), FLASH_PAGESZ):
+        length = min(FLASH_PAGESZ, len(image) - offset)
+        port.send(Message.from_bytes(mk_updatedata(image, offset, length)))
+        # no reply over UART, allow time for the page to be written
+        sleep(UPDATE_PAGEWAIT)
+    port.send(
+        Message.from_bytes(
+            mk_update(COMMAND_UPDATECOMMIT, crc32stm(image), 5)))
+    # status replies are only sent over USB
+    pages = (len(image) + FLASH_PAGESZ - 1) // FLASH_PAGESZ
+    print('Warning: Update sent but not verified, device restarts in'
+          ' about %d s if the image was accepted' %
+          (ceil(pages * UPDATE_PAGEWAIT), ),
+          file=sys.stderr)
+
+
 def load_config(filename):
     """Return file config merged with defaults and separate file config"""
     cr = {'general': {}, 'output': {}}
@@ -876,6 +1033,10 @@ def main():
                        '--update',
                        action='store_true',
                        help='update configuration on device')
+    group.add_argument('-f',
+                       '--firmware',
+                       action='store_true',
+                       help='update device firmware from binary file')
     parser.add_argument('-l',
                         '--list',
                         action='store_true',
@@ -999,6 +1160,21 @@ def main():
         except Exception as e:
             print('Error updating configuration:', e, file=sys.stderr)
             return -1
+    elif args.firmware:
+        try:
+            if not args.file or not os.path.exists(args.file):
+                print('Error: Firmware file not found', file=sys.stderr)
+                return -1
+            image = load_firmware(args.file)
+            if args.uart:
+                send_firmware(UartMidi(args.uart), image)
+            else:
+                with open_input(args.port) as ip:
+                    with open_output(args.port) as op:
+                        send_firmware_usb(op, ip, image)
+        except Exception as e:
+            print('Error updating firmware:', e, file=sys.stderr)
+            return -1
     elif args.create:
         try:
             if args.file == '-':